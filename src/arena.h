@@ -0,0 +1,190 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+// Bump allocation for trees that are freed all at once.
+// Objects in an arena are never destroyed one by one: they must be
+// trivially destructible, and their memory is released with the arena, in
+// O(chunks).
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class Arena {
+ public:
+  Arena() = default;
+  ~Arena() = default;
+
+  // disallow copy
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns `size` bytes aligned to `align`, a power of 2 up to 16.
+  auto Allocate(size_t size, size_t align) -> void * {
+    const size_t pos = (this->used_ + align - 1) & ~(align - 1);
+    if (pos + size > this->capacity_) {
+      return this->Grow(size);
+    }
+    this->used_ = pos + size;
+    return this->chunk_ + pos;
+  }
+
+  template <typename T, typename... Args>
+  auto New(Args &&...args) -> T * {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "objects in an arena are never destroyed");
+    return new (this->Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  // Returns storage for `n` objects, which are not constructed.
+  template <typename T>
+  auto AllocateArray(size_t n) -> T * {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "objects in an arena are never destroyed");
+    return static_cast<T *>(this->Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  // Keep `other` until this arena is freed, e.g. an arena filled by
+  // another thread. Vectors in it can still grow.
+  auto Adopt(std::unique_ptr<Arena> other) -> void {
+    this->adopted_.push_back(std::move(other));
+  }
+
+  // Returns the number of bytes of the chunks.
+  // Adopted arenas are included.
+  auto BytesReserved() const -> size_t {
+    size_t reserved = this->reserved_;
+    for (const auto &arena : this->adopted_) {
+      reserved += arena->BytesReserved();
+    }
+    return reserved;
+  }
+  auto NumChunks() const -> size_t {
+    size_t num_chunks = this->chunks_.size();
+    for (const auto &arena : this->adopted_) {
+      num_chunks += arena->NumChunks();
+    }
+    return num_chunks;
+  }
+
+ private:
+  // chunks double in size, from 64KB up to 4MB.
+  static constexpr size_t min_chunk_size = 64 * 1024;
+  static constexpr size_t max_chunk_size = 4 * 1024 * 1024;
+
+  // Start a chunk with room for `size` bytes, and allocate them.
+  auto Grow(size_t size) -> void * {
+    size_t chunk_size = this->next_chunk_size_;
+    if (size > chunk_size) {
+      // too large to share a chunk.
+      chunk_size = size;
+    } else if (this->next_chunk_size_ < max_chunk_size) {
+      this->next_chunk_size_ *= 2;
+    }
+    // new[] aligns to at least 16.
+    this->chunks_.emplace_back(new char[chunk_size]);
+    this->reserved_ += chunk_size;
+    this->chunk_ = this->chunks_.back().get();
+    this->capacity_ = chunk_size;
+    this->used_ = size;
+    return this->chunk_;
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  char *chunk_{nullptr};
+  size_t used_{0};
+  size_t capacity_{0};
+  size_t next_chunk_size_{min_chunk_size};
+  size_t reserved_{0};
+  std::vector<std::unique_ptr<Arena>> adopted_;
+};
+
+// A growable array whose storage is in an arena. Growing it leaves the old
+// storage to the arena. Copies share the storage.
+template <typename T>
+class ArenaVector {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "elements are moved with memcpy");
+
+ public:
+  ArenaVector() = default;
+  explicit ArenaVector(Arena *arena): arena_(arena) {}
+  // Copy `n` elements from `data`.
+  ArenaVector(Arena *arena, const T *data, size_t n): arena_(arena) {
+    this->Assign(data, n);
+  }
+
+  auto size() const -> size_t { return this->size_; }
+  auto empty() const -> bool { return this->size_ == 0; }
+  auto data() const -> T * { return this->data_; }
+
+  auto operator[](size_t idx) const -> T & {
+    assert(idx < this->size_);
+    return this->data_[idx];
+  }
+  auto front() const -> T & { return (*this)[0]; }
+  auto back() const -> T & { return (*this)[this->size_ - 1]; }
+
+  auto begin() const -> T * { return this->data_; }
+  auto end() const -> T * { return this->data_ + this->size_; }
+
+  auto push_back(const T &value) -> void {
+    if (this->size_ == this->capacity_) {
+      this->Reserve(this->capacity_ ? 2 * this->capacity_ : 4);
+    }
+    this->data_[this->size_++] = value;
+  }
+
+  // Elements past the current size are value-initialized.
+  auto resize(size_t n) -> void {
+    if (n > this->capacity_) {
+      this->Reserve(n);
+    }
+    for (size_t i = this->size_; i < n; i++) {
+      new (this->data_ + i) T();
+    }
+    this->size_ = static_cast<uint32_t>(n);
+  }
+
+  auto clear() -> void { this->size_ = 0; }
+
+  // Replace the elements with `n` elements from `data`. The storage is
+  // reused if it is large enough.
+  auto Assign(const T *data, size_t n) -> void {
+    if (n > this->capacity_) {
+      this->data_ = nullptr;
+      this->size_ = this->capacity_ = 0;
+      this->Reserve(n);
+    }
+    if (n > 0) {
+      memmove(this->data_, data, n * sizeof(T));
+    }
+    this->size_ = static_cast<uint32_t>(n);
+  }
+
+  auto GetArena() const -> Arena * { return this->arena_; }
+
+ private:
+  auto Reserve(size_t n) -> void {
+    assert(this->arena_ != nullptr);
+    T *data = this->arena_->AllocateArray<T>(n);
+    if (this->size_ > 0) {
+      memcpy(data, this->data_, this->size_ * sizeof(T));
+    }
+    this->data_ = data;
+    this->capacity_ = static_cast<uint32_t>(n);
+  }
+
+  Arena *arena_{nullptr};
+  T *data_{nullptr};
+  uint32_t size_{0};
+  uint32_t capacity_{0};
+};
+
+#endif // __ARENA_H__
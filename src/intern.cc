@@ -0,0 +1,111 @@
+#include "intern.h"
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+namespace Lex {
+
+// atom = ((index in shard + 1) << shard_bits) | shard
+// so that no name gets null_atom.
+
+auto Interner::Shard::Store(std::string_view name) -> std::string_view {
+  if (name.size() > block_size) {
+    // too large to share a block.
+    this->blocks.emplace_back(new char[name.size()]);
+    memcpy(this->blocks.back().get(), name.data(), name.size());
+    return std::string_view(this->blocks.back().get(), name.size());
+  }
+
+  if (this->block_used + name.size() > block_size) {
+    this->blocks.emplace_back(new char[block_size]);
+    this->block_used = 0;
+  }
+  char *dst = this->blocks.back().get() + this->block_used;
+  memcpy(dst, name.data(), name.size());
+  this->block_used += name.size();
+  return std::string_view(dst, name.size());
+}
+
+auto Interner::Intern(std::string_view name) -> Atom {
+  const size_t hash = std::hash<std::string_view>{}(name);
+  const size_t idx = hash & (num_shards - 1);
+  Shard &shard = this->shards_[idx];
+
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.atoms.find(name);
+    if (it != shard.atoms.end()) {
+      return it->second;
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  // another thread may have added it.
+  auto it = shard.atoms.find(name);
+  if (it != shard.atoms.end()) {
+    return it->second;
+  }
+
+  if (shard.names.size() + 1 >= (size_t{1} << (32 - shard_bits))) {
+    throw std::runtime_error("Too many names to intern");
+  }
+  const std::string_view text = shard.Store(name);
+  shard.names.push_back(text);
+  const Atom atom = static_cast<Atom>((shard.names.size() << shard_bits) | idx);
+  shard.atoms.emplace(text, atom);
+  return atom;
+}
+
+auto Interner::Find(std::string_view name) const -> Atom {
+  const size_t hash = std::hash<std::string_view>{}(name);
+  const Shard &shard = this->shards_[hash & (num_shards - 1)];
+
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  auto it = shard.atoms.find(name);
+  return it != shard.atoms.end() ? it->second : null_atom;
+}
+
+auto Interner::Text(Atom atom) const -> std::string_view {
+  assert(atom != null_atom);
+  const Shard &shard = this->shards_[atom & (num_shards - 1)];
+  const size_t idx = (atom >> shard_bits) - 1;
+
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  assert(idx < shard.names.size());
+  return shard.names[idx];
+}
+
+auto Interner::Size() const -> size_t {
+  size_t ret = 0;
+  for (const auto &shard : this->shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    ret += shard.names.size();
+  }
+  return ret;
+}
+
+auto AtomCache::Intern(std::string_view name) -> Atom {
+  if (this->slots_.empty()) {
+    this->slots_.resize(cache_size);
+  }
+  uint32_t hash = name.size();
+  for (const char ch : name) {
+    hash = hash * 31 + static_cast<uint8_t>(ch);
+  }
+  auto &slot = this->slots_[hash & (cache_size - 1)];
+  if (slot.first != name) {
+    slot.second = Lex::Intern(name);
+    slot.first = AtomText(slot.second);
+  }
+  return slot.second;
+}
+
+auto GlobalInterner() -> Interner & {
+  // never destroyed, atoms may be used until exit.
+  static Interner *interner = new Interner();
+  return *interner;
+}
+
+} // namespace Lex
@@ -0,0 +1,97 @@
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+// Interning of identifiers.
+// Each distinct name is stored once and gets a 32-bit atom, so that names
+// can be hashed and compared as integers. Atoms are never freed, and the
+// memory used grows with the number of distinct names only.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Lex {
+
+typedef uint32_t Atom;
+
+// not the atom of any name.
+constexpr Atom null_atom = 0;
+
+// Thread-safe string interner.
+// Names are spread over shards by hash, each with its own lock, so that
+// threads tokenizing different files rarely wait for each other.
+class Interner {
+ public:
+  Interner() = default;
+  ~Interner() = default;
+
+  // disallow copy
+  Interner(const Interner &) = delete;
+  Interner &operator=(const Interner &) = delete;
+
+  // Returns the atom of `name`, adding it if it is new.
+  auto Intern(std::string_view name) -> Atom;
+
+  // Returns the atom of `name`, or null_atom if it was never interned.
+  auto Find(std::string_view name) const -> Atom;
+
+  // Returns the name of `atom`, which stays valid as long as the interner.
+  auto Text(Atom atom) const -> std::string_view;
+
+  // Returns the number of distinct names.
+  auto Size() const -> size_t;
+
+ private:
+  static constexpr size_t shard_bits = 6;
+  static constexpr size_t num_shards = 1 << shard_bits;
+  // names are copied into blocks of this size.
+  static constexpr size_t block_size = 64 * 1024;
+
+  struct Shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string_view, Atom> atoms;
+    std::vector<std::string_view> names;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used{block_size};
+
+    // Copy `name` into the blocks of the shard.
+    auto Store(std::string_view name) -> std::string_view;
+  };
+
+  Shard shards_[num_shards];
+};
+
+// Interner used by the tokenizer.
+auto GlobalInterner() -> Interner &;
+
+inline auto Intern(std::string_view name) -> Atom {
+  return GlobalInterner().Intern(name);
+}
+
+inline auto AtomText(Atom atom) -> std::string_view {
+  return GlobalInterner().Text(atom);
+}
+
+// Recently interned names, in front of the global interner, so that most
+// lookups take no lock. Not thread-safe: use one per thread.
+class AtomCache {
+ public:
+  AtomCache() = default;
+  ~AtomCache() = default;
+
+  auto Intern(std::string_view name) -> Atom;
+
+ private:
+  static constexpr size_t cache_size = 1024;
+  // indexed by a cheap hash. the names are owned by the interner.
+  std::vector<std::pair<std::string_view, Atom>> slots_;
+};
+
+} // namespace Lex
+
+#endif // __INTERN_H__
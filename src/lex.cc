@@ -1,17 +1,22 @@
 #include "lex.h"
 #include "utils.h"
+#include "scan.h"
+#include "visit.h"
 #include <cassert>
 #include <cstdint>
 #include <sstream>
 #include <stack>
 #include <utility>
 #include <cctype>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <unistd.h>
 
 namespace Lex {
 
-// line number
-static uint32_t lno = 0;
-
 static const char *token_names[] = {
   "null",
   "alpha",
@@ -97,570 +102,783 @@ const char *GetNameOfLabel(TokenLabel label) {
   return token_names[static_cast<int>(label)];
 }
 
-static TokenLabel GetLabelOfChar(char ch) {
-  switch (ch) {
-  case (';'): {
-    return TokenLabel::TSEMICOLON;
-  }
-  case ('('): {
-    return TokenLabel::TLEFTPARENT;
-  }
-  case (')'): {
-    return TokenLabel::TRIGHTPARENT;
+// Character classes of the scanner. Every byte of the input maps to exactly
+// one class, and the scanner dispatches on the class of the first byte of a
+// token instead of testing characters one by one.
+enum CharClass : uint8_t {
+  CNULL = 0,  // not part of any token: blanks, '@', '$', non-ascii, etc.
+  CNEWLINE,   // '\n'
+  CIDENT,     // [a-zA-Z0-9_]
+  CQUOTE,     // '
+  CDOUBLEQUOTE, // "
+  CSHARP,     // #, preprocessor commands
+  CPUNCT,     // single-char tokens, see ScannerTables::punct
+  // operators, which may be followed by a second char, see
+  // ScannerTables::op_pair. Keep them last.
+  COP_ADD,    // +
+  COP_SUB,    // -
+  COP_MUL,    // *
+  COP_DIV,    // /
+  COP_REM,    // %
+  COP_XOR,    // ^
+  COP_AND,    // &
+  COP_OR,     // |
+  COP_ASSIGN, // =
+  COP_NOT,    // !
+  COP_LE,     // <
+  COP_GE,     // >
+  CNUM_CLASSES,
+};
+
+static constexpr int num_operators = CNUM_CLASSES - COP_ADD;
+
+struct ScannerTables {
+  // character class of each byte
+  CharClass cclass[256];
+  // label of single-char tokens
+  TokenLabel punct[256];
+  // label of an operator when it is not followed by a matching char
+  TokenLabel op_single[num_operators];
+  // state transition of an operator on the class of the next char.
+  // TNULL if the two chars do not form an operator.
+  TokenLabel op_pair[num_operators][CNUM_CLASSES];
+};
+
+static constexpr auto MakeScannerTables() -> ScannerTables {
+  ScannerTables t{};
+  for (int ch = 0; ch < 256; ch++) {
+    t.cclass[ch] = CNULL;
+    t.punct[ch] = TokenLabel::TNULL;
+  }
+  for (int ch = 'a'; ch <= 'z'; ch++) { t.cclass[ch] = CIDENT; }
+  for (int ch = 'A'; ch <= 'Z'; ch++) { t.cclass[ch] = CIDENT; }
+  for (int ch = '0'; ch <= '9'; ch++) { t.cclass[ch] = CIDENT; }
+  t.cclass[static_cast<int>('_')] = CIDENT;
+  t.cclass[static_cast<int>('\n')] = CNEWLINE;
+  t.cclass[static_cast<int>('\'')] = CQUOTE;
+  t.cclass[static_cast<int>('\"')] = CDOUBLEQUOTE;
+  t.cclass[static_cast<int>('#')] = CSHARP;
+
+  const struct { char ch; TokenLabel label; } puncts[] = {
+    {';', TokenLabel::TSEMICOLON},
+    {'(', TokenLabel::TLEFTPARENT},
+    {')', TokenLabel::TRIGHTPARENT},
+    {'[', TokenLabel::TLEFTSQ},
+    {']', TokenLabel::TRIGHTSQ},
+    {'{', TokenLabel::TLEFTBRACKET},
+    {'}', TokenLabel::TRIGHTBRACKET},
+    {':', TokenLabel::TCOLON},
+    {'?', TokenLabel::TQUESTION},
+    {',', TokenLabel::TCOMMA},
+    {'.', TokenLabel::TDOT},
+    {'~', TokenLabel::TFLIP},
+  };
+  for (const auto &p : puncts) {
+    t.cclass[static_cast<int>(p.ch)] = CPUNCT;
+    t.punct[static_cast<int>(p.ch)] = p.label;
+  }
+
+  const struct { char ch; CharClass cc; TokenLabel label; } ops[] = {
+    {'+', COP_ADD, TokenLabel::TADD},
+    {'-', COP_SUB, TokenLabel::TSUB},
+    {'*', COP_MUL, TokenLabel::TMUL},
+    {'/', COP_DIV, TokenLabel::TDIV},
+    {'%', COP_REM, TokenLabel::TREM},
+    {'^', COP_XOR, TokenLabel::TXOR},
+    {'&', COP_AND, TokenLabel::TADRP},
+    {'|', COP_OR, TokenLabel::TPIPE},
+    {'=', COP_ASSIGN, TokenLabel::TASSIGN},
+    {'!', COP_NOT, TokenLabel::TNOT},
+    {'<', COP_LE, TokenLabel::TLE},
+    {'>', COP_GE, TokenLabel::TGE},
+  };
+  for (const auto &op : ops) {
+    t.cclass[static_cast<int>(op.ch)] = op.cc;
+    t.op_single[op.cc - COP_ADD] = op.label;
+    for (int cc = 0; cc < CNUM_CLASSES; cc++) {
+      t.op_pair[op.cc - COP_ADD][cc] = TokenLabel::TNULL;
+    }
+  }
+
+  const struct { CharClass first, second; TokenLabel label; } pairs[] = {
+    {COP_ADD, COP_ADD, TokenLabel::TINCR},
+    {COP_ADD, COP_ASSIGN, TokenLabel::TADDBY},
+    {COP_SUB, COP_SUB, TokenLabel::TDECR},
+    {COP_SUB, COP_GE, TokenLabel::TARROW},
+    {COP_SUB, COP_ASSIGN, TokenLabel::TSUBBY},
+    {COP_MUL, COP_ASSIGN, TokenLabel::TMULBY},
+    {COP_DIV, COP_ASSIGN, TokenLabel::TDIVBY},
+    {COP_REM, COP_ASSIGN, TokenLabel::TREMBY},
+    {COP_XOR, COP_ASSIGN, TokenLabel::TXORBY},
+    {COP_AND, COP_AND, TokenLabel::TAND},
+    {COP_AND, COP_ASSIGN, TokenLabel::TANDBY},
+    {COP_OR, COP_OR, TokenLabel::TOR},
+    {COP_OR, COP_ASSIGN, TokenLabel::TORBY},
+    {COP_ASSIGN, COP_ASSIGN, TokenLabel::TEQ},
+    {COP_NOT, COP_ASSIGN, TokenLabel::TNE},
+    {COP_LE, COP_ASSIGN, TokenLabel::TLEQ},
+    {COP_GE, COP_ASSIGN, TokenLabel::TGEQ},
+  };
+  for (const auto &p : pairs) {
+    t.op_pair[p.first - COP_ADD][p.second] = p.label;
   }
-  case ('['): {
-    return TokenLabel::TLEFTSQ;
+
+  return t;
+}
+
+static constexpr ScannerTables scanner = MakeScannerTables();
+
+static inline auto ClassOf(char ch) -> CharClass {
+  return scanner.cclass[static_cast<uint8_t>(ch)];
+}
+
+// token offsets are 32-bit, see CLangTokenize.
+static inline uint32_t Off(size_t pos) {
+  return static_cast<uint32_t>(pos);
+}
+
+// Find the next `ch` after `from`, skipping escaped chars.
+// Newlines skipped are added to *newlines.
+static size_t FindNextChar(const char *str, size_t len, size_t from, char ch,
+                           uint32_t *newlines) {
+  size_t ret = from + 1;
+  while (true) {
+    ret = Scan::FindCharOrEscape(str, ret, len, ch, newlines);
+    if (ret >= len || str[ret] == ch) {
+      break;
+    }
+    // skip one char.
+    ret ++;
+    if (ret < len && str[ret] == '\n') {
+      *newlines += 1;
+    }
+    ret ++;
   }
-  case (']'): {
-    return TokenLabel::TRIGHTSQ;
+
+  return ret > len ? len : ret;
+}
+
+// Find the end of the preprocessor command at `from`: the next newline
+// that is not escaped, in a block comment or in a literal.
+// Newlines skipped are added to *newlines.
+static size_t FindCommandEnd(const char *str, size_t len, size_t from,
+                             uint32_t *newlines) {
+  size_t ret = from + 1;
+  while (ret < len && str[ret] != '\n') {
+    const char ch = str[ret];
+    const char next = (ret + 1 < len) ? str[ret + 1] : '\0';
+    if (ch == '\\') {
+      *newlines += next == '\n';
+      ret += 2;
+    } else if (ch == '/' && next == '/') {
+      return FindNextChar(str, len, ret, '\n', newlines);
+    } else if (ch == '/' && next == '*') {
+      ret = std::min(Scan::FindCommentEnd(str, ret + 2, len, newlines) + 2, len);
+    } else if (ch == '"' || ch == '\'') {
+      // a literal, unless it is not closed on this line, as in #error don't
+      size_t end = ret + 1;
+      while (end < len && str[end] != ch && str[end] != '\n') {
+        end += str[end] == '\\' && end + 1 < len && str[end + 1] != '\n' ? 2 : 1;
+      }
+      ret = end < len && str[end] == ch ? end + 1 : ret + 1;
+    } else {
+      ret++;
+    }
   }
-  case ('{'): {
-    return TokenLabel::TLEFTBRACKET;
+
+  return ret > len ? len : ret;
+}
+
+struct Keyword {
+  std::string_view text;
+  TokenLabel label;
+};
+
+static constexpr Keyword keywords[] = {
+  // supported types
+  {"bool", TokenLabel::TBOOL},
+  {"int", TokenLabel::TINT},
+  {"char", TokenLabel::TCHAR},
+  {"void", TokenLabel::TVOID},
+  {"long", TokenLabel::TLONG},
+  {"signed", TokenLabel::TSIGNED},
+  {"unsigned", TokenLabel::TUNSIGNED},
+  {"short", TokenLabel::TSHORT},
+  // control flow
+  {"if", TokenLabel::TIF},
+  {"else", TokenLabel::TELSE},
+  {"while", TokenLabel::TWHILE},
+  {"return", TokenLabel::TRETURN},
+  {"for", TokenLabel::TFOR},
+  {"do", TokenLabel::TDO},
+  {"switch", TokenLabel::TSWITCH},
+  {"case", TokenLabel::TCASE},
+  {"default", TokenLabel::TDEFAULT},
+  {"break", TokenLabel::TBREAK},
+  {"continue", TokenLabel::TCONTINUE},
+  // struct, union, enum
+  {"struct", TokenLabel::TSTRUCT},
+  {"union", TokenLabel::TUNION},
+  {"enum", TokenLabel::TENUM},
+  // life time
+  {"static", TokenLabel::TSTATIC},
+  {"extern", TokenLabel::TEXTERN},
+};
+
+static constexpr size_t keyword_slots = 64;
+static constexpr size_t max_keyword_len = 8;
+
+// hash of a keyword candidate over its length, first and last char.
+static constexpr auto KeywordHash(size_t len, char first, char last) -> size_t {
+  return (len + 9 * static_cast<uint8_t>(first) + 6 * static_cast<uint8_t>(last))
+         & (keyword_slots - 1);
+}
+
+struct KeywordTable {
+  // index into `keywords`, or -1 for an empty slot.
+  int8_t slot[keyword_slots];
+  // no two keywords share a slot
+  bool perfect;
+};
+
+static constexpr auto MakeKeywordTable() -> KeywordTable {
+  KeywordTable t{};
+  t.perfect = true;
+  for (size_t h = 0; h < keyword_slots; h++) {
+    t.slot[h] = -1;
   }
-  case ('}'): {
-    return TokenLabel::TRIGHTBRACKET;
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+    const auto &text = keywords[i].text;
+    const size_t h = KeywordHash(text.size(), text.front(), text.back());
+    if (t.slot[h] >= 0 || text.size() > max_keyword_len) {
+      t.perfect = false;
+    }
+    t.slot[h] = static_cast<int8_t>(i);
   }
-  case (':'): {
-    return TokenLabel::TCOLON;
+  return t;
+}
+
+static constexpr KeywordTable keyword_table = MakeKeywordTable();
+static_assert(keyword_table.perfect,
+              "keyword hash has collisions, choose other multipliers");
+
+// Returns the keyword label of an identifier, or TALPHA.
+static inline auto LookupKeyword(std::string_view text) -> TokenLabel {
+  if (text.size() < 2 || text.size() > max_keyword_len) {
+    return TokenLabel::TALPHA;
   }
-  case ('?'): {
-    return TokenLabel::TQUESTION;
+  const int idx = keyword_table.slot[KeywordHash(text.size(), text.front(), text.back())];
+  if (idx < 0) {
+    return TokenLabel::TALPHA;
   }
-  case ('#'): {
-    return TokenLabel::TSHARP;
+  const Keyword &kw = keywords[idx];
+  if (kw.text.size() != text.size() ||
+      memcmp(kw.text.data(), text.data(), text.size()) != 0) {
+    return TokenLabel::TALPHA;
   }
+  return kw.label;
+}
 
-  default: break;
+// Returns true if a null token may start at `i` of `src`: blanks, comments
+// and preprocessor commands if they are skipped. Sets *incomplete if that
+// depends on bytes past `len`.
+static inline bool StartsNullToken(const char *src, size_t i, size_t len,
+                                   bool eof, bool skip_sharp, bool *incomplete) {
+  const CharClass cc = ClassOf(src[i]);
+  if (cc == CNULL || cc == CNEWLINE || (cc == CSHARP && skip_sharp)) {
+    return true;
   }
-
-  static const char *printable = "~!%^&*-+=|,.<>?:/";
-  for (const char *pt = printable; *pt; pt++) {
-    if (ch == *pt) {
-      return TokenLabel::TOPERATOR;
-    }
+  if (cc != COP_DIV) {
+    return false;
   }
-
-  return TokenLabel::TNULL;
+  if (i + 1 >= len) {
+    *incomplete = !eof;
+    return false;
+  }
+  return src[i + 1] == '/' || src[i + 1] == '*';
 }
 
-static bool IsIdentifier(char ch) {
-  // c identifier is made of alpha, digits, and _.
-  return (ch >= 'a' && ch <='z') ||
-         (ch >= 'A' && ch <= 'Z') ||
-         (ch >= '0' && ch <= '9') || 
-         (ch == '_');
+LineTable::LineTable(std::string_view src) {
+  const char *data = src.data();
+  const void *nl;
+  size_t pos = 0;
+  while ((nl = memchr(data + pos, '\n', src.size() - pos)) != nullptr) {
+    pos = static_cast<const char *>(nl) - data + 1;
+    this->starts_.push_back(pos);
+  }
 }
 
-static size_t FindNextChar(const std::string &str, size_t from, char ch) {
-  size_t ret = from + 1;
-  while (ret < str.size()) {
-    if (str[ret] == ch) {
-      break;
-    }
-    if (str[ret] == '\n') {
-      lno++;
-    }
-    if (str[ret] == '\\') {
-      // skip one char.
-      ret ++;
-      if (str[ret] == '\n') {
-        lno ++;
-      }
-    }
-    ret ++;
-  }
+LineTable::LineTable(uint32_t line, uint64_t offset)
+  : first_line_(line), starts_({offset}) {}
 
-  return ret > str.size() ? str.size() : ret;
+auto LineTable::Locate(uint64_t offset) const -> std::pair<uint32_t, uint32_t> {
+  assert(offset >= this->starts_.front());
+  auto it = std::upper_bound(this->starts_.begin(), this->starts_.end(), offset);
+  const size_t idx = it - this->starts_.begin() - 1;
+  return {static_cast<uint32_t>(this->first_line_ + idx),
+          static_cast<uint32_t>(offset - this->starts_[idx] + 1)};
 }
 
-static std::vector<Token> MergeEmptyTokens(std::vector<Token> &tokens);
-static void ReLabelTokens(std::vector<Token> &tokens);
+Lexer::Lexer(std::string_view src, bool ignore_null)
+  : Lexer(src, 0, 1, ignore_null) {}
 
-auto CLangTokenize(const std::string &fobj, bool IgnoreNull) -> std::vector<Token> {
-  lno = 1; // reset line number
-  size_t i = 0;
-  const size_t len = fobj.size(); // length of file
-  std::vector<Token> tokens = {};
+Lexer::Lexer(std::string_view src, size_t from, uint32_t line, bool ignore_null)
+  : src_(src.data()), len_(src.size()), pos_(from), line_(line),
+    ignore_null_(ignore_null), eof_(true) {
+  if (len_ > UINT32_MAX) {
+    throw std::runtime_error("Source file is too large");
+  }
+  assert(from <= len_);
+  if (from > 0) {
+    // the line of `from` starts after the last newline before it.
+    const void *nl = memrchr(src.data(), '\n', from);
+    const size_t start = nl ? static_cast<const char *>(nl) - src.data() + 1 : 0;
+    this->lines_ = LineTable(line, start);
+  }
+}
 
-  for (; i < len; ) {
-    char ch = fobj[i];
-    const auto oldno = lno;
+Lexer::Lexer(int fd, bool ignore_null, size_t window)
+  : src_(nullptr), len_(0), ignore_null_(ignore_null), eof_(false), fd_(fd) {
+  assert(window > 0);
+  this->window_.resize(window);
+  this->src_ = this->window_.data();
+}
 
-    if (IsIdentifier(ch)) {
-      size_t j;
-      for (j = i + 1; j < len && IsIdentifier(fobj[j]); j++) {}
-      tokens.push_back({fobj.substr(i, j - i), TokenLabel::TALPHA, lno});
+auto Lexer::Refill() -> void {
+  assert(this->fd_ >= 0 && !this->eof_);
 
-      // advance
-      i = j;
-    } else {
+  // drop the bytes before the current token.
+  const size_t keep = this->len_ - this->pos_;
+  if (this->pos_ > 0) {
+    memmove(this->window_.data(), this->window_.data() + this->pos_, keep);
+    this->base_ += this->pos_;
+    this->pos_ = 0;
+    this->len_ = keep;
+  }
 
-      switch (ch) {
+  // the current token fills the whole window.
+  if (this->len_ == this->window_.size()) {
+    this->window_.resize(this->window_.size() * 2);
+  }
+  if (this->window_.size() > UINT32_MAX) {
+    throw std::runtime_error("Token is too large");
+  }
+  this->src_ = this->window_.data();
 
-      // single quote
-      case '\'': {
-        size_t j = FindNextChar(fobj, i, ch);
-        j++;
-        tokens.push_back({fobj.substr(i, j - i), TokenLabel::TQUOTE, oldno});
-        i = j;
-        break;
-      }
+  long nread;
+  do {
+    nread = read(this->fd_, this->window_.data() + this->len_,
+                 this->window_.size() - this->len_);
+  } while (nread < 0 && errno == EINTR);
 
-      // double quote
-      case '\"': {
-        size_t j = FindNextChar(fobj, i, ch);
-        j++;
-        tokens.push_back({fobj.substr(i, j - i), TokenLabel::TDOUBLEQUOTE, oldno});
-        i = j;
-        break;
-      }
+  if (nread < 0) {
+    throw std::runtime_error("Failed to read file");
+  }
+  if (nread == 0) {
+    this->eof_ = true;
+  }
+  this->len_ += nread;
+}
 
-      // preprocessor commands.
-      case '#': {
-        size_t j = FindNextChar(fobj, i, '\n');
-        tokens.push_back({fobj.substr(i, j - i), TokenLabel::TNULL, oldno});
-        i = j;
-        break;
-      }
+auto Lexer::ScanRawToken(size_t i, TokenLabel *lbl) -> size_t {
+  const char *src = this->src_;
+  const size_t len = this->len_;
+  const char ch = src[i];
+  const CharClass cc = ClassOf(ch);
+  TokenLabel label = TokenLabel::TNULL;
+  size_t j = i + 1;
+  uint32_t newlines = 0;
+
+  switch (cc) {
+  case (CIDENT): {
+    j = Scan::SkipIdentifier(src, j, len);
+    // distinguish alpha and digit.
+    label = (ch >= '0' && ch <= '9') ? TokenLabel::TDIGIT : TokenLabel::TALPHA;
+    break;
+  }
 
-      // maybe comment
-      case '/': {
-        char next = (i + 1 >= len) ? '\0' : fobj[i + 1];
-        if (next == '/') {
-          size_t j = FindNextChar(fobj, i, '\n');
-          tokens.push_back({fobj.substr(i, j - i), TokenLabel::TNULL, oldno});
-          i = j;
-        } else {
-          if (next == '*') {
-            // handle block comment
-            size_t j = i + 2;
-            while (j < len) {
-              if (fobj[j] == '\n') { lno++; }
-              // find close of block comment
-              if (fobj[j] == '*' && fobj[j + 1] == '/') { break; }
-              j++;
-            }
-
-            // scenario: *(j) /(j + 1) ?(j + 2)
-            j+=2;
-            tokens.push_back({fobj.substr(i, j - i), TokenLabel::TNULL, oldno});
-            i = j;
-          } else {
-            // normal operator
-            tokens.push_back({std::string(1, ch), TokenLabel::TOPERATOR, oldno});
-            i++;
-          }
-        }
-        break;
-      }
- 
-      // new line
-      case '\n': {
-        tokens.push_back({std::string(1, ch), TokenLabel::TNULL, oldno});
-        lno++; i++;
+  case (CNULL):
+  case (CNEWLINE): {
+    // a run of blanks, which is merged anyway.
+    j = i;
+    while (true) {
+      j = Scan::SkipBlanks(src, j, len, &newlines);
+      if (j >= len || ClassOf(src[j]) != CNULL) {
         break;
       }
+      // not a blank, but not part of any token either.
+      j++;
+    }
+    break;
+  }
 
-      default: {
-        // single-char operator or blank.
-        tokens.push_back({std::string(1, ch), GetLabelOfChar(ch), oldno});
-        i++;
-        break;
-      }
+  case (CQUOTE): {
+    j = std::min(FindNextChar(src, len, i, ch, &newlines) + 1, len);
+    label = TokenLabel::TQUOTE;
+    break;
+  }
 
-      }
+  case (CDOUBLEQUOTE): {
+    j = std::min(FindNextChar(src, len, i, ch, &newlines) + 1, len);
+    label = TokenLabel::TDOUBLEQUOTE;
+    break;
+  }
 
+  // preprocessor commands.
+  case (CSHARP): {
+    if (this->directives_ == Directives::TOKENS) {
+      label = TokenLabel::TSHARP;
+      break;
+    }
+    if (this->directives_ == Directives::KEEP) {
+      // the command may go on in a block comment.
+      j = FindCommandEnd(src, len, i, &newlines);
+      label = TokenLabel::TSHARP;
+      break;
     }
+    j = FindNextChar(src, len, i, '\n', &newlines);
+    break;
   }
 
-  ReLabelTokens(tokens);
-  if (IgnoreNull) {
-    return RemoveNullTokens(tokens);
+  case (CPUNCT): {
+    label = scanner.punct[static_cast<uint8_t>(ch)];
+    break;
   }
-  return MergeEmptyTokens(tokens);
-}
 
-static std::vector<Token> MergeEmptyTokens(std::vector<Token> &tokens)
-{
-  std::vector<Token> ret;
-
-  size_t i = 0;
-  const TokenLabel tnul = TokenLabel::TNULL;
-  while (i < tokens.size()) {
-    if (tokens[i].label != tnul) {
-      ret.push_back(tokens[i]);
-      i++;
+  default: {
+    // operators
+    assert(cc >= COP_ADD && cc < CNUM_CLASSES);
+    const char next = (i + 1 < len) ? src[i + 1] : '\0';
+    if (cc == COP_DIV && next == '/') {
+      // line comment
+      j = FindNextChar(src, len, i, '\n', &newlines);
+    } else if (cc == COP_DIV && next == '*') {
+      // block comment
+      j = Scan::FindCommentEnd(src, i + 2, len, &newlines);
+      // scenario: *(j) /(j + 1) ?(j + 2)
+      j = std::min(j + 2, len);
     } else {
-      size_t j =  i;
-      uint32_t l = tokens[i].line;
-      std::string buf;
-      while (j < tokens.size()) {
-        if (tokens[j].label != tnul) { break; }
-        buf += tokens[j].buf;
-        j++;
+      label = scanner.op_pair[cc - COP_ADD][ClassOf(next)];
+      if (label != TokenLabel::TNULL) {
+        j = i + 2;
+      } else {
+        label = scanner.op_single[cc - COP_ADD];
       }
-
-      ret.push_back({buf, tnul, l});
-      i = j;
     }
+    break;
+  }
   }
 
-  assert(ret.size() <= tokens.size());
-  // free previous token
-  tokens.clear();
-  return ret;
+  this->line_ += newlines;
+  *lbl = label;
+  return j;
 }
 
-auto RemoveNullTokens(std::vector<Token> &tokens) -> std::vector<Token> {
-  std::vector<Token> ret;
-  const TokenLabel tnul = TokenLabel::TNULL;
+auto Lexer::ScanToken(size_t i, TokenLabel *lbl) -> size_t {
+  const size_t len = this->len_;
+  TokenLabel label;
+  size_t j = this->ScanRawToken(i, &label);
 
-  for (auto &t : tokens) {
-    if (t.label != tnul) { ret.push_back(t); }
+  if (label == TokenLabel::TALPHA) {
+    // maybe one of the keyword
+    label = LookupKeyword(std::string_view(this->src_ + i, j - i));
   }
 
-  tokens.clear();
-  return ret;
+  if (label == TokenLabel::TNULL && !this->ignore_null_) {
+    // merge adjacent comments, whitespaces, etc.
+    bool incomplete = false;
+    const bool skip_sharp = this->directives_ == Directives::SKIP;
+    while (j < len && StartsNullToken(this->src_, j, len, this->eof_, skip_sharp,
+                                      &incomplete)) {
+      TokenLabel next;
+      j = this->ScanRawToken(j, &next);
+      assert(next == TokenLabel::TNULL);
+    }
+    if (incomplete) {
+      j = len;
+    }
+  }
+
+  *lbl = label;
+  return j;
 }
 
-static void ReLabelTokens(std::vector<Token> &tokens) {
-  std::vector<Token> tmp;
-  static const Token tnul = {"", TokenLabel::TNULL, 0};
+auto Lexer::Next(Token *token) -> bool {
+  assert(token != nullptr);
 
-  size_t i = 0;
-  const size_t len = tokens.size();
-  // in case of oob,
-  tokens.push_back(tnul);
-  assert(tokens.size() == len + 1);
-
-  while (i < len) {
-    const Token &t = tokens[i];
-    switch (t.label) {
-  
-    case (TokenLabel::TALPHA): {
-      // maybe one of the keyword
-      bool matched = false;
-      if (t.buf == "if") {
-        tmp.push_back(Token(t.buf, TokenLabel::TIF, t.line));
-        matched = true;
-      }
-      if (t.buf == "else") {
-        tmp.push_back(Token(t.buf, TokenLabel::TELSE, t.line));
-        matched = true;
-      }
-      if (t.buf == "while") {
-        tmp.push_back(Token(t.buf, TokenLabel::TWHILE, t.line));
-        matched = true;
-      }
-      if (t.buf == "return") {
-        tmp.push_back(Token(t.buf, TokenLabel::TRETURN, t.line));
-        matched = true;
-      }
-      if (t.buf == "for") {
-        tmp.push_back(Token(t.buf, TokenLabel::TFOR, t.line));
-        matched = true;
-      }
-      if (t.buf == "do") {
-        tmp.push_back(Token(t.buf, TokenLabel::TDO, t.line));
-        matched = true;
-      }
-      if (t.buf == "switch") {
-        tmp.push_back(Token(t.buf, TokenLabel::TSWITCH, t.line));
-        matched = true;
-      }
-      if (t.buf == "case") {
-        tmp.push_back(Token(t.buf, TokenLabel::TCASE, t.line));
-        matched = true;
-      }
-      if (t.buf == "default") {
-        tmp.push_back(Token(t.buf, TokenLabel::TDEFAULT, t.line));
-        matched = true;
-      }
-      if (t.buf == "break") {
-        tmp.push_back(Token(t.buf, TokenLabel::TBREAK, t.line));
-        matched = true;
-      }
-      if (t.buf == "continue") {
-        tmp.push_back(Token(t.buf, TokenLabel::TCONTINUE, t.line));
-        matched = true;
-      }
-      if (t.buf == "void") {
-        tmp.push_back(Token(t.buf, TokenLabel::TVOID, t.line));
-        matched = true;
-      }
-      if (t.buf == "long") {
-        tmp.push_back(Token(t.buf, TokenLabel::TLONG, t.line));
-        matched = true;
-      }
-      if (t.buf == "signed") {
-        tmp.push_back(Token(t.buf, TokenLabel::TSIGNED, t.line));
-        matched = true;
-      }
-      if (t.buf == "unsigned") {
-        tmp.push_back(Token(t.buf, TokenLabel::TUNSIGNED, t.line));
-        matched = true;
-      }
-      if (t.buf == "short") {
-        tmp.push_back(Token(t.buf, TokenLabel::TSHORT, t.line));
-        matched = true;
-      }
-      if (t.buf == "int") {
-        tmp.push_back(Token(t.buf, TokenLabel::TINT, t.line));
-        matched = true;
-      }
-      if (t.buf == "bool") {
-        tmp.push_back(Token(t.buf, TokenLabel::TBOOL, t.line));
-        matched = true;
-      }
-      if (t.buf == "char") {
-        tmp.push_back(Token(t.buf, TokenLabel::TCHAR, t.line));
-        matched = true;
-      }
-      if (t.buf == "struct") {
-        tmp.push_back(Token(t.buf, TokenLabel::TSTRUCT, t.line));
-        matched = true;
-      }
-      if (t.buf == "union") {
-        tmp.push_back(Token(t.buf, TokenLabel::TUNION, t.line));
-        matched = true;
-      }
-      if (t.buf == "enum") {
-        tmp.push_back(Token(t.buf, TokenLabel::TENUM, t.line));
-        matched = true;
-      }
-      if (t.buf == "static") {
-        tmp.push_back(Token(t.buf, TokenLabel::TSTATIC, t.line));
-        matched = true;
-      }
-      if (t.buf == "extern") {
-        tmp.push_back(Token(t.buf, TokenLabel::TEXTERN, t.line));
-        matched = true;
-      }
-      if (!matched) {
-        // distinguish alpha and digit.
-        char leading = t.buf[0];
-        if (leading >= '0' && leading <= '9') {
-          tmp.push_back(Token(t.buf, TokenLabel::TDIGIT, t.line));
-        } else {
-          tmp.push_back(t);
-        }
+  while (true) {
+    if (this->pos_ >= this->len_) {
+      if (this->eof_) {
+        return false;
       }
+      this->Refill();
+      continue;
+    }
 
-      i++;
-      break;
+    const uint32_t line = this->line_;
+    TokenLabel label;
+    const size_t end = this->ScanToken(this->pos_, &label);
+    if (end >= this->len_ && !this->eof_) {
+      // the token may go on in bytes not read yet. scan it again.
+      this->line_ = line;
+      this->Refill();
+      continue;
     }
 
-    case (TokenLabel::TOPERATOR): {
-      const Token &next = tokens[i + 1];
-      assert(t.buf.size() == 1);
-      switch (t.buf[0]) {
-      case ('/'): {
-        if (next.buf == "=") {
-          tmp.push_back(Token("/=", TokenLabel::TDIVBY, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TDIV, t.line));
-          i++;
-        }
-        break;
-      }
-      case ('%'): {
-        if (next.buf == "=") {
-          tmp.push_back(Token("%=", TokenLabel::TREMBY, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TREM, t.line));
-          i++;
-        }
-        break;
-      }
-      case ('*'): {
-        if (next.buf == "=") {
-          tmp.push_back(Token("*=", TokenLabel::TMULBY, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TMUL, t.line));
-          i++;
-        }
-        break;
-      }
-      case ('^'): {
-        if (next.buf == "=") {
-          tmp.push_back(Token("^=", TokenLabel::TXORBY, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TXOR, t.line));
-          i++;
-        }
-        break;
-      }
-      case ('.'): {
-        tmp.push_back(Token(t.buf, TokenLabel::TDOT, t.line));
-        i++;
-        break;
-      }
-      case (','): {
-        tmp.push_back(Token(t.buf, TokenLabel::TCOMMA, t.line));
-        i++; break;
-      }
-      case ('~'): {
-        tmp.push_back(Token(t.buf, TokenLabel::TFLIP, t.line));
-        i++;
-        break;
+    const size_t begin = this->pos_;
+    this->pos_ = end;
+    if (this->line_ != line) {
+      // the token has newlines.
+      const void *nl;
+      size_t p = begin;
+      while ((nl = memchr(this->src_ + p, '\n', end - p)) != nullptr) {
+        p = static_cast<const char *>(nl) - this->src_ + 1;
+        this->lines_.AddLine(this->base_ + p);
       }
+    }
+    if (label == TokenLabel::TNULL && this->ignore_null_) {
+      continue;
+    }
 
-      case ('+'): {
-        // should handle +, += and ++
-        if (next.buf == "+") {
-          // is ++
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("++", TokenLabel::TINCR, t.line));
-          i += 2;
-        } else if (next.buf == "=") {
-          tmp.push_back(Token("+=", TokenLabel::TADDBY, t.line));
-          i += 2;
-        } else {
-          // is +
-          tmp.push_back(Token(t.buf, TokenLabel::TADD, t.line));
-          i ++;
-        }
-        break;
-      }
+    Atom atom = null_atom;
+    if (label == TokenLabel::TALPHA) {
+      atom = this->atoms_.Intern(std::string_view(this->src_ + begin, end - begin));
+    }
+    *token = Token(this->src_, Off(begin), Off(end - begin), label, line, atom);
+    return true;
+  }
+}
 
-      case ('-'): {
-        // should handle -, --, ->, -=
-        if (next.buf == "-") {
-          // is --
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("--", TokenLabel::TDECR, t.line));
-          i += 2;
-        } else if (next.buf == ">") {
-          // is ->
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("->", TokenLabel::TARROW, t.line));
-          i += 2;
-        } else if (next.buf == "=") {
-          tmp.push_back(Token("-=", TokenLabel::TSUBBY, t.line));
-          i += 2;
-        } else {
-          // is -
-          tmp.push_back(Token(t.buf, TokenLabel::TSUB, t.line));
-          i++;
-        }
+// a chunk is not worth a thread below this size.
+static constexpr size_t min_chunk_size = 256 * 1024;
 
-        break;
-      }
+// Tokenize [from, to) of `src` as if it were the start of a file.
+// The last token may go on beyond `to`.
+static auto TokenizeChunk(std::string_view src, size_t from, size_t to) -> std::vector<Token> {
+  Lexer lexer(src, from, 1, false);
+  std::vector<Token> tokens;
+  Token token;
+  while (lexer.Next(&token) && token.offset < to) {
+    tokens.push_back(token);
+  }
+  return tokens;
+}
 
-      case ('='): {
-        // should handle =, ==
-        if (next.buf == "=") {
-          // is ==
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("==", TokenLabel::TEQ, t.line));
-          i += 2;
-        } else {
-          // is =
-          tmp.push_back(Token(t.buf, TokenLabel::TASSIGN, t.line));
-          i++;
-        }
+// Each chunk is tokenized speculatively, starting at its first byte with
+// line 1. Chunks start at a newline, but may still start inside a comment
+// or literal, so they are stitched in order: where the previous chunk ends,
+// we look for a speculative token starting at the same offset. As scanning
+// only depends on the offset, the rest of the chunk is then right, and only
+// needs its line numbers shifted. Otherwise we scan serially until we meet
+// one of the speculative tokens.
+static auto CLangTokenizeChunks(std::string_view fobj, bool IgnoreNull,
+                                size_t nchunks) -> std::vector<Token> {
+  const char *data = fobj.data();
+  const size_t len = fobj.size();
+
+  std::vector<size_t> bounds = {0};
+  for (size_t k = 1; k < nchunks; k++) {
+    const size_t from = std::max(k * len / nchunks, bounds.back());
+    const void *nl = memchr(data + from, '\n', len - from);
+    if (nl == nullptr) {
+      break;
+    }
+    const size_t b = static_cast<const char *>(nl) - data + 1;
+    if (b < len) {
+      bounds.push_back(b);
+    }
+  }
+  bounds.push_back(len);
+  nchunks = bounds.size() - 1;
 
-        break;
-      }
-      case ('!'): {
-        // should handle !, !=
-        if (next.buf == "=") {
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("!=", TokenLabel::TNE, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token("!", TokenLabel::TNOT, t.line));
-          i++;
-        }
-        break;
-      }
+  std::vector<std::vector<Token>> chunks(nchunks);
+  std::vector<size_t> newlines(nchunks);
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < nchunks; k++) {
+    workers.emplace_back([&, k]() {
+      chunks[k] = TokenizeChunk(fobj, bounds[k], bounds[k + 1]);
+      newlines[k] = Scan::CountNewlines(data, bounds[k], bounds[k + 1]);
+    });
+  }
+  size_t total = 0;
+  for (size_t k = 0; k < nchunks; k++) {
+    workers[k].join();
+    total += chunks[k].size();
+  }
 
-      case ('>'): {
-        // should handle >, >=
-        if (next.buf == "=") {
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token(">=", TokenLabel::TGEQ, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TGE, t.line));
-          i++;
-        }
+  std::vector<Token> tokens;
+  tokens.reserve(total);
+  size_t pos = 0; // end of the last token
+  auto append = [&](Token token) {
+    pos = token.offset + token.length;
+    if (token.label != TokenLabel::TNULL || !IgnoreNull) {
+      tokens.push_back(token);
+    }
+  };
 
-        break;
+  uint32_t line_base = 0; // newlines before the chunk
+  for (size_t k = 0; k < nchunks; k++) {
+    const auto &chunk = chunks[k];
+    size_t i = 0;
+    auto synced = [&]() {
+      while (i < chunk.size() && chunk[i].offset < pos) {
+        i++;
       }
+      return i < chunk.size() && chunk[i].offset == pos;
+    };
 
-      case ('<'): {
-        if (next.buf == "=") {
-          assert(next.label == TokenLabel::TOPERATOR);
-          tmp.push_back(Token("<=", TokenLabel::TLEQ, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TLE, t.line));
-          i++;
-        }
-
-        break;
+    if (pos < bounds[k + 1] && !synced()) {
+      const auto line = Scan::CountNewlines(data, bounds[k], pos) + line_base + 1;
+      Lexer lexer(fobj, pos, line, false);
+      Token token;
+      while (pos < bounds[k + 1] && !synced() && lexer.Next(&token)) {
+        append(token);
       }
+    }
 
-      case ('&'): {
-        if (next.buf == "&") {
-          // is &&
-          tmp.push_back(Token("&&", TokenLabel::TAND, t.line));
-          i += 2;
-        } else if (next.buf == "=") {
-          tmp.push_back(Token("&=", TokenLabel::TANDBY, t.line));
-          i += 2;
-        } else {
-          // is &
-          tmp.push_back(Token(t.buf, TokenLabel::TADRP, t.line));
-          i ++;
-        }
-        break;
-      }
-      case ('|'): {
-        if (next.buf == "|") {
-          tmp.push_back(Token("||", TokenLabel::TOR, t.line));
-          i += 2;
-        } else if (next.buf == "=") {
-          tmp.push_back(Token("|=", TokenLabel::TORBY, t.line));
-          i += 2;
-        } else {
-          tmp.push_back(Token(t.buf, TokenLabel::TPIPE, t.line));
-          i ++;
-        }
-        break;
+    if (pos < bounds[k + 1]) {
+      for (; i < chunk.size(); i++) {
+        Token token = chunk[i];
+        token.line += line_base;
+        append(token);
       }
+    }
+    line_base += newlines[k];
+  }
+  return tokens;
+}
 
-      default: {
-        // should not happen.
-        fprintf(stderr, "Unknown operator at line %u: %s\n", t.line, EncodeString(t.buf).c_str());
-        fprintf(stderr, "Further execution is not possible.\n");
-        assert(0);
-      }
+auto CLangTokenize(std::string_view fobj, bool IgnoreNull, size_t nchunks) -> std::vector<Token> {
+  nchunks = std::min(nchunks, fobj.size() / min_chunk_size);
+  if (nchunks > 1) {
+    if (fobj.size() > UINT32_MAX) {
+      throw std::runtime_error("Source file is too large");
+    }
+    return CLangTokenizeChunks(fobj, IgnoreNull, nchunks);
+  }
+
+  Lexer lexer(fobj, IgnoreNull);
+  std::vector<Token> tokens = {};
+  Token token;
+  while (lexer.Next(&token)) {
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+// Scanning a token looks at most 2 bytes past its end (e.g. "/*" after a
+// comment, which is merged), so tokens ending 2 bytes before the edit are
+// unchanged. Scanning from the start of the last such token, we stop at the
+// first token after the edit that starts where an old token started: as
+// scanning only depends on the bytes from there on, which are not edited,
+// all the following tokens are the same up to a shift.
+auto CLangRetokenize(std::vector<Token> &tokens, std::string_view fobj,
+                     const Edit &edit, bool IgnoreNull) -> void {
+  assert(edit.offset + edit.inserted <= fobj.size());
+  const size_t old_end = edit.offset + edit.removed;
+  const size_t new_end = edit.offset + edit.inserted;
+
+  // the last token starting 2 bytes before the edit, if any.
+  auto it = std::partition_point(tokens.begin(), tokens.end(), [&](const Token &t) {
+    return t.offset + 2 <= edit.offset;
+  });
+  const bool from_start = it == tokens.begin();
+  const size_t first = from_start ? 0 : it - tokens.begin() - 1;
+  const size_t from = from_start ? 0 : tokens[first].offset;
+  const uint32_t line = from_start ? 1 : tokens[first].line;
+
+  Lexer lexer(fobj, from, line, IgnoreNull);
+  std::vector<Token> scanned;
+  size_t last = first; // old tokens [first, last) are replaced
+  bool synced = false;
+  int64_t line_delta = 0;
+  Token token;
+  while (lexer.Next(&token)) {
+    if (token.offset >= new_end) {
+      const size_t old_offset = token.offset - new_end + old_end;
+      while (last < tokens.size() && tokens[last].offset < old_offset) {
+        last++;
+      }
+      if (last < tokens.size() && tokens[last].offset == old_offset) {
+        synced = true;
+        line_delta = static_cast<int64_t>(token.line) - tokens[last].line;
+        break;
       }
-      break;
     }
+    scanned.push_back(token);
+  }
+  if (!synced) {
+    last = tokens.size();
+  }
 
-    default:  {
-      tmp.push_back(t);
-      i++;
-      break;
+  // replace [first, last) with the scanned tokens.
+  const size_t replaced = last - first;
+  if (scanned.size() > replaced) {
+    tokens.insert(tokens.begin() + last, scanned.size() - replaced, Token());
+  } else {
+    tokens.erase(tokens.begin() + first + scanned.size(), tokens.begin() + last);
+  }
+  std::copy(scanned.begin(), scanned.end(), tokens.begin() + first);
+
+  // the buffer may have moved. the first or the last token is an old one,
+  // unless all of them were scanned again.
+  const char *src = fobj.data();
+  if (!tokens.empty() && (tokens.front().src != src || tokens.back().src != src)) {
+    for (auto &t : tokens) {
+      t.src = src;
     }
+  }
+
+  // shift the rest, unless the edit kept the size and lines.
+  const uint32_t offset_delta = static_cast<uint32_t>(edit.inserted - edit.removed);
+  if (offset_delta != 0 || line_delta != 0) {
+    for (size_t i = first + scanned.size(); i < tokens.size(); i++) {
+      tokens[i].offset += offset_delta;
+      tokens[i].line = static_cast<uint32_t>(tokens[i].line + line_delta);
     }
   }
+}
+
+auto RemoveNullTokens(std::vector<Token> &tokens) -> std::vector<Token> {
+  std::vector<Token> ret;
+  const TokenLabel tnul = TokenLabel::TNULL;
+
+  for (auto &t : tokens) {
+    if (t.label != tnul) { ret.push_back(t); }
+  }
 
   tokens.clear();
-  tokens = tmp;
+  return ret;
 }
 
 } // namespace Lex
 
 namespace Parser {
 
+// Throw a SourceError at the line of `token` or `instr` (unless `cond`).
+static void Expect(bool cond, const Lex::Token &token, const std::string &msg) {
+  if (!cond) {
+    throw Lex::SourceError(token.line, msg);
+  }
+}
+[[noreturn]] static void Fail(const Instruction &instr, const std::string &msg) {
+  throw Lex::SourceError(instr.tokens.empty() ? 0 : instr.tokens.front().line, msg);
+}
+static void Expect(bool cond, const Instruction &instr, const std::string &msg) {
+  if (!cond) {
+    Fail(instr, msg);
+  }
+}
+// The value of the number `token`; a SourceError at its line if it is not one.
+static auto Number(const Lex::Token &token) -> long {
+  try {
+    return Atoi(token.Text());
+  } catch (const std::exception &e) {
+    throw Lex::SourceError(token.line, "Bad number " + std::string(token.Text()) + ": " +
+                           e.what());
+  }
+}
+
 static const char *block_type_names[] = {
   "common",
   "function",
@@ -685,69 +903,67 @@ auto BlockTypeToString(BlockType bt) -> std::string {
   return block_type_names[static_cast<int>(bt)];
 }
 
-static size_t ident = 0;
-static inline auto PrintIdent(std::ostream &os) -> std::ostream & {
-  // avoid underflow
-  assert(ident < max_recursion);
-  os << std::string(ident * 2, ' ');
+static inline auto PrintIdent(std::ostream &os, size_t depth) -> std::ostream & {
+  os << std::string(depth * 2, ' ');
   return os;
 }
 
-auto Instruction::GetFuncCalls() const -> std::vector<std::string> {
-  size_t len = this->tokens.size();
+// names of called funcs in tokens[0, len).
+static auto FuncCallsOf(const Lex::Token *tokens, size_t len) -> std::vector<Lex::Atom> {
   if (len == 0) {
     return {};
   }
 
   len --;
 
-  std::vector<std::string> ret;
+  std::vector<Lex::Atom> ret;
   for (size_t i = 0; i < len; i++) {
     if (tokens[i].label == Lex::TokenLabel::TALPHA && 
         tokens[i + 1].label == Lex::TokenLabel::TLEFTPARENT) {
-      ret.push_back(tokens[i].buf);
+      ret.push_back(tokens[i].atom);
     }
   }
   return ret;
 }
 
-auto Instruction::GetVarNames(void) const -> std::vector<std::string> {
-  size_t len = this->tokens.size();
+// names of variables in tokens[0, len).
+static auto VarNamesOf(const Lex::Token *tokens, size_t len) -> std::vector<Lex::Atom> {
   if (len == 0) {
     return {};
   }
 
-  std::vector<std::string> ret;
+  auto label_of = [&](size_t i) {
+    return i < len ? tokens[i].label : Lex::TokenLabel::TNULL;
+  };
+
+  std::vector<Lex::Atom> ret;
   for (size_t i = 0; i < len; i++) {
-    auto prev = i ? this->GetTypeOfToken(i - 1) : Lex::TokenLabel::TNULL;
-    auto cur = this->GetTypeOfToken(i);
-    auto next = this->GetTypeOfToken(i + 1);
+    auto prev = i ? label_of(i - 1) : Lex::TokenLabel::TNULL;
+    auto cur = label_of(i);
+    auto next = label_of(i + 1);
 
     if (prev != Lex::TokenLabel::TDOT 
      && prev != Lex::TokenLabel::TARROW // check that `cur` is not a member of struct.
      && cur == Lex::TokenLabel::TALPHA // check this is not a func call.
      && next != Lex::TokenLabel::TLEFTPARENT) {
-      ret.push_back(tokens[i].buf);
+      ret.push_back(tokens[i].atom);
     } 
   }
 
   return ret;
 }
 
-// non-recursive
-static void AddLabelForBlock(BasicBlock *root) {
-  // there're two types of BasicBlock:
-  // one is simply a wrapper of an instruction;
-  // the other is the collection of basic blocks.
-  // assert(root->GetInstruction().tokens.empty() || root->GetNumChildren() == 0);
-  // find the first token that is not null.
+auto Instruction::GetFuncCalls() const -> std::vector<Lex::Atom> {
+  return FuncCallsOf(this->tokens.data(), this->tokens.size());
+}
 
-  if (root->GetInstruction().tokens.empty()) {
-    // assert(root->GetType() == BlockType::BCOMMON);
-    return;
-  }
+auto Instruction::GetVarNames(void) const -> std::vector<Lex::Atom> {
+  return VarNamesOf(this->tokens.data(), this->tokens.size());
+}
 
-  const auto &Tokens = root->GetInstruction().tokens;
+// Returns the type of the block of an instruction.
+static auto LabelOfInstruction(const Lex::TokenSpan &Tokens) -> BlockType {
+  BlockType ret = BlockType::BCOMMON;
   for (const auto &token : Tokens) {
     if (token.label == Lex::TokenLabel::TNULL) {
       continue;
@@ -756,11 +972,10 @@ static void AddLabelForBlock(BasicBlock *root) {
     switch (token.label) {
     case (Lex::TokenLabel::TCASE):
     case (Lex::TokenLabel::TDEFAULT): {
-      root->SetType(BlockType::BCASE);
-      return;
+      return BlockType::BCASE;
     }
     case (Lex::TokenLabel::TSWITCH): {
-      root->SetType(BlockType::BSWITCH);
+      ret = BlockType::BSWITCH;
       break;
     }
     case (Lex::TokenLabel::TVOID):
@@ -772,57 +987,53 @@ static void AddLabelForBlock(BasicBlock *root) {
       if (Tokens.size() > 3 && Tokens[ln - 1].label != Lex::TokenLabel::TSEMICOLON) {
         // is a function declaration, for example:
         // int func (
-        root->SetType(BlockType::BFUNCTION);
+        ret = BlockType::BFUNCTION;
       } else {
-        root->SetType(BlockType::BVARDECLARE);
+        ret = BlockType::BVARDECLARE;
       }
-      return;
+      return ret;
     }
 
     // control flows
     case (Lex::TokenLabel::TIF): {
-      root->SetType(BlockType::BIF); 
-      return;
+      return BlockType::BIF;
     }
     case (Lex::TokenLabel::TWHILE): {
-      root->SetType(BlockType::BWHILE);
-      return;
+      return BlockType::BWHILE;
     }
     case (Lex::TokenLabel::TDO): {
-      root->SetType(BlockType::BDO);
+      ret = BlockType::BDO;
       break;
     }
     case (Lex::TokenLabel::TFOR): {
-      root->SetType(BlockType::BFOR);
+      ret = BlockType::BFOR;
       break;
     }
     case (Lex::TokenLabel::TBREAK): {
-      root->SetType(BlockType::BBREAK);
+      ret = BlockType::BBREAK;
       break;
     }
     case (Lex::TokenLabel::TCONTINUE): {
-      root->SetType(BlockType::BCONTINUE);
+      ret = BlockType::BCONTINUE;
       break;
     }
     case (Lex::TokenLabel::TELSE): {
-      root->SetType(BlockType::BELSE);
-      return;
+      return BlockType::BELSE;
     }
     case (Lex::TokenLabel::TRETURN): {
-      root->SetType(BlockType::BRET);
-      return;
+      return BlockType::BRET;
     }
 
     case (Lex::TokenLabel::TSTRUCT): {
-      root->SetType(BlockType::BSTRUCT);
+      ret = BlockType::BSTRUCT;
       break;
     }
     case (Lex::TokenLabel::TUNION): {
-      root->SetType(BlockType::BUNION);
+      ret = BlockType::BUNION;
       break;
     }
     case (Lex::TokenLabel::TENUM): {
-      root->SetType(BlockType::BENUM);
+      ret = BlockType::BENUM;
       break;
     }
 
@@ -831,22 +1042,22 @@ static void AddLabelForBlock(BasicBlock *root) {
     }
     }
   }
+  return ret;
 }
 
-// recursive, should be called only once for each tree
-static void AddLabelForBlocks(BasicBlock *root) {
-  assert(root != nullptr);
-  // assert(root->GetType() == BlockType::BCOMMON);
-
-  AddLabelForBlock(root);
-  size_t nchildren = root->GetNumChildren();
-  for (size_t i = 0; i < nchildren; i++) {
-    AddLabelForBlocks(root->GetChild(i));
+// non-recursive, called once for each block of an instruction.
+static void AddLabelForBlock(BasicBlock *root) {
+  // there're two types of BasicBlock:
+  // one is simply a wrapper of an instruction;
+  // the other is the collection of basic blocks.
+  if (!root->GetInstrAsRef().tokens.empty()) {
+    root->SetType(LabelOfInstruction(root->GetInstrAsRef().tokens));
   }
 }
 
 void BasicBlock::ReshapeBlock(BasicBlock *root) {
-  std::vector<BasicBlock *> new_children;
+  // children are moved down in place, the new ones are never more.
+  size_t num_new_children = 0;
   size_t num_children = root->children.size();
   size_t i = 0;
   while (i < num_children) {
@@ -890,207 +1101,542 @@ void BasicBlock::ReshapeBlock(BasicBlock *root) {
     }
     }
 
-    new_children.push_back(child);
+    root->children[num_new_children++] = child;
     i ++;
   }
 
-  root->children.clear();
-  root->children = new_children;
+  root->children.resize(num_new_children);
 }
 
-void BasicBlock::ReshapeBlockTree(BasicBlock *root) {
-  for (auto *child : root->children) {
-    ReshapeBlockTree(child);
+// Calls `fn` on the blocks of the tree of `root`, children before their
+// parent, as the blocks were before any call.
+template <typename Fn>
+static void WalkBlocksBottomUp(BasicBlock *root, Fn &&fn) {
+  struct Collect {
+    std::vector<BasicBlock *> blocks;
+    void Enter(BasicBlock *block, size_t) { this->blocks.push_back(block); }
+  } collect;
+  VisitBlocks(root, collect);
+  const auto &blocks = collect.blocks;
+  // descendants come after their ancestors in pre-order.
+  for (size_t i = blocks.size(); i > 0; i--) {
+    fn(blocks[i - 1]);
   }
-  ReshapeBlock(root);
+}
+
+void BasicBlock::ReshapeBlockTree(BasicBlock *root) {
+  WalkBlocksBottomUp(root, ReshapeBlock);
 }
 void BasicBlock::MergeIfElseBlock(BasicBlock *root) {
-  std::vector<BasicBlock *> new_children;
+  Arena *arena = root->children.GetArena();
+  size_t num_new_children = 0;
   size_t num_children = root->children.size();
   size_t i = 0;
 
   while  (i < num_children) {
     auto *child = root->children[i];
     if (child->GetType() == BlockType::BIF) {
-      assert(child->GetNumChildren() == 1);
+      Expect(child->GetNumChildren() == 1, child->instruction, "If without a block");
       if (i + 1 < num_children && root->children[i + 1]->GetType() == 
           BlockType::BELSE) {
         auto *next = root->children[i + 1];
-        assert(next->GetNumChildren() == 1);
-        auto if_else_block = new BasicBlock();  
+        Expect(next->GetNumChildren() == 1, next->instruction, "Else without a block");
+        auto if_else_block = arena->New<BasicBlock>(arena);
         if_else_block->SetType(BlockType::BIFELSE);
         if_else_block->instruction = child->instruction;
-        if_else_block->children = {child->children[0], next->children[0]};
-        new_children.push_back(if_else_block);
+        if_else_block->AddChild(child->children[0]);
+        if_else_block->AddChild(next->children[0]);
+        root->children[num_new_children++] = if_else_block;
 
-        // will not be used later.
-        child->children.clear(); delete child;
-        next->children.clear(); delete next;
+        // will not be used later, freed with the arena.
+        child->children.clear();
+        next->children.clear();
         i += 2;
       } else {
-        new_children.push_back(child);
+        root->children[num_new_children++] = child;
         i++;
       }
     } else {
-      new_children.push_back(child);
+      root->children[num_new_children++] = child;
       i++;
     }
   }
 
-  for (auto *child : new_children) {
-    if (child->GetType() == BlockType::BELSE) {
-      fprintf(stderr, "Else block is not followed by if block\n");
-      assert(false);
-    }
+  root->children.resize(num_new_children);
+  for (auto *child : root->children) {
+    Expect(child->GetType() != BlockType::BELSE, child->instruction,
+           "Else does not follow an if");
   }
-
-  root->children.clear();
-  root->children = new_children;
 }
-void BasicBlock::MergeIfElseBlockTree(BasicBlock *root) {
-  for (auto child : root->children) {
-    MergeIfElseBlockTree(child);
+auto BasicBlock::MergeIfElseBlockTree(BasicBlock *root) -> std::vector<Lex::Diagnostic> {
+  std::vector<Lex::Diagnostic> diagnostics;
+  // ifs are not declarations, so top-level ones are errors too.
+  size_t num_new_children = 0;
+  for (auto *child : root->children) {
+    try {
+      Expect(child->btype != BlockType::BIF && child->btype != BlockType::BELSE,
+             child->instruction, "Statement outside of a function");
+      WalkBlocksBottomUp(child, MergeIfElseBlock);
+      root->children[num_new_children++] = child;
+    } catch (const Lex::SourceError &e) {
+      diagnostics.push_back({e.GetLine(), e.what(), child->GetLineRange()});
+    }
   }
-  MergeIfElseBlock(root);
+  root->children.resize(num_new_children);
+  return diagnostics;
 }
 
-auto BasicBlock::GetLineRange() const -> std::pair<size_t, size_t> {
-  std::pair<size_t, size_t> ret = {-1, 0};
-  if (!this->instruction.tokens.empty()) {
-    ret = this->instruction.GetLineRange();
-  }
+// The union of the ranges of the instructions of a tree, which
+// Instruction::*Range returns.
+template <auto Range>
+struct InstructionRange {
+  std::pair<size_t, size_t> range = {-1, 0};
 
-  for (auto *child : this->children) {
-    auto rg = child->GetLineRange();
-    if (rg.first < ret.first) {
-      ret.first = rg.first;
+  void Enter(const BasicBlock *block, size_t) {
+    const auto &instr = block->GetInstrAsRef();
+    if (instr.tokens.empty()) {
+      return;
     }
-    if (rg.second > ret.second) {
-      ret.second = rg.second;
+    auto rg = (instr.*Range)();
+    if (rg.first < this->range.first) {
+      this->range.first = rg.first;
+    }
+    if (rg.second > this->range.second) {
+      this->range.second = rg.second;
     }
   }
+};
 
-  return ret;
+auto BasicBlock::GetLineRange() const -> std::pair<size_t, size_t> {
+  InstructionRange<&Instruction::GetLineRange> lines;
+  VisitBlocks(this, lines);
+  return lines.range;
 }
 
-static BasicBlock *CLangParseRecur(const std::vector<Lex::Token> &tokens, 
-                                   size_t *index) {
-  BasicBlock *top = new BasicBlock();
-  assert (index != nullptr);
-  assert (top != nullptr);
-  Instruction instr;
+auto BasicBlock::GetByteRange() const -> std::pair<size_t, size_t> {
+  InstructionRange<&Instruction::GetByteRange> bytes;
+  VisitBlocks(this, bytes);
+  return bytes.range;
+}
 
-  while (*index < tokens.size()) {
-    switch (tokens[*index].label) {
+// Instructions are spans of `tokens`, which has no null tokens.
+// Each block is labeled when it is made, and its children are reshaped
+// when it is closed, so that every block is handled once.
+// Blocks being parsed are kept on a stack on the heap, so the nesting of
+// brackets is only limited by memory.
+static BasicBlock *CLangParseTokens(Lex::TokenSpan tokens, Arena *arena) {
+  struct OpenBlock {
+    BasicBlock *block;
+    // the current instruction is tokens[begin, index)
+    size_t begin;
+  };
+  BasicBlock *root = arena->New<BasicBlock>(arena);
+  std::vector<OpenBlock> stack = {{root, 0}};
+
+  // add tokens[top.begin, end) as an instruction.
+  auto add_instruction = [&](const OpenBlock &top, size_t end) {
+    if (end > top.begin) {
+      const Lex::TokenSpan span(tokens.data() + top.begin, tokens.data() + end);
+      auto *block = arena->New<BasicBlock>(arena, Instruction(span));
+      AddLabelForBlock(block);
+      top.block->AddChild(block);
+    }
+  };
+
+  size_t index = 0;
+  while (index < tokens.size()) {
+    OpenBlock &top = stack.back();
+    switch (tokens[index].label) {
     case Lex::TokenLabel::TLEFTBRACKET: {
       // end of an instruction.
-      if (!instr.tokens.empty()) {
-        top->AddChild(new BasicBlock(instr));
-        instr.tokens.clear();
-      }
-      *index += 1;
-      BasicBlock *child = CLangParseRecur(tokens, index);
+      add_instruction(top, index);
+      index += 1;
+      BasicBlock *child = arena->New<BasicBlock>(arena);
       child->HasBracket();
-      top->AddChild(child);
+      top.block->AddChild(child);
+      stack.push_back({child, index});
       break;
     }
     case Lex::TokenLabel::TRIGHTBRACKET: {
       // finished this block
-      // return to the caller.
-      if (!instr.tokens.empty()) {
-        top->AddChild(new BasicBlock(instr));
-        instr.tokens.clear();
-      }
-      *index += 1;
-      return top;
+      // return to the parent.
+      add_instruction(top, index);
+      index += 1;
+      BasicBlock::ReshapeBlock(top.block);
+      if (stack.size() == 1) {
+        // unbalanced, the rest is ignored.
+        return root;
+      }
+      stack.pop_back();
+      stack.back().begin = index;
+      break;
     }
 
     case Lex::TokenLabel::TSEMICOLON: {
       // finished this instruction
       // add it to the block
-      instr.tokens.push_back(tokens[*index]);
-      if (!instr.tokens.empty()) {
-        top->AddChild(new BasicBlock(instr));
-        instr.tokens.clear();
-      }
-      *index += 1;
-      break;
-    }
-
-    case Lex::TokenLabel::TNULL: {
-      // discard.
-      *index += 1;
+      index += 1;
+      add_instruction(top, index);
+      top.begin = index;
       break;
     }
 
     default: {
-      instr.tokens.push_back(tokens[*index]);
-      *index += 1;
+      index += 1;
       break;
     }
     }
   }
 
-  AddLabelForBlocks(top);
-  BasicBlock::ReshapeBlockTree(top);
-  return top;
+  // end of input, close the blocks left open.
+  while (!stack.empty()) {
+    BasicBlock::ReshapeBlock(stack.back().block);
+    stack.pop_back();
+  }
+  return root;
 }
 
-auto Instruction::Print(std::ostream &os) const -> std::ostream & {
-  PrintIdent(os);
+auto Instruction::Print(std::ostream &os, size_t depth) const -> std::ostream & {
+  PrintIdent(os, depth);
   for (const auto &token : tokens) {
-    os << token.buf;
+    os << token.Text();
     os << TO_STD_STRING(" ");
   }
   os << TO_STD_STRING("\n");
   return os;
 }
 
-auto BasicBlock::Print(std::ostream &os) const -> std::ostream & {
+// Prints a tree as BasicBlock::Print does, indented from `base`.
+struct BlockPrinter {
+  std::ostream &os;
+  size_t base;
+
+  void Enter(const BasicBlock *block, size_t depth) {
+    depth += this->base;
+    PrintIdent(this->os, depth);
+    if (!block->GetInstrAsRef().tokens.empty()) {
+      block->GetInstrAsRef().Print(os, depth);
+    }
+
+    if (block->HasChildren()) {
+      this->os << TO_STD_STRING("\n");
+      if (block->IsBracketed()) {
+        PrintIdent(this->os, depth);
+        this->os << TO_STD_STRING("{\n");
+      }
+    } else if (block->IsBracketed()) {
+      this->os << TO_STD_STRING("\n");
+      PrintIdent(this->os, depth + 1);
+      this->os << TO_STD_STRING("{ }\n");
+    }
+  }
+
+  void LeaveScope(const BasicBlock *block, size_t depth) {
+    if (block->IsBracketed()) {
+      PrintIdent(this->os, depth + this->base);
+      this->os << TO_STD_STRING("}\n");
+    }
+  }
+};
+
+auto BasicBlock::Print(std::ostream &os, size_t depth) const -> std::ostream & {
   // after reshaping, this assertion may not be true.
   // assert(this->instruction.tokens.empty() || 
   //        this->children.empty());
 
-  PrintIdent(os);
-  if (!this->instruction.tokens.empty()) {
-    this->instruction.Print(os);
-    // return os;
+  BlockPrinter printer = {os, depth};
+  VisitBlocks(this, printer);
+  return os;
+}
+
+// An item of the root: an instruction, or a bracketed block with its
+// brackets.
+struct TopLevelItem {
+  Lex::TokenSpan tokens;
+  bool bracketed;
+};
+
+// Split `tokens` into the items of the root, as CLangParseTokens would,
+// matching brackets by counting them. Tokens after the last instruction
+// are dropped.
+static auto ScanTopLevelItems(Lex::TokenSpan tokens) -> std::vector<TopLevelItem> {
+  std::vector<TopLevelItem> items;
+  const Lex::Token *base = tokens.data();
+  size_t begin = 0;
+  size_t index = 0;
+  while (index < tokens.size()) {
+    const auto label = tokens[index].label;
+    assert(label != Lex::TokenLabel::TNULL);
+    if (label == Lex::TokenLabel::TSEMICOLON) {
+      index += 1;
+      items.push_back({Lex::TokenSpan(base + begin, base + index), false});
+      begin = index;
+    } else if (label == Lex::TokenLabel::TLEFTBRACKET) {
+      if (index > begin) {
+        items.push_back({Lex::TokenSpan(base + begin, base + index), false});
+      }
+      // to the matching bracket, or to the end of input.
+      size_t depth = 0;
+      begin = index;
+      for (; index < tokens.size(); index++) {
+        if (tokens[index].label == Lex::TokenLabel::TLEFTBRACKET) {
+          depth += 1;
+        } else if (tokens[index].label == Lex::TokenLabel::TRIGHTBRACKET) {
+          depth -= 1;
+          if (depth == 0) {
+            index += 1;
+            break;
+          }
+        }
+      }
+      items.push_back({Lex::TokenSpan(base + begin, base + index), true});
+      begin = index;
+    } else if (label == Lex::TokenLabel::TRIGHTBRACKET) {
+      // unbalanced, the rest is ignored.
+      if (index > begin) {
+        items.push_back({Lex::TokenSpan(base + begin, base + index), false});
+      }
+      break;
+    } else {
+      index += 1;
+    }
   }
+  return items;
+}
 
-  if (!this->children.empty()) {
+// Returns the block of an item of the root.
+static auto ParseTopLevelItem(const TopLevelItem &item, Arena *arena) -> BasicBlock * {
+  if (item.bracketed) {
+    // the block is the only child of the root of its tokens.
+    return CLangParseTokens(item.tokens, arena)->GetChild(0);
+  }
+  auto *block = arena->New<BasicBlock>(arena, Instruction(item.tokens));
+  AddLabelForBlock(block);
+  return block;
+}
 
-    os << TO_STD_STRING("\n");
-    if (this->has_bracket_) {
-      PrintIdent(os);
-      os << TO_STD_STRING("{\n");
+// a thread is not worth it for fewer tokens.
+static constexpr size_t min_parse_chunk_size = 64 * 1024;
+
+// The items of the root are parsed by `nthreads` threads, each into an
+// arena of its own which `arena` adopts, and are then put under the root
+// in order and grouped as the serial parser does.
+static BasicBlock *CLangParseTokensParallel(Lex::TokenSpan tokens, Arena *arena,
+                                           size_t nthreads) {
+  const auto items = ScanTopLevelItems(tokens);
+
+  // contiguous ranges of items with about the same number of tokens.
+  std::vector<size_t> bounds = {0};
+  size_t num_tokens = 0;
+  for (size_t i = 0; i < items.size(); i++) {
+    num_tokens += items[i].tokens.size();
+    if (num_tokens * nthreads >= bounds.size() * tokens.size() && i + 1 < items.size()) {
+      bounds.push_back(i + 1);
     }
-  
-    ++ident;
-    for (const auto *child : this->children) {
-      child->Print(os);
+  }
+  bounds.push_back(items.size());
+  nthreads = bounds.size() - 1;
+
+  std::vector<BasicBlock *> blocks(items.size());
+  std::vector<std::unique_ptr<Arena>> arenas(nthreads);
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < nthreads; k++) {
+    arenas[k].reset(new Arena());
+    workers.emplace_back([&, k]() {
+      for (size_t i = bounds[k]; i < bounds[k + 1]; i++) {
+        blocks[i] = ParseTopLevelItem(items[i], arenas[k].get());
+      }
+    });
+  }
+  for (size_t k = 0; k < nthreads; k++) {
+    workers[k].join();
+    arena->Adopt(std::move(arenas[k]));
+  }
+
+  BasicBlock *root = arena->New<BasicBlock>(arena);
+  for (auto *block : blocks) {
+    root->AddChild(block);
+  }
+  BasicBlock::ReshapeBlock(root);
+  return root;
+}
+
+auto CLangParser(const std::vector<Lex::Token> &tokens, size_t nthreads) -> ParseTree {
+  std::unique_ptr<Arena> arena(new Arena());
+
+  // null tokens are discarded, instructions are spans of the others.
+  std::unique_ptr<std::vector<Lex::Token>> non_null;
+  const auto is_null = [](const Lex::Token &token) {
+    return token.label == Lex::TokenLabel::TNULL;
+  };
+  if (std::any_of(tokens.begin(), tokens.end(), is_null)) {
+    non_null.reset(new std::vector<Lex::Token>());
+    std::remove_copy_if(tokens.begin(), tokens.end(), std::back_inserter(*non_null), is_null);
+  }
+
+  const auto &parsed = non_null ? *non_null : tokens;
+  const Lex::TokenSpan span(parsed.data(), parsed.data() + parsed.size());
+  nthreads = std::min(nthreads, parsed.size() / min_parse_chunk_size);
+  BasicBlock *root = nthreads > 1 ? CLangParseTokensParallel(span, arena.get(), nthreads)
+                                  : CLangParseTokens(span, arena.get());
+  return ParseTree(std::move(arena), root, std::move(non_null));
+}
+
+auto CLangParser(Lex::TokenSpan tokens) -> ParseTree {
+  assert(std::none_of(tokens.begin(), tokens.end(), [](const Lex::Token &token) {
+    return token.label == Lex::TokenLabel::TNULL;
+  }));
+  std::unique_ptr<Arena> arena(new Arena());
+  BasicBlock *root = CLangParseTokens(tokens, arena.get());
+  return ParseTree(std::move(arena), root);
+}
+
+// The same as the parser at the top level: the items of the root are
+// grouped as ReshapeBlock would. Blocks are matched by counting brackets,
+// their tokens are not looked at otherwise.
+auto CLangScanTopLevel(const std::vector<Lex::Token> &tokens) -> std::vector<TopLevelUnit> {
+  const auto items = ScanTopLevelItems(
+    Lex::TokenSpan(tokens.data(), tokens.data() + tokens.size()));
+
+  // Returns the lines of the instructions in `span`, like GetLineRange
+  // of the block parsed from it.
+  const auto line_range = [](Lex::TokenSpan span) {
+    std::pair<size_t, size_t> ret = {-1, 0};
+    const auto extend = [&](const Lex::Token &first, const Lex::Token &last) {
+      ret.first = std::min<size_t>(ret.first, first.line);
+      ret.second = std::max<size_t>(ret.second, last.line);
+    };
+    size_t begin = 0;
+    for (size_t i = 0; i < span.size(); i++) {
+      switch (span[i].label) {
+      case (Lex::TokenLabel::TSEMICOLON): {
+        extend(span[begin], span[i]);
+        begin = i + 1;
+        break;
+      }
+      case (Lex::TokenLabel::TLEFTBRACKET):
+      case (Lex::TokenLabel::TRIGHTBRACKET): {
+        if (i > begin) {
+          extend(span[begin], span[i - 1]);
+        }
+        begin = i + 1;
+        break;
+      }
+      default: {
+        break;
+      }
+      }
     }
-  
-    --ident;
-    if (this->has_bracket_) {
-      PrintIdent(os);
-      os << TO_STD_STRING("}\n");
+    return ret;
+  };
+
+  std::vector<TopLevelUnit> units;
+  size_t i = 0;
+  while (i < items.size()) {
+    TopLevelUnit unit;
+    unit.type = BlockType::BCOMMON;
+    size_t last = i;
+    if (!items[i].bracketed) {
+      unit.head = items[i].tokens;
+      unit.type = LabelOfInstruction(unit.head);
+    }
+    switch (unit.type) {
+    case (BlockType::BDO): {
+      // the body and the while.
+      last = std::min(i + 2, items.size() - 1);
+      break;
     }
-  } else {
-    if (this->has_bracket_) {
-      ++ident;
-      os << TO_STD_STRING("\n");
-      PrintIdent(os);
-      os << TO_STD_STRING("{ }\n");
-      --ident;
+    case (BlockType::BFUNCTION):
+    case (BlockType::BIF):
+    case (BlockType::BELSE):
+    case (BlockType::BFOR):
+    case (BlockType::BWHILE): {
+      if (i + 1 < items.size() && 
+          unit.head.back().label != Lex::TokenLabel::TSEMICOLON) {
+        last = i + 1;
+      }
+      break;
+    }
+    default: {
+      break;
     }
+    }
+    unit.tokens = Lex::TokenSpan(items[i].tokens.begin(), items[last].tokens.end());
+    unit.lines = line_range(unit.tokens);
+    units.push_back(unit);
+    i = last + 1;
   }
-  return os;
+  return units;
+}
+
+FlatTree::FlatTree(const BasicBlock *root) {
+  // count first, so that the arrays are allocated once.
+  size_t num_nodes = 0;
+  size_t num_tokens = 0;
+  std::vector<const BasicBlock *> blocks = {root};
+  while (!blocks.empty()) {
+    const auto block = blocks.back();
+    blocks.pop_back();
+    num_nodes++;
+    num_tokens += block->GetInstrAsRef().tokens.size();
+    for (size_t i = 0; i < block->GetNumChildren(); i++) {
+      blocks.push_back(block->GetChild(i));
+    }
+  }
+  this->types_.reserve(num_nodes);
+  this->brackets_.reserve(num_nodes);
+  this->depths_.reserve(num_nodes);
+  this->subtree_sizes_.reserve(num_nodes);
+  this->parents_.reserve(num_nodes);
+  this->token_begin_.reserve(num_nodes + 1);
+  this->tokens_.reserve(num_tokens);
+
+  // pre-order walk, with the parent of each block.
+  std::vector<std::pair<const BasicBlock *, NodeId>> stack = {{root, npos}};
+  this->token_begin_.push_back(0);
+  while (!stack.empty()) {
+    const auto block = stack.back().first;
+    const NodeId parent = stack.back().second;
+    stack.pop_back();
+
+    const NodeId id = static_cast<NodeId>(this->types_.size());
+    this->types_.push_back(static_cast<uint8_t>(block->GetType()));
+    this->brackets_.push_back(block->IsBracketed());
+    this->depths_.push_back(parent == npos ? 0 : this->depths_[parent] + 1);
+    this->subtree_sizes_.push_back(1);
+    this->parents_.push_back(parent);
+
+    const auto &tokens = block->GetInstrAsRef().tokens;
+    this->tokens_.insert(this->tokens_.end(), tokens.begin(), tokens.end());
+    this->token_begin_.push_back(static_cast<uint32_t>(this->tokens_.size()));
+
+    // the first child is visited first.
+    for (size_t i = block->GetNumChildren(); i > 0; i--) {
+      stack.push_back({block->GetChild(i - 1), id});
+    }
+  }
+
+  // children come after their parent.
+  for (size_t id = this->Size() - 1; id > 0; id--) {
+    this->subtree_sizes_[this->parents_[id]] += this->subtree_sizes_[id];
+  }
+}
+
+auto FlatTree::GetFuncCalls(NodeId id) const -> std::vector<Lex::Atom> {
+  const auto rg = this->GetTokens(id);
+  return FuncCallsOf(rg.first, rg.second - rg.first);
+}
+
+auto FlatTree::GetVarNames(NodeId id) const -> std::vector<Lex::Atom> {
+  const auto rg = this->GetTokens(id);
+  return VarNamesOf(rg.first, rg.second - rg.first);
 }
 
-auto CLangParser(const std::vector<Lex::Token> &tokens) -> BasicBlock * {
-  size_t idx = 0;
-  // recursively parse the tokens
-  return CLangParseRecur(tokens, &idx);
+auto FlatTree::BytesUsed() const -> size_t {
+  return this->types_.capacity() + this->brackets_.capacity() / 8 +
+    (this->depths_.capacity() + this->subtree_sizes_.capacity() +
+     this->parents_.capacity() + this->token_begin_.capacity()) * sizeof(uint32_t) +
+    this->tokens_.capacity() * sizeof(Lex::Token);
 }
 
 } // namespace Parser
@@ -1215,7 +1761,7 @@ auto StackFrame::Alloc(size_t size) -> size_t {
   return this->alloc_size;
 }
 
-auto SymbolTable::Lookup(const std::string &name) -> SymbolType * {
+auto SymbolTable::Lookup(Lex::Atom name) -> SymbolType * {
   for (auto it = this->table_stack.rbegin(); it != this->table_stack.rend(); 
        ++it) {
     auto table = *it;
@@ -1237,17 +1783,57 @@ auto X86Generator::GenerateCode(Parser::BasicBlock *root) -> std::string {
   assert(this->symtab.GetStackSize() == 0);
 
   // FIXME: .file source_file.c
-  this->GenerateCodeForBlock(os, root);
+  // the root block. The code of a top-level declaration is kept only if
+  // all of it is generated, otherwise it is skipped and reported.
+  this->symtab.Enter(os);
+  for (size_t i = 0; i < root->GetNumChildren(); i++) {
+    auto *child = root->GetChild(i);
+    std::ostringstream child_os;
+    const size_t depth = this->symtab.GetStackDepth();
+    try {
+      this->GenerateCodeForBlock(child_os, child);
+      os << child_os.str();
+    } catch (const Lex::SourceError &e) {
+      this->symtab.LeaveTo(depth);
+      this->diagnostics.push_back({e.GetLine(), e.what(), child->GetLineRange()});
+    }
+  }
+  this->symtab.Leave(os);
 
   // dump all c string consts into asm code
   this->DumpCString(os);
   return os.str();
 }
 
+// Blocks whose code is being generated are kept on a stack on the heap, so
+// the nesting of blocks is only limited by memory.
 auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlock *block) 
   -> std::ostringstream & {
   assert(block != nullptr); 
 
+  std::vector<OpenCodeBlock> stack = {{block}};
+  this->GenerateCodeBeforeChildren(os, stack.back());
+  while (!stack.empty()) {
+    OpenCodeBlock &top = stack.back();
+    if (top.next == top.num_children) {
+      this->GenerateCodeAfterChildren(os, top);
+      stack.pop_back();
+      continue;
+    }
+    if (top.next > 0) {
+      this->GenerateCodeBetweenChildren(os, top);
+    }
+    auto *child = top.block->GetChild(top.next++);
+    stack.push_back({child});
+    this->GenerateCodeBeforeChildren(os, stack.back());
+  }
+
+  return os;
+}
+
+auto X86Generator::GenerateCodeBeforeChildren(std::ostringstream &os, OpenCodeBlock &open)
+  -> std::ostringstream & {
+  auto *block = open.block;
   auto instr = block->GetInstruction();
   switch (block->GetType()) {
   case (Parser::BlockType::BCOMMON): {
@@ -1257,20 +1843,13 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     } else {
       // is root block
       this->symtab.Enter(os);
-      auto num_children = block->GetNumChildren();
-      for (size_t i = 0; i < num_children; i++) {
-        this->GenerateCodeForBlock(os, block->GetChild(i));
-        // os << TO_STD_STRING("\n");
-      }
-      // leave this block, let the symbol table recover
-      // stack pointer.
-      this->symtab.Leave(os);
+      open.num_children = block->GetNumChildren();
     }
     break;
   }
   case (Parser::BlockType::BFUNCTION): {
     assert(!instr.tokens.empty());
-    assert(block->GetNumChildren() == 1);
+    Parser::Expect(block->GetNumChildren() == 1, instr, "Function without a body");
     // FIXME: not all functions should be labeled 'global'.
 
     // example asm code:
@@ -1278,16 +1857,16 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     // .globl main
     os << TO_STD_STRING("\n\t.text\n");
     os << TO_STD_STRING("\t.globl ");
-    os << instr.tokens[1].buf;
+    os << instr.tokens[1].Text();
     os << TO_STD_STRING("\n");
 
     // .type main, @function
     os << TO_STD_STRING("\t.type ");
-    os << instr.tokens[1].buf;
+    os << instr.tokens[1].Text();
     os << TO_STD_STRING(", @function\n");
 
     // main:
-    os << instr.tokens[1].buf;
+    os << instr.tokens[1].Text();
     os << TO_STD_STRING(":\n");
 
     // endbr64
@@ -1296,10 +1875,7 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     // this->GenerateCodeForInstruction(os, block->GetInstruction());
     this->symtab.Enter(os);
     this->StoreArgsIntoMem(os, block->GetInstruction());
-    this->GenerateCodeForBlock(os, block->GetChild(0));
-    this->symtab.Leave(os);
-    // force return
-    os << TO_STD_STRING("\tret\n");
+    open.num_children = 1;
     break;
   }
   case (Parser::BlockType::BWHILE): {
@@ -1315,22 +1891,23 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     //   jmp .L2
     // .L3:
     assert(!instr.tokens.empty());
-    assert(block->GetNumChildren() == 1);
+    Parser::Expect(block->GetNumChildren() == 1, instr, "While without a block");
+    Parser::Expect(instr.tokens.size() == 4, instr, "Unsupported condition of while");
     size_t enter_label = this->branch_count++;
     size_t leave_label = this->branch_count++;
     os << ".L" << enter_label << ":\n";
-    assert(instr.tokens.size() == 4);
     this->LoadValueIntoReg(os, instr.tokens[2], X86Registers::AX);
     os << "\tcmp $0, %rax\n";
     os << "\tje .L" << leave_label << "\n";
-    this->GenerateCodeForBlock(os, block->GetChild(0));
-    os << "\tjmp .L" << enter_label << "\n";
-    os << ".L" << leave_label << ":" << "\n";
+    open.labels[0] = enter_label;
+    open.labels[1] = leave_label;
+    open.num_children = 1;
     break;
   }
   case (Parser::BlockType::BIF): {
     assert(!instr.tokens.empty());
-    assert(block->GetNumChildren() == 1);
+    Parser::Expect(block->GetNumChildren() == 1, instr, "If without a block");
+    Parser::Expect(instr.tokens.size() >= 3, instr, "If without a condition");
     // example source:
     // if (some_var) 
     //   do_something();
@@ -1343,8 +1920,8 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     this->LoadValueIntoReg(os, instr.tokens[2], X86Registers::AX);
     os << "\tcmp $0, %rax\n";
     os << "\tje .L" << leave_label << "\n";
-    this->GenerateCodeForBlock(os, block->GetChild(0));
-    os << ".L" << leave_label << ":" << "\n";
+    open.labels[0] = leave_label;
+    open.num_children = 1;
     break;
   }
   case (Parser::BlockType::BIFELSE): {
@@ -1363,16 +1940,15 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
     // .Lend_label:
     assert(!instr.tokens.empty());
     assert(block->GetNumChildren() == 2);
+    Parser::Expect(instr.tokens.size() >= 3, instr, "If without a condition");
     size_t else_label = this->branch_count++;
     size_t end_label = this->branch_count++;
     this->LoadValueIntoReg(os, instr.tokens[2], X86Registers::AX);
     os << "\tcmp $0, %rax\n";
     os << "\tje .L" << else_label << "\n";
-    this->GenerateCodeForBlock(os, block->GetChild(0));
-    os << "\tjmp .L" << end_label << "\n";
-    os << ".L" << else_label << ":\n";
-    this->GenerateCodeForBlock(os, block->GetChild(1));
-    os << ".L" << end_label << ":\n";
+    open.labels[0] = else_label;
+    open.labels[1] = end_label;
+    open.num_children = 2;
     break;
   }
   case (Parser::BlockType::BVARDECLARE): {
@@ -1400,31 +1976,34 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
       break;
     }
     default: {
-      fprintf(stderr, "Error: Invalid type\n");
-      assert(false);
+      Parser::Fail(instr, "Unsupported type in declaration");
     }
     }
 
     // compute pointer level
     symtype.pointer_level = 0;
     size_t i;
-    for (i = 1; instr.tokens[i].label == Lex::TokenLabel::TMUL; i++) {
+    for (i = 1; instr.GetTypeOfToken(i) == Lex::TokenLabel::TMUL; i++) {
       symtype.pointer_level++;
     }
-    if (symtype.pointer_level == 0 && symtype.base_type == SymbolType::BaseType::TVOID) {
-      fprintf(stderr, "cannot create scalar of void type.\n");
-      assert(false);
-    }
+    Parser::Expect(symtype.pointer_level != 0 || 
+                   symtype.base_type != SymbolType::BaseType::TVOID,
+                   instr, "Cannot create scalar of void type");
+    Parser::Expect(instr.GetTypeOfToken(i) == Lex::TokenLabel::TALPHA, instr,
+                   "Declaration without a name");
     
     // name of the var.
-    const std::string &name = instr.tokens[i].buf;
+    const std::string_view name = instr.tokens[i].Text();
 
     // check whether this var is an array.
     if (i + 1 < instr.tokens.size()) {
-      assert(instr.tokens[i + 1].label == Lex::TokenLabel::TLEFTSQ);
-      assert(instr.tokens[i + 3].label == Lex::TokenLabel::TRIGHTSQ);
-      auto arr_size = Atoi(instr.tokens[i + 2].buf);
-      assert(arr_size > 0);
+      Parser::Expect(instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TLEFTSQ &&
+                     instr.GetTypeOfToken(i + 3) == Lex::TokenLabel::TRIGHTSQ,
+                     instr, "Unsupported declaration");
+      Parser::Expect(instr.GetTypeOfToken(i + 2) == Lex::TokenLabel::TDIGIT,
+                     instr.tokens[i + 2], "Array size is not a number");
+      auto arr_size = Parser::Number(instr.tokens[i + 2]);
+      Parser::Expect(arr_size > 0, instr, "Array size is not positive");
       symtype.is_array = true;
       symtype.array_size = arr_size;
     }
@@ -1458,20 +2037,21 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
       os << name << ":\n\t.zero " << mem_size << "\n";
       symtype.stack_frame = nullptr;
     }
-    this->symtab.AddSymbol(name, symtype);
+    this->symtab.AddSymbol(instr.tokens[i].atom, symtype);
     break;
   }
   case (Parser::BlockType::BRET): {
     // return the value of a single variable or a const number.
     // example: return var; return 0; return;
-    assert(instr.tokens.size() <= 2);
-    assert(instr.tokens[0].label == Lex::TokenLabel::TRETURN);
+    Parser::Expect(instr.tokens.size() <= 2 && 
+                   instr.tokens[0].label == Lex::TokenLabel::TRETURN,
+                   instr, "Unsupported return statement");
 
     if (instr.tokens.size() == 2) {
-      if (isdigit(instr.tokens[1].buf[0])) {
-        os << "\tmovq $" << instr.tokens[1].buf << ", %rax\n";
+      if (isdigit(instr.tokens[1].Text()[0])) {
+        os << "\tmovq $" << instr.tokens[1].Text() << ", %rax\n";
       } else {
-        this->LoadVarIntoReg(os, instr.tokens[1].buf, X86Registers::AX);
+        this->LoadVarIntoReg(os, instr.tokens[1], X86Registers::AX);
       }
     } else {
       // for functions like void func();
@@ -1487,30 +2067,78 @@ auto X86Generator::GenerateCodeForBlock(std::ostringstream &os, Parser::BasicBlo
 
   case (Parser::BlockType::BELSE): {
     // this block should be cleared by BasicBlock::MergeIfElseBlockTree
-    fprintf(stderr, "This is a bug. Please report it.\n");
-    assert(false);
+    Parser::Fail(instr, "Else does not follow an if");
   }
   default: {
-    fprintf(stderr, "Unknown block type\n");
-    assert(false);
+    Parser::Fail(instr, "Unsupported statement: " + 
+                 Parser::BlockTypeToString(block->GetType()));
   }
   }
 
   return os;
 }
 
-auto X86Generator::LoadVarIntoReg(std::ostringstream &os, const std::string 
-  &var_name, X86Registers reg) -> std::ostringstream & {
-  assert(isalpha(var_name[0]) || var_name[0] == '_');
+auto X86Generator::GenerateCodeBetweenChildren(std::ostringstream &os,
+                                               const OpenCodeBlock &open)
+  -> std::ostringstream & {
+  // between the if and the else.
+  if (open.block->GetType() == Parser::BlockType::BIFELSE) {
+    os << "\tjmp .L" << open.labels[1] << "\n";
+    os << ".L" << open.labels[0] << ":\n";
+  }
+  return os;
+}
 
-  auto *symtype = this->symtab.Lookup(var_name);
-  if (symtype == nullptr) {
-    fprintf(stderr, "Unknown variable %s\n", var_name.c_str());
-    assert(false);
+auto X86Generator::GenerateCodeAfterChildren(std::ostringstream &os,
+                                             const OpenCodeBlock &open)
+  -> std::ostringstream & {
+  switch (open.block->GetType()) {
+  case (Parser::BlockType::BCOMMON): {
+    if (open.block->GetInstrAsRef().tokens.size() == 0) {
+      // leave this block, let the symbol table recover
+      // stack pointer.
+      this->symtab.Leave(os);
+    }
+    break;
+  }
+  case (Parser::BlockType::BFUNCTION): {
+    this->symtab.Leave(os);
+    // force return
+    os << TO_STD_STRING("\tret\n");
+    break;
+  }
+  case (Parser::BlockType::BWHILE): {
+    os << "\tjmp .L" << open.labels[0] << "\n";
+    os << ".L" << open.labels[1] << ":" << "\n";
+    break;
+  }
+  case (Parser::BlockType::BIF): {
+    os << ".L" << open.labels[0] << ":" << "\n";
+    break;
+  }
+  case (Parser::BlockType::BIFELSE): {
+    os << ".L" << open.labels[1] << ":\n";
+    break;
   }
+  default: {
+    break;
+  }
+  }
+
+  return os;
+}
+
+auto X86Generator::LoadVarIntoReg(std::ostringstream &os, const Lex::Token
+  &var, X86Registers reg) -> std::ostringstream & {
+  const std::string_view var_name = var.Text();
+  Parser::Expect(isalpha(var_name[0]) || var_name[0] == '_', var,
+                 "Not a variable: " + std::string(var_name));
+
+  auto *symtype = this->symtab.Lookup(var.atom);
+  Parser::Expect(symtype != nullptr, var, "Unknown variable " + std::string(var_name));
   if (symtype->is_array) {
-    fprintf(stderr, "Cannot load array into register\n");
-    assert(false);
+    delete symtype;
+    throw Lex::SourceError(var.line, "Cannot load array into register");
   }
   auto sp = this->symtab.GetStackSize();
   assert(sp >= symtype->GetAddr());
@@ -1548,18 +2176,17 @@ auto X86Generator::LoadVarIntoReg(std::ostringstream &os, const std::string
   return os;
 }
 
-auto X86Generator::StoreVarFromReg(std::ostringstream &os, const std::string 
-  &var_name, X86Registers reg) -> std::ostringstream & {
-  assert(isalpha(var_name[0]) || var_name[0] == '_');
+auto X86Generator::StoreVarFromReg(std::ostringstream &os, const Lex::Token
+  &var, X86Registers reg) -> std::ostringstream & {
+  const std::string_view var_name = var.Text();
+  Parser::Expect(isalpha(var_name[0]) || var_name[0] == '_', var,
+                 "Not a variable: " + std::string(var_name));
 
-  auto *symtype = this->symtab.Lookup(var_name);
-  if (symtype == nullptr) {
-    fprintf(stderr, "Unknown variable %s\n", var_name.c_str());
-    assert(false);
-  }
+  auto *symtype = this->symtab.Lookup(var.atom);
+  Parser::Expect(symtype != nullptr, var, "Unknown variable " + std::string(var_name));
   if (symtype->is_array) {
-    fprintf(stderr, "Cannot store array from register\n");
-    assert(false);
+    delete symtype;
+    throw Lex::SourceError(var.line, "Cannot store array from register");
   }
   auto sp = this->symtab.GetStackSize();
   assert(sp >= symtype->GetAddr());
@@ -1622,7 +2249,7 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
 
   // check whether this is a function call.
   if ((instr.GetTypeOfToken(1) == Lex::TokenLabel::TLEFTPARENT)) {
-    assert(instr.tokens.size() >= 3);
+    Parser::Expect(instr.tokens.size() >= 3, instr, "Syntax error in function call");
     // probably do_something(a, b, c);
     // assembly code:
     // call do_something
@@ -1634,25 +2261,24 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
         break;
       }
 
-      // if the assertions fail, there's syntax error.
-      assert(instr.GetTypeOfToken(i) == Lex::TokenLabel::TALPHA);
-      assert(instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TCOMMA
-        || instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TRIGHTPARENT);
-
-      assert(nargs < max_args);
+      Parser::Expect(instr.GetTypeOfToken(i) == Lex::TokenLabel::TALPHA &&
+                     (instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TCOMMA ||
+                      instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TRIGHTPARENT),
+                     instr, "Syntax error in function call");
+      Parser::Expect(nargs < max_args, instr, "Too many arguments");
       this->LoadValueIntoReg(os, instr.tokens[i], function_args[nargs]);
       nargs++;
       i += 2;
     }
 
-    os << "\tcall " << instr.tokens[0].buf << "\n";
+    os << "\tcall " << instr.tokens[0].Text() << "\n";
     return os;
   } 
 
   if (instr.GetTypeOfToken(1) == Lex::TokenLabel::TASSIGN && 
       instr.GetTypeOfToken(3) == Lex::TokenLabel::TLEFTPARENT) {
     // probably ret = do_something_and_return ( );
-    assert(instr.tokens.size() >= 5);
+    Parser::Expect(instr.tokens.size() >= 5, instr, "Syntax error in function call");
 
     // prepare arguments
     size_t nargs = 0;
@@ -1661,33 +2287,33 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
         break;
       }
 
-      // if the assertions fail, there's syntax error.
-      assert(instr.GetTypeOfToken(i) == Lex::TokenLabel::TALPHA);
-      assert(instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TCOMMA
-        || instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TRIGHTPARENT);
-
-      assert(nargs < max_args);
+      Parser::Expect(instr.GetTypeOfToken(i) == Lex::TokenLabel::TALPHA &&
+                     (instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TCOMMA ||
+                      instr.GetTypeOfToken(i + 1) == Lex::TokenLabel::TRIGHTPARENT),
+                     instr, "Syntax error in function call");
+      Parser::Expect(nargs < max_args, instr, "Too many arguments");
       this->LoadValueIntoReg(os, instr.tokens[i], function_args[nargs]);
       nargs++;
       i += 2;
     }
 
-    os << "\tcall " << instr.tokens[2].buf << "\n";
+    os << "\tcall " << instr.tokens[2].Text() << "\n";
     // store the return value to memory
-    this->StoreVarFromReg(os, instr.tokens[0].buf, X86Registers::AX);
+    this->StoreVarFromReg(os, instr.tokens[0], X86Registers::AX);
     return os;
   }
 
   if (instr.GetTypeOfToken(0) == Lex::TokenLabel::TMUL) {
     // probably *pt = some_val;
-    assert(instr.tokens.size() == 4);
+    Parser::Expect(instr.tokens.size() == 4, instr, "Syntax error in assignment");
     this->LoadValueIntoReg(os, instr.tokens[3], X86Registers::R10);
     this->LoadValueIntoReg(os, instr.tokens[1], X86Registers::AX);
     const char *r10 = nullptr;
     const char *mov = nullptr;
 
-    auto *symtype_ptr = this->symtab.Lookup(instr.tokens[1].buf);
-    assert(symtype_ptr != nullptr);
+    auto *symtype_ptr = this->symtab.Lookup(instr.tokens[1].atom);
+    Parser::Expect(symtype_ptr != nullptr, instr.tokens[1],
+                   "Unknown variable " + std::string(instr.tokens[1].Text()));
     size_t memsz = 0;
     if (symtype_ptr->pointer_level > 1) {
       memsz = sizeof(void *);
@@ -1703,8 +2329,8 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
         break;
       }
       default: {
-        fprintf(stderr, "Unsupported type\n");
-        assert(0);
+        delete symtype_ptr;
+        Parser::Fail(instr, "Unsupported type");
       }
       }
     }
@@ -1739,12 +2365,12 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
     // FIXME: will simply load the value 
     // into register %rax.
     size_t incr = 1;
-    this->LoadVarIntoReg(os, instr.tokens[0].buf, X86Registers::AX);
-    auto *symtype = this->symtab.Lookup(instr.tokens[0].buf);
+    this->LoadVarIntoReg(os, instr.tokens[0], X86Registers::AX);
+    auto *symtype = this->symtab.Lookup(instr.tokens[0].atom);
 
     if (symtype->is_array) {
-      fprintf(stderr, "Array assignment not supported");
-      assert(false);
+      delete symtype;
+      Parser::Fail(instr, "Array assignment not supported");
     }
 
     if (symtype->pointer_level > 1) {
@@ -1780,29 +2406,30 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
       break;
     }
     default: {
-      fprintf(stderr, "unknown unary operator %s\n", 
-              Lex::GetNameOfLabel(instr.tokens[1].label));
-      assert(false);
+      Parser::Fail(instr, std::string("Unknown unary operator ") + 
+                   Lex::GetNameOfLabel(instr.tokens[1].label));
     }
     }
 
-    this->StoreVarFromReg(os, instr.tokens[0].buf, X86Registers::AX);
+    this->StoreVarFromReg(os, instr.tokens[0], X86Registers::AX);
     return os;
   }
 
   if (instr.tokens.size() == 3) {
     // must be assignment
     // example: a = foo; a = 2;
-    assert(instr.tokens[1].label == Lex::TokenLabel::TASSIGN);
+    Parser::Expect(instr.tokens[1].label == Lex::TokenLabel::TASSIGN, instr,
+                   "Syntax error in assignment");
     this->LoadValueIntoReg(os, instr.tokens[2], X86Registers::AX);
     // store the value in the variable
-    this->StoreVarFromReg(os, instr.tokens[0].buf, X86Registers::AX);
+    this->StoreVarFromReg(os, instr.tokens[0], X86Registers::AX);
     return os;
   }
 
   if (instr.tokens.size() == 4) {
     // get address, or deref a pointer
-    assert(instr.tokens[1].label == Lex::TokenLabel::TASSIGN);
+    Parser::Expect(instr.tokens[1].label == Lex::TokenLabel::TASSIGN, instr,
+                   "Syntax error in assignment");
 
     switch (instr.tokens[2].label) {
     case (Lex::TokenLabel::TADD): {
@@ -1819,10 +2446,12 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
     case (Lex::TokenLabel::TADRP): {
       // get the address of the operand
       // example: pt = &a;
-      auto *symtype = this->symtab.Lookup(instr.tokens[3].buf);
+      auto *symtype = this->symtab.Lookup(instr.tokens[3].atom);
+      Parser::Expect(symtype != nullptr, instr.tokens[3],
+                     "Unknown variable " + std::string(instr.tokens[3].Text()));
       if (symtype->is_global) {
         // asm code: leaq a(%rip), %rax
-        os << "\tleaq " << instr.tokens[3].buf << "(%rip), %rax\n";
+        os << "\tleaq " << instr.tokens[3].Text() << "(%rip), %rax\n";
       } else {
         // the value is on stack.
         auto sp = this->symtab.GetStackSize();
@@ -1842,13 +2471,11 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
     }
 
     default: {
-      fprintf(stderr, "syntax error\n");
-      assert(0);
-      break;
+      Parser::Fail(instr, "Syntax error in assignment");
     }
     }
 
-    this->StoreVarFromReg(os, instr.tokens[0].buf, X86Registers::AX);
+    this->StoreVarFromReg(os, instr.tokens[0], X86Registers::AX);
     return os;
   }
 
@@ -2019,7 +2646,7 @@ auto X86Generator::GenerateCodeForInstruction(std::ostringstream &os, const
     }
 
     // the result is in AX.
-    this->StoreVarFromReg(os, instr.tokens[0].buf, X86Registers::AX);
+    this->StoreVarFromReg(os, instr.tokens[0], X86Registers::AX);
     return os;
   }
 
@@ -2031,18 +2658,19 @@ auto X86Generator::LoadValueIntoReg(std::ostringstream &os, const Lex::Token &to
   
   const char *reg_name = X86Regs64Bit[static_cast<int>(reg)];
   if (token.label == Lex::TokenLabel::TDOUBLEQUOTE) {
-    const auto var_name = this->GetNameOfString(token.buf);
+    const auto var_name = this->GetNameOfString(token.Text());
     // example: leaq var_name(%rip), %rax
     os << "\tleaq " << var_name << "(%rip), %" << reg_name << "\n";
     return os;
   }
-  assert(token.label == Lex::TokenLabel::TALPHA);
+  Parser::Expect(token.label == Lex::TokenLabel::TALPHA, token,
+                 "Not a value: " + std::string(token.Text()));
 
-  if (isdigit(token.buf[0])) {
-    long val = Atoi(token.buf);
+  if (isdigit(token.Text()[0])) {
+    long val = Parser::Number(token);
     os << "\tmovq $" << val << ", %" << reg_name << "\n";
   } else {
-    this->LoadVarIntoReg(os, token.buf, reg);
+    this->LoadVarIntoReg(os, token, reg);
   }
 
   return os;
@@ -2074,7 +2702,7 @@ auto X86Generator::StoreArgsIntoMem(std::ostringstream &os, const Parser::Instru
     i++;
   }
   i++;
-  assert(i < instr.tokens.size());
+  Parser::Expect(i < instr.tokens.size(), instr, "Function without parameters");
 
   while (instr.GetTypeOfToken(i) != Lex::TokenLabel::TRIGHTPARENT) {
     size_t j = i;
@@ -2101,9 +2729,8 @@ auto X86Generator::StoreArgsIntoMem(std::ostringstream &os, const Parser::Instru
     }
 
     default: {
-      fprintf(stderr, "unsupported type name %s\n", instr.tokens[i].buf.c_str());
-      assert(0);
-      break;
+      throw Lex::SourceError(instr.tokens[i].line, "Unsupported type name " + 
+                             std::string(instr.tokens[i].Text()));
     }
     }
 
@@ -2113,9 +2740,13 @@ auto X86Generator::StoreArgsIntoMem(std::ostringstream &os, const Parser::Instru
       symtype.pointer_level++;
       j++;
     }
+    Parser::Expect(symtype.pointer_level != 0 ||
+                   symtype.base_type != SymbolType::BaseType::TVOID,
+                   instr.tokens[i], "Cannot create scalar of void type");
 
     // argument name
-    assert(instr.GetTypeOfToken(j) == Lex::TokenLabel::TALPHA);
+    Parser::Expect(instr.GetTypeOfToken(j) == Lex::TokenLabel::TALPHA, instr,
+                   "Parameter without a name");
     auto stack_frame = this->symtab.GetCurrentStackFrame();
     symtype.stack_frame = stack_frame;
     size_t old_size = stack_frame->alloc_size;
@@ -2123,14 +2754,15 @@ auto X86Generator::StoreArgsIntoMem(std::ostringstream &os, const Parser::Instru
     if (stack_frame->alloc_size > old_size) {
       os << "\taddq $-" << stack_frame->alloc_size - old_size << ", %rsp\n";
     }
-    this->symtab.AddSymbol(instr.tokens[j].buf, symtype);
-    assert(nargs < max_args);
-    this->StoreVarFromReg(os, instr.tokens[j].buf, function_args[nargs++]);
+    this->symtab.AddSymbol(instr.tokens[j].atom, symtype);
+    Parser::Expect(nargs < max_args, instr, "Too many parameters");
+    this->StoreVarFromReg(os, instr.tokens[j], function_args[nargs++]);
     j++;
 
     i = j;
-    assert(instr.GetTypeOfToken(i) == Lex::TokenLabel::TCOMMA ||
-      instr.GetTypeOfToken(i) == Lex::TokenLabel::TRIGHTPARENT) ;
+    Parser::Expect(instr.GetTypeOfToken(i) == Lex::TokenLabel::TCOMMA ||
+                   instr.GetTypeOfToken(i) == Lex::TokenLabel::TRIGHTPARENT,
+                   instr, "Syntax error in parameters");
   }
 
   return os;
@@ -2140,45 +2772,37 @@ auto X86Generator::StoreArgsIntoMem(std::ostringstream &os, const Parser::Instru
 
 namespace BugInsertor {
 
-static auto BreakOrContExec(Parser::BasicBlock *bb, size_t *cur, size_t count) 
-  -> bool {
-  if (*cur > count) {
-    return false;
-  }
-
-  const auto &instr = bb->GetInstrAsRef();
-  const auto instp = instr.GetTypeOfToken(0);
+// Removes the `count`th break or continue in pre-order.
+struct BreakOrContRemover {
+  size_t count;
+  size_t cur{0};
+  bool removed{false};
 
-  if (instp == Lex::TokenLabel::TCONTINUE ||
-      instp == Lex::TokenLabel::TBREAK) {
-    
-    if (*cur == count) {
-      // remove this instr.
-      auto &instr_mut = bb->GetInstrAsRefMut();
-      instr_mut.tokens.clear();
-      instr_mut.tokens.push_back(Lex::Token("", Lex::TokenLabel::TNULL, 0));
-      bb->SetType(Parser::BlockType::BCOMMON);
-      return true;
-    } else {
-      *cur = *cur + 1;
+  auto Enter(Parser::BasicBlock *block, size_t) -> Parser::VisitAction {
+    const auto instp = block->GetInstrAsRef().GetTypeOfToken(0);
+    if (instp != Lex::TokenLabel::TCONTINUE &&
+        instp != Lex::TokenLabel::TBREAK) {
+      return Parser::VisitAction::VCONTINUE;
     }
-  }
-
-  const auto num_children = bb->GetNumChildren();
-  for (size_t i = 0; i < num_children; i++) {
-    auto ret = BreakOrContExec(bb->GetChild(i), cur, count);
-    if (ret) {
-      return true;
+    if (this->cur++ != this->count) {
+      return Parser::VisitAction::VCONTINUE;
     }
-  }
 
-  return false;
-}
+    // remove this instr.
+    static const Lex::Token null_token;
+    auto &instr_mut = block->GetInstrAsRefMut();
+    instr_mut.tokens = Lex::TokenSpan(&null_token, &null_token + 1);
+    block->SetType(Parser::BlockType::BCOMMON);
+    this->removed = true;
+    return Parser::VisitAction::VSTOP;
+  }
+};
 
 auto MissingBreakOrCont(Parser::BasicBlock *bb, size_t count)
   -> bool {
-  size_t idx = 0;
-  return BreakOrContExec(bb, &idx, count);
+  BreakOrContRemover remover = {count};
+  Parser::VisitBlocks(bb, remover);
+  return remover.removed;
 }
 
 } // namespace BugInsertor
@@ -3,9 +3,12 @@
 
 #define TO_STD_STRING(x) x
 
+#include "arena.h"
 #include "utils.h"
+#include "intern.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <cassert>
@@ -101,21 +104,32 @@ enum class TokenLabel {
 
 const char *GetNameOfLabel(TokenLabel label);
 
+// A token does not own its text: it is a (offset, length) window into the
+// source buffer it was scanned from, which must outlive the token.
 struct Token {
  public:
-  std::string buf; // string buffer
+  const char *src; // start of the source buffer
+  uint32_t offset; // byte offset of the token in `src`
+  uint32_t length; // length of the token in bytes
   TokenLabel label; // token label
   uint32_t line;   // line number
+  Atom atom;       // interned name of identifiers, null_atom otherwise
 
   // default constructor
-  Token(): label(TokenLabel::TNULL), line(0) {}
-  Token(const std::string &word, TokenLabel lbl, uint32_t lno)
-    : buf(word), label(lbl), line(lno) {}
+  Token(): src(nullptr), offset(0), length(0), label(TokenLabel::TNULL), line(0),
+           atom(null_atom) {}
+  Token(const char *src, uint32_t offset, uint32_t length, TokenLabel lbl, uint32_t lno,
+        Atom atom = null_atom)
+    : src(src), offset(offset), length(length), label(lbl), line(lno), atom(atom) {}
 
   auto operator=(const Token &token) -> Token & = default;
 
+  auto Text() const -> std::string_view {
+    return std::string_view(this->src + this->offset, this->length);
+  }
+
   auto Print(std::ostream &os) const -> std::ostream & {
-    os << this->buf;
+    os << this->Text();
     return os;
   }
 
@@ -123,26 +137,243 @@ struct Token {
   ~Token() = default;
 };
 
-// Tokenizer for C language
-auto CLangTokenize(const std::string &fobj, bool IgnoreNull) -> std::vector<Token>;
+// A [begin, end) range of tokens, which does not own them: the tokens must
+// outlive the span.
+class TokenSpan {
+ public:
+  TokenSpan() = default;
+  TokenSpan(const Token *begin, const Token *end): begin_(begin), end_(end) {}
+
+  auto size() const -> size_t { return this->end_ - this->begin_; }
+  auto empty() const -> bool { return this->begin_ == this->end_; }
+  auto data() const -> const Token * { return this->begin_; }
+  auto begin() const -> const Token * { return this->begin_; }
+  auto end() const -> const Token * { return this->end_; }
+
+  auto operator[](size_t idx) const -> const Token & {
+    assert(idx < this->size());
+    return this->begin_[idx];
+  }
+  auto front() const -> const Token & { return (*this)[0]; }
+  auto back() const -> const Token & { return (*this)[this->size() - 1]; }
+
+  // Copy the tokens, if they must outlive the ones of the span.
+  auto ToVector() const -> std::vector<Token> {
+    return std::vector<Token>(this->begin_, this->end_);
+  }
+
+ private:
+  const Token *begin_{nullptr};
+  const Token *end_{nullptr};
+};
+
+// Start offsets of the lines of a source buffer, to map a byte offset to
+// its line and column by binary search. Lines and columns count from 1,
+// and a column is a byte offset in its line.
+class LineTable {
+ public:
+  LineTable() = default;
+
+  // Index all the lines of `src`.
+  explicit LineTable(std::string_view src);
+
+  // An empty table, whose first line is `line` starting at `offset`.
+  LineTable(uint32_t line, uint64_t offset);
+
+  ~LineTable() = default;
+
+  // Add the start of the next line.
+  auto AddLine(uint64_t offset) -> void {
+    assert(offset > this->starts_.back());
+    this->starts_.push_back(offset);
+  }
+
+  auto FirstLine() const -> uint32_t { return this->first_line_; }
+  auto LastLine() const -> uint32_t {
+    return static_cast<uint32_t>(this->first_line_ + this->starts_.size() - 1);
+  }
+
+  // Returns the start offset of `line`.
+  auto LineStart(uint32_t line) const -> uint64_t {
+    assert(line >= this->first_line_ && line <= this->LastLine());
+    return this->starts_[line - this->first_line_];
+  }
+
+  // Returns the line and the column of `offset`.
+  auto Locate(uint64_t offset) const -> std::pair<uint32_t, uint32_t>;
+
+  auto LineOf(uint64_t offset) const -> uint32_t { return this->Locate(offset).first; }
+  auto ColumnOf(uint64_t offset) const -> uint32_t { return this->Locate(offset).second; }
+
+ private:
+  uint32_t first_line_{1};
+  std::vector<uint64_t> starts_{0};
+};
+
+// Pull-based tokenizer for C language.
+//
+// It either scans an in-memory buffer, or reads a file descriptor
+// incrementally through a fixed-size window, so that a file of any size
+// is tokenized in constant memory. The window only grows when a single
+// token (e.g. a huge comment) does not fit in it.
+class Lexer {
+ public:
+  // 64KB window for streamed input
+  static constexpr size_t default_window = 64 * 1024;
+
+  // How '#' is scanned.
+  enum class Directives {
+    SKIP = 0, // a preprocessor command up to the end of line, as a null token
+    KEEP,     // the same, but labeled TSHARP
+    TOKENS,   // a single TSHARP token, as in the body of a command
+  };
+
+  // Tokenize `src`, which must outlive the lexer and its tokens.
+  Lexer(std::string_view src, bool ignore_null);
+
+  // Tokenize `src` from byte `from`, which is on line `line`.
+  // Token offsets are still relative to the start of `src`.
+  Lexer(std::string_view src, size_t from, uint32_t line, bool ignore_null);
+
+  // Tokenize what is read from `fd`. The fd is not closed.
+  // Tokens point into the window: their text is only valid until the
+  // next call to Next(), and their offset is relative to WindowOffset().
+  Lexer(int fd, bool ignore_null, size_t window = default_window);
+
+  ~Lexer() = default;
+
+  // disallow copy
+  Lexer(const Lexer &) = delete;
+  Lexer &operator=(const Lexer &) = delete;
+
+  // Scan the next token. Returns false at the end of input.
+  auto Next(Token *token) -> bool;
+
+  // Offset of the window in the input, 0 for in-memory input.
+  auto WindowOffset() const -> uint64_t { return this->base_; }
+
+  // Set how '#' is scanned, before scanning starts.
+  auto SetDirectives(Directives directives) -> void { this->directives_ = directives; }
+
+  // Lines seen so far, all of them once Next() returned false.
+  // Offsets are relative to the start of the input.
+  auto Lines() const -> const LineTable & { return this->lines_; }
+
+  class iterator {
+   public:
+    iterator(): lexer_(nullptr) {}
+    explicit iterator(Lexer *lexer): lexer_(lexer) { ++(*this); }
+
+    auto operator*() const -> const Token & { return this->token_; }
+    auto operator->() const -> const Token * { return &this->token_; }
+
+    auto operator++() -> iterator & {
+      if (!this->lexer_->Next(&this->token_)) {
+        this->lexer_ = nullptr;
+      }
+      return *this;
+    }
+
+    auto operator==(const iterator &other) const -> bool { return this->lexer_ == other.lexer_; }
+    auto operator!=(const iterator &other) const -> bool { return this->lexer_ != other.lexer_; }
+
+   private:
+    Lexer *lexer_;
+    Token token_;
+  };
+
+  // single pass: begin() may only be called once.
+  auto begin() -> iterator { return iterator(this); }
+  auto end() -> iterator { return iterator(); }
+
+ private:
+  // Scan a token starting at `i` of the window, without keyword lookup
+  // and merging. Returns the end of the token.
+  auto ScanRawToken(size_t i, TokenLabel *label) -> size_t;
+  auto ScanToken(size_t i, TokenLabel *label) -> size_t;
+  // Move the current token to the front of the window, and read more input.
+  auto Refill() -> void;
+
+  const char *src_; // start of the window
+  size_t len_;      // bytes in the window
+  size_t pos_{0};   // next token starts here
+  uint32_t line_{1};
+  bool ignore_null_;
+  bool eof_;        // no more input to read
+  Directives directives_{Directives::SKIP};
+
+  AtomCache atoms_;
+  LineTable lines_;
+
+  // only for streamed input
+  int fd_{-1};
+  uint64_t base_{0};
+  std::vector<char> window_;
+};
+
+// Tokenizer for C language, a wrapper of Lexer.
+// The returned tokens point into `fobj`, so keep it alive while they are used.
+// With nchunks > 1, a large `fobj` is split at newlines into up to `nchunks`
+// chunks that are tokenized by as many threads. The result is the same.
+auto CLangTokenize(std::string_view fobj, bool IgnoreNull,
+                   size_t nchunks = 1) -> std::vector<Token>;
+
+// An edit of a source buffer: `removed` bytes at `offset` were replaced
+// with `inserted` bytes.
+struct Edit {
+  size_t offset;
+  size_t removed;
+  size_t inserted;
+};
+
+// Update `tokens` of a source buffer after `edit`, so that they become the
+// tokens of `fobj`, the edited buffer. Only the tokens around the edit are
+// scanned again; the ones after it are shifted. `IgnoreNull` must be the
+// same as when `tokens` were made.
+auto CLangRetokenize(std::vector<Token> &tokens, std::string_view fobj,
+                     const Edit &edit, bool IgnoreNull) -> void;
 
 // Remove null tokens, and clear the vector
 auto RemoveNullTokens(std::vector<Token> &tokens) -> std::vector<Token>;
 
+// An error in the input: a syntax error, or a construct which is not
+// supported. It is thrown inside a top-level declaration, which is then
+// skipped and reported as a Diagnostic.
+class SourceError : public std::runtime_error {
+ public:
+  // `line` is 0 if unknown.
+  SourceError(uint32_t line, const std::string &msg)
+    : std::runtime_error(msg), line_(line) {}
+
+  auto GetLine() const -> uint32_t { return this->line_; }
+
+ private:
+  uint32_t line_;
+};
+
+// A SourceError, and the lines of the top-level declaration skipped for it.
+struct Diagnostic {
+  uint32_t line;
+  std::string message;
+  std::pair<size_t, size_t> skipped;
+};
+
 } // namespace Lex
 
 namespace Parser {
 
-static const size_t max_recursion = 256;
-
+// An instruction refers to its tokens in the token array of the parser, so
+// copies of it are cheap. Use tokens.ToVector() to copy the tokens.
 struct Instruction {
  public:
-  std::vector<Lex::Token> tokens;
+  Lex::TokenSpan tokens;
 
   Instruction() = default;
+  explicit Instruction(Lex::TokenSpan tokens): tokens(tokens) {}
   ~Instruction() = default;
 
-  auto Print(std::ostream &os) const -> std::ostream &;
+  // `depth` is the indentation level.
+  auto Print(std::ostream &os, size_t depth = 0) const -> std::ostream &;
 
   auto GetTypeOfToken(size_t idx) const -> Lex::TokenLabel {
     return idx < tokens.size() ? tokens[idx].label : Lex::TokenLabel::TNULL;
@@ -150,25 +381,34 @@ struct Instruction {
 
   // Returns names of called func inside this instruction.
   // WARN: may not be correct.
-  auto GetFuncCalls(void) const -> std::vector<std::string>;
+  auto GetFuncCalls(void) const -> std::vector<Lex::Atom>;
 
   // Returns names of variables inside this instruction.
   // WARN: may not be correct.
-  auto GetVarNames(void) const -> std::vector<std::string>;
+  auto GetVarNames(void) const -> std::vector<Lex::Atom>;
 
+  // tokens are in source order, so the ranges only look at both ends.
   auto GetLineRange() const -> std::pair<size_t, size_t> {
-    std::pair<size_t, size_t> ret = {-1, 0};
-    for (const auto &token : tokens) {
-      if (token.line > ret.second) {
-        ret.second = token.line;
-      }
-      if (token.line < ret.first) {
-        ret.first = token.line;
-      }
-    }
+    assert(!tokens.empty());
+    return {tokens.front().line, tokens.back().line};
+  }
 
-    assert(ret.first <= ret.second);
-    return ret;
+  // Returns [begin, end) of the instruction in the source buffer.
+  auto GetByteRange() const -> std::pair<size_t, size_t> {
+    assert(!tokens.empty());
+    return {tokens.front().offset, tokens.back().offset + tokens.back().length};
+  }
+
+  // Returns the source text of the instruction, comments included.
+  // It is only a slice of the source for unpreprocessed tokens: after
+  // preprocessing, an instruction may mix tokens of headers, macro bodies and
+  // interned text, and then the view is empty.
+  auto GetSourceText() const -> std::string_view {
+    const auto rg = this->GetByteRange();
+    if (tokens.front().src != tokens.back().src || rg.second < rg.first) {
+      return std::string_view();
+    }
+    return std::string_view(tokens.front().src + rg.first, rg.second - rg.first);
   }
 };
 
@@ -197,14 +437,12 @@ auto BlockTypeToString(BlockType bt) -> std::string;
 
 class BasicBlock {
  public:
-  BasicBlock() = default;
-  BasicBlock(const Instruction &instruction): instruction(instruction), children({}) {}
+  explicit BasicBlock(Arena *arena): children(arena) {}
+  BasicBlock(Arena *arena, const Instruction &instruction)
+    : instruction(instruction), children(arena) {}
 
-  ~BasicBlock() {
-    for (auto *child : children) {
-      delete child;
-    }
-  }
+  // children are freed with the arena.
+  ~BasicBlock() = default;
 
   void AddChild(BasicBlock *child) { children.push_back(child); }
 
@@ -212,6 +450,7 @@ class BasicBlock {
   void HasBracket() {
     this->has_bracket_ = true;
   }
+  auto IsBracketed() const -> bool { return this->has_bracket_; }
 
   auto GetType(void) const -> BlockType { return this->btype; }
   // do not use this function
@@ -227,25 +466,187 @@ class BasicBlock {
   auto GetNumChildren(void) const -> size_t { return children.size(); }
   auto HasChildren(void) const -> bool { return !children.empty(); }
 
-  auto Print(std::ostream &os) const -> std::ostream &;
+  // Print the block tree, indented from `depth`.
+  auto Print(std::ostream &os, size_t depth = 0) const -> std::ostream &;
 
   // helper method. Do not use these
   static void ReshapeBlock(BasicBlock *root);
   static void ReshapeBlockTree(BasicBlock *root);
+  // @throw Lex::SourceError if an if or else has no block, or an else
+  // does not follow an if.
   static void MergeIfElseBlock(BasicBlock *root);
-  static void MergeIfElseBlockTree(BasicBlock *root);
+  // Top-level declarations which cannot be merged are removed, and
+  // returned as diagnostics.
+  static auto MergeIfElseBlockTree(BasicBlock *root) -> std::vector<Lex::Diagnostic>;
 
   auto GetLineRange() const -> std::pair<size_t, size_t>;
 
+  // Structural hash of the tree of the block, 0 until HashBlockTree sets
+  // it (see src/treehash.h). Changes to the tree do not update it.
+  auto GetHash() const -> uint64_t { return this->hash_; }
+  auto SetHash(uint64_t hash) -> void { this->hash_ = hash; }
+
+  // Returns [begin, end) of the tokens of the tree in the source buffer.
+  // Brackets of the block are not tokens of it.
+  auto GetByteRange() const -> std::pair<size_t, size_t>;
+
  private:
   BlockType btype{BlockType::BCOMMON};
   Instruction instruction;
-  std::vector<BasicBlock *> children;
+  ArenaVector<BasicBlock *> children;
   bool has_bracket_{false};
+  uint64_t hash_{0};
+};
+
+// The result of a parse: the root block, and the arena which owns all the
+// blocks of the tree. The tree is freed with the handle.
+// Instructions refer to the tokens given to the parser, which must outlive
+// the tree, or to a copy without null tokens, owned by the handle.
+class ParseTree {
+ public:
+  ParseTree(std::unique_ptr<Arena> arena, BasicBlock *root,
+            std::unique_ptr<std::vector<Lex::Token>> tokens = nullptr)
+    : arena_(std::move(arena)), root_(root), tokens_(std::move(tokens)) {}
+
+  auto operator->() const -> BasicBlock * { return this->root_; }
+  auto operator*() const -> BasicBlock & { return *this->root_; }
+  auto get() const -> BasicBlock * { return this->root_; }
+
+  auto GetArena() const -> const Arena & { return *this->arena_; }
+
+ private:
+  std::unique_ptr<Arena> arena_;
+  BasicBlock *root_;
+  std::unique_ptr<std::vector<Lex::Token>> tokens_;
+};
+
+// parser for c language. `tokens` must outlive the tree.
+// With nthreads > 1, the top-level declarations and functions of a large
+// input are parsed by up to `nthreads` threads. The tree is the same.
+auto CLangParser(const std::vector<Lex::Token> &tokens, size_t nthreads = 1) -> ParseTree;
+// Parse a span of tokens without null tokens, e.g. a unit of
+// CLangScanTopLevel. `tokens` must outlive the tree.
+auto CLangParser(Lex::TokenSpan tokens) -> ParseTree;
+
+// A declaration or a function at the top level of a file, as a child of
+// the root would be after parsing.
+struct TopLevelUnit {
+  // the type of its block
+  BlockType type;
+  // the instruction of its block, empty for a bare bracketed block,
+  // e.g. `int main(void)` of a function.
+  Lex::TokenSpan head;
+  // all of its tokens, brackets included.
+  Lex::TokenSpan tokens;
+  // the same as GetLineRange of its block.
+  std::pair<size_t, size_t> lines;
 };
 
-// parser for c language
-auto CLangParser(const std::vector<Lex::Token> &tokens) -> BasicBlock *;
+// Split `tokens`, which has no null tokens, into its top-level units
+// without building any block. A unit is parsed on demand by passing its
+// tokens to CLangParser. `tokens` must outlive the units.
+auto CLangScanTopLevel(const std::vector<Lex::Token> &tokens) -> std::vector<TopLevelUnit>;
+
+// A parse tree flattened into parallel arrays, with the nodes in pre-order:
+// the subtree of node `id` is [id, id + SubtreeSize(id)), and its first
+// child is id + 1. A walk of the whole tree is a scan of the arrays.
+class FlatTree {
+ public:
+  typedef uint32_t NodeId;
+  static constexpr NodeId npos = UINT32_MAX;
+
+  // Flatten the tree of `root`. The tokens of the instructions are copied,
+  // so the flat tree does not depend on the parse tree.
+  explicit FlatTree(const BasicBlock *root);
+
+  // Ids of nodes in [begin, end) of the pre-order.
+  class NodeRange {
+   public:
+    class iterator {
+     public:
+      iterator(const FlatTree *tree, NodeId id, bool siblings)
+        : tree_(tree), id_(id), siblings_(siblings) {}
+      auto operator*() const -> NodeId { return this->id_; }
+      auto operator++() -> iterator & {
+        this->id_ += this->siblings_ ? this->tree_->SubtreeSize(this->id_) : 1;
+        return *this;
+      }
+      auto operator!=(const iterator &other) const -> bool { return this->id_ != other.id_; }
+
+     private:
+      const FlatTree *tree_;
+      NodeId id_;
+      bool siblings_; // skip subtrees
+    };
+
+    NodeRange(const FlatTree *tree, NodeId begin, NodeId end, bool siblings)
+      : tree_(tree), begin_(begin), end_(end), siblings_(siblings) {}
+    auto begin() const -> iterator { return iterator(this->tree_, this->begin_, this->siblings_); }
+    auto end() const -> iterator { return iterator(this->tree_, this->end_, this->siblings_); }
+
+   private:
+    const FlatTree *tree_;
+    NodeId begin_;
+    NodeId end_;
+    bool siblings_;
+  };
+
+  auto Size() const -> size_t { return this->types_.size(); }
+  auto Root() const -> NodeId { return 0; }
+
+  // All the nodes, in pre-order.
+  auto Nodes() const -> NodeRange { return this->Subtree(0); }
+  // `id` and its descendants, in pre-order.
+  auto Subtree(NodeId id) const -> NodeRange {
+    return NodeRange(this, id, id + this->SubtreeSize(id), false);
+  }
+  auto Children(NodeId id) const -> NodeRange {
+    return NodeRange(this, id + 1, id + this->SubtreeSize(id), true);
+  }
+
+  auto GetType(NodeId id) const -> BlockType { return static_cast<BlockType>(this->types_[id]); }
+  auto IsBracketed(NodeId id) const -> bool { return this->brackets_[id]; }
+  // the root is at depth 0.
+  auto GetDepth(NodeId id) const -> uint32_t { return this->depths_[id]; }
+  // number of nodes in the subtree, `id` included.
+  auto SubtreeSize(NodeId id) const -> uint32_t { return this->subtree_sizes_[id]; }
+  auto GetParent(NodeId id) const -> NodeId { return this->parents_[id]; }
+
+  auto FirstChild(NodeId id) const -> NodeId {
+    return this->SubtreeSize(id) > 1 ? id + 1 : npos;
+  }
+  auto NextSibling(NodeId id) const -> NodeId {
+    const NodeId parent = this->parents_[id];
+    if (parent == npos) {
+      return npos;
+    }
+    const NodeId next = id + this->SubtreeSize(id);
+    return next < parent + this->SubtreeSize(parent) ? next : npos;
+  }
+
+  // Tokens of the instruction of `id`, in [*begin, *end).
+  auto GetTokens(NodeId id) const -> std::pair<const Lex::Token *, const Lex::Token *> {
+    return {this->tokens_.data() + this->token_begin_[id],
+            this->tokens_.data() + this->token_begin_[id + 1]};
+  }
+
+  // Same as Instruction::GetFuncCalls and Instruction::GetVarNames.
+  auto GetFuncCalls(NodeId id) const -> std::vector<Lex::Atom>;
+  auto GetVarNames(NodeId id) const -> std::vector<Lex::Atom>;
+
+  // Returns the memory used by the arrays.
+  auto BytesUsed() const -> size_t;
+
+ private:
+  std::vector<uint8_t> types_;
+  std::vector<bool> brackets_;
+  std::vector<uint32_t> depths_;
+  std::vector<uint32_t> subtree_sizes_;
+  std::vector<NodeId> parents_;
+  // tokens of node `id` are [token_begin_[id], token_begin_[id + 1]).
+  std::vector<uint32_t> token_begin_;
+  std::vector<Lex::Token> tokens_;
+};
 
 } // namespace Parser
 
@@ -306,8 +707,7 @@ struct SymbolType {
     
     if (base_type == SymbolType::BaseType::TVOID && ptr_level == 0) {
       // cannot create scalar of void type.
-      fprintf(stderr, "Cannot create scalar of void type\n");
-      assert(false);
+      throw Lex::SourceError(0, "Cannot create scalar of void type");
     } 
   }
 
@@ -364,29 +764,30 @@ class SymbolTable {
   ~SymbolTable()  = default;
   SymbolTable &operator=(const SymbolTable &) = delete;
 
-  auto Lookup(const std::string &name) -> SymbolType *;
+  auto Lookup(Lex::Atom name) -> SymbolType *;
   
   // add a symbol to the table, and allocate memory on 
   // stack for it.
-  void AddSymbol(const std::string &name, SymbolType type) {
+  void AddSymbol(Lex::Atom name, SymbolType type) {
     auto &it = this->table_stack.back();
     if (it.find(name) != it.end()) {
-      throw std::runtime_error("Symbol already exists");
+      throw Lex::SourceError(0, "Symbol " + std::string(Lex::AtomText(name)) +
+                             " already exists");
     }
     assert(type.addr != 0 || type.is_global);
     it[name] = type;
   }
 
   auto Enter(std::ostringstream &os) -> std::ostringstream & { 
-    assert(this->table_stack.size() <= Parser::max_recursion);
-
     // push a stack frame to the stack.
     size_t current_sp = 0;
     if (!this->stack_frames.empty()) {
       auto frame_ptr = this->stack_frames.top();
       current_sp = frame_ptr->initial_sp + frame_ptr->alloc_size;
     }
-    assert(current_sp < max_stack_size);
+    if (current_sp >= max_stack_size) {
+      throw Lex::SourceError(0, "Stack frame too large");
+    }
     std::shared_ptr<StackFrame> current_frame = std::make_shared<StackFrame>();
     current_frame->initial_sp = current_sp;
     current_frame->alloc_size = 0;
@@ -415,6 +816,15 @@ class SymbolTable {
     return os;
   }
 
+  // Drop the stack frames above `depth` without recovering the stack
+  // pointer, when the code of their blocks is discarded.
+  void LeaveTo(size_t depth) {
+    while (this->table_stack.size() > depth) {
+      this->table_stack.pop_back();
+      this->stack_frames.pop();
+    }
+  }
+
   // returns number of stack frames
   auto GetStackDepth() const -> size_t { return this->table_stack.size(); }
 
@@ -433,7 +843,7 @@ class SymbolTable {
   auto GetCurrentStackFrame() -> std::shared_ptr<StackFrame> { return this->stack_frames.top(); }
 
  private:
-  typedef std::unordered_map<std::string, SymbolType> Table;
+  typedef std::unordered_map<Lex::Atom, SymbolType> Table;
   std::vector<Table> table_stack;
   std::stack<std::shared_ptr<StackFrame>> stack_frames;
 };
@@ -449,10 +859,16 @@ class CodeGenerator {
     throw std::runtime_error("Not implemented");
   }
 
+  // Top-level declarations skipped by GenerateCode, for errors in them.
+  auto GetDiagnostics() const -> const std::vector<Lex::Diagnostic> & {
+    return this->diagnostics;
+  }
+
   virtual ~CodeGenerator() = default;
  protected:
   SymbolTable symtab;
   size_t branch_count{0};
+  std::vector<Lex::Diagnostic> diagnostics;
 };
 
 class X86Generator : public CodeGenerator {
@@ -490,7 +906,8 @@ class X86Generator : public CodeGenerator {
     return ".LC" + std::to_string(idx);
   }
 
-  auto GetNameOfString(const std::string &str) -> std::string {
+  auto GetNameOfString(std::string_view text) -> std::string {
+    const std::string str(text);
     assert(str.front() == '\"' && str.back() == '\"' 
            && str.size() >= 2);
     
@@ -526,11 +943,30 @@ class X86Generator : public CodeGenerator {
   
   auto GenerateCodeForBlock(std::ostringstream &oss, Parser::BasicBlock *block) 
     -> std::ostringstream &;
+
+  // A block whose code is being generated. The code of its first
+  // `num_children` children goes between the code before them, the code
+  // between two of them and the code after them.
+  struct OpenCodeBlock {
+    Parser::BasicBlock *block;
+    size_t num_children{0};
+    // the next child to generate
+    size_t next{0};
+    // jump targets, e.g. the start and the end of a while
+    size_t labels[2]{0, 0};
+  };
+
+  auto GenerateCodeBeforeChildren(std::ostringstream &oss, OpenCodeBlock &open)
+    -> std::ostringstream &;
+  auto GenerateCodeBetweenChildren(std::ostringstream &oss, const OpenCodeBlock &open)
+    -> std::ostringstream &;
+  auto GenerateCodeAfterChildren(std::ostringstream &oss, const OpenCodeBlock &open)
+    -> std::ostringstream &;
   
-  auto LoadVarIntoReg(std::ostringstream &oss, const std::string &var_name, X86Registers reg)
+  auto LoadVarIntoReg(std::ostringstream &oss, const Lex::Token &var, X86Registers reg)
     -> std::ostringstream &;
   
-  auto StoreVarFromReg(std::ostringstream &oss, const std::string &var_name, X86Registers reg)
+  auto StoreVarFromReg(std::ostringstream &oss, const Lex::Token &var, X86Registers reg)
     -> std::ostringstream &;
 
   /* Load a value(can be a variable or number) into a register */
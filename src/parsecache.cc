@@ -0,0 +1,359 @@
+#include "parsecache.h"
+#include "utils.h"
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Parser {
+
+static const char parse_cache_magic[4] = {'T', 'L', 'X', 'P'};
+
+static inline auto Read32(const char *p) -> uint32_t {
+  uint32_t val;
+  memcpy(&val, p, sizeof(val));
+  return val;
+}
+
+// Offsets of the sections of an entry, from the counts of its header.
+struct EntryLayout {
+  explicit EntryLayout(const ParseCacheHeader &header) {
+    const size_t num_tokens = header.num_tokens;
+    const size_t num_nodes = header.num_nodes;
+    size_t pos = sizeof(ParseCacheHeader);
+    auto section = [&](size_t size) {
+      const size_t begin = pos;
+      pos = (pos + size + 7) & ~size_t(7);
+      return begin;
+    };
+    this->offsets = section(num_tokens * sizeof(uint32_t));
+    this->lengths = section(num_tokens * sizeof(uint32_t));
+    this->lines = section(num_tokens * sizeof(uint32_t));
+    this->names = section(num_tokens * sizeof(uint32_t));
+    this->labels = section(num_tokens);
+    this->name_ends = section(header.num_names * sizeof(uint32_t));
+    this->name_text = section(header.names_size);
+    this->types = section(num_nodes);
+    this->brackets = section(num_nodes);
+    this->subtree_sizes = section(num_nodes * sizeof(uint32_t));
+    this->token_begin = section(num_nodes * sizeof(uint32_t));
+    this->token_end = section(num_nodes * sizeof(uint32_t));
+    this->size = pos;
+  }
+
+  size_t offsets, lengths, lines, names, labels;
+  size_t name_ends, name_text;
+  size_t types, brackets, subtree_sizes, token_begin, token_end;
+  size_t size;
+};
+
+ParseCache::ParseCache(const std::string &dir) : dir_(dir) {
+  if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+    throw std::runtime_error("Failed to make " + dir);
+  }
+}
+
+auto ParseCache::FromEnv() -> std::unique_ptr<ParseCache> {
+  const char *dir = getenv("TLEX_CACHE");
+  if (dir == nullptr || *dir == '\0') {
+    return nullptr;
+  }
+  return std::unique_ptr<ParseCache>(new ParseCache(dir));
+}
+
+auto ParseCache::EntryPath(uint64_t hash) const -> std::string {
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-v%u.tlxp",
+           static_cast<unsigned long long>(hash), parse_cache_version);
+  return this->dir_ + name;
+}
+
+auto ParseCache::Parse(std::string_view source) -> ParsedSource {
+  const uint64_t hash = Hash64(source);
+  const std::string path = this->EntryPath(hash);
+  std::vector<Lex::Token> tokens;
+  std::unique_ptr<ParseTree> cached;
+  const bool loaded = this->Load(path, source, hash, tokens, &cached);
+  if (cached) {
+    this->hits_++;
+    return ParsedSource{std::move(tokens), std::move(*cached)};
+  }
+
+  // an entry made by Tokenize only saves the tokenizer.
+  this->misses_++;
+  if (!loaded) {
+    tokens = Lex::CLangTokenize(source, true);
+  }
+  auto tree = CLangParser(tokens);
+  ParsedSource parsed = {std::move(tokens), std::move(tree)};
+  this->Save(path, source, hash, parsed.tokens, parsed.tree.get());
+  return parsed;
+}
+
+auto ParseCache::Tokenize(std::string_view source) -> std::vector<Lex::Token> {
+  const uint64_t hash = Hash64(source);
+  const std::string path = this->EntryPath(hash);
+  std::vector<Lex::Token> tokens;
+  if (this->Load(path, source, hash, tokens, nullptr)) {
+    this->hits_++;
+    return tokens;
+  }
+
+  this->misses_++;
+  tokens = Lex::CLangTokenize(source, true);
+  this->Save(path, source, hash, tokens, nullptr);
+  return tokens;
+}
+
+auto ParseCache::Load(const std::string &path, std::string_view source, uint64_t hash,
+                      std::vector<Lex::Token> &tokens, std::unique_ptr<ParseTree> *tree)
+  -> bool {
+  if (access(path.c_str(), R_OK) != 0) {
+    return false;
+  }
+  std::unique_ptr<FileSource> entry;
+  try {
+    entry.reset(new FileSource(path.c_str()));
+  } catch (const std::runtime_error &) {
+    return false;
+  }
+  const std::string_view data = entry->View();
+  if (data.size() < sizeof(ParseCacheHeader)) {
+    return false;
+  }
+  ParseCacheHeader header;
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, parse_cache_magic, sizeof(header.magic)) != 0 ||
+      header.version != parse_cache_version || header.hash != hash ||
+      header.source_size != source.size() || header.num_tokens > UINT32_MAX ||
+      header.num_names > header.num_tokens ||
+      header.num_nodes > UINT32_MAX || header.names_size > data.size()) {
+    return false;
+  }
+  const EntryLayout layout(header);
+  if (layout.size != data.size() ||
+      Hash64(data.substr(sizeof(ParseCacheHeader))) != header.body_hash) {
+    return false;
+  }
+
+  // sections are aligned, but they are read with memcpy all the same.
+  const char *base = data.data();
+  auto u32_at = [&](size_t section, size_t idx) { return Read32(base + section + 4 * idx); };
+  auto u8_at = [&](size_t section, size_t idx) {
+    return static_cast<uint8_t>(base[section + idx]);
+  };
+
+  // intern each name once.
+  std::vector<Lex::Atom> atoms(header.num_names + 1, Lex::null_atom);
+  Lex::AtomCache atom_cache;
+  size_t name_begin = 0;
+  for (size_t i = 0; i < header.num_names; i++) {
+    const size_t name_end = u32_at(layout.name_ends, i);
+    if (name_end < name_begin || name_end > header.names_size) {
+      return false;
+    }
+    atoms[i + 1] = atom_cache.Intern(
+      std::string_view(base + layout.name_text + name_begin, name_end - name_begin));
+    name_begin = name_end;
+  }
+
+  const size_t num_tokens = header.num_tokens;
+  tokens.resize(num_tokens);
+  for (size_t i = 0; i < num_tokens; i++) {
+    const uint32_t offset = u32_at(layout.offsets, i);
+    const uint32_t length = u32_at(layout.lengths, i);
+    const uint32_t name = u32_at(layout.names, i);
+    const uint8_t label = u8_at(layout.labels, i);
+    if (length > source.size() || offset > source.size() - length ||
+        name > header.num_names || label > static_cast<uint8_t>(Lex::TokenLabel::TEXTERN)) {
+      tokens.clear();
+      return false;
+    }
+    tokens[i] = Lex::Token(source.data(), offset, length, static_cast<Lex::TokenLabel>(label),
+                           u32_at(layout.lines, i), atoms[name]);
+  }
+
+  if (tree == nullptr || header.num_nodes == 0) {
+    return true;
+  }
+
+  // the nodes are in pre-order: a node is a child of the last node whose
+  // subtree has not ended.
+  struct Open {
+    BasicBlock *block;
+    size_t end;
+  };
+  std::unique_ptr<Arena> arena(new Arena());
+  std::vector<Open> stack;
+  BasicBlock *root = nullptr;
+  for (size_t id = 0; id < header.num_nodes; id++) {
+    const uint8_t type = u8_at(layout.types, id);
+    const size_t size = u32_at(layout.subtree_sizes, id);
+    const size_t begin = u32_at(layout.token_begin, id);
+    const size_t end = u32_at(layout.token_end, id);
+    if (type > static_cast<uint8_t>(BlockType::BENUM) || size == 0 ||
+        begin > end || end > num_tokens) {
+      return false;
+    }
+
+    BasicBlock *block = begin == end ? arena->New<BasicBlock>(arena.get())
+      : arena->New<BasicBlock>(arena.get(), Instruction(Lex::TokenSpan(
+          tokens.data() + begin, tokens.data() + end)));
+    block->SetType(static_cast<BlockType>(type));
+    if (u8_at(layout.brackets, id)) {
+      block->HasBracket();
+    }
+
+    while (!stack.empty() && stack.back().end <= id) {
+      stack.pop_back();
+    }
+    if (stack.empty()) {
+      // only the root has no parent.
+      if (id != 0 || size != header.num_nodes) {
+        return false;
+      }
+      root = block;
+    } else {
+      if (id + size > stack.back().end) {
+        return false;
+      }
+      stack.back().block->AddChild(block);
+    }
+    stack.push_back({block, id + size});
+  }
+
+  tree->reset(new ParseTree(std::move(arena), root));
+  return true;
+}
+
+auto ParseCache::Save(const std::string &path, std::string_view source, uint64_t hash,
+                      const std::vector<Lex::Token> &tokens, const BasicBlock *root) -> void {
+  // the distinct names, numbered from 1.
+  std::unordered_map<Lex::Atom, uint32_t> name_index;
+  std::vector<uint32_t> names(tokens.size());
+  std::string name_text;
+  std::vector<uint32_t> name_ends;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    const Lex::Atom atom = tokens[i].atom;
+    if (atom == Lex::null_atom) {
+      continue;
+    }
+    auto it = name_index.find(atom);
+    if (it == name_index.end()) {
+      name_text += Lex::AtomText(atom);
+      name_ends.push_back(static_cast<uint32_t>(name_text.size()));
+      it = name_index.emplace(atom, static_cast<uint32_t>(name_ends.size())).first;
+    }
+    names[i] = it->second;
+  }
+
+  // the nodes in pre-order.
+  struct Node {
+    const BasicBlock *block;
+    uint32_t parent;
+  };
+  std::vector<Node> nodes;
+  std::vector<const BasicBlock *> stack;
+  std::vector<uint32_t> parents;
+  if (root != nullptr) {
+    stack.push_back(root);
+    parents.push_back(UINT32_MAX);
+  }
+  while (!stack.empty()) {
+    const BasicBlock *block = stack.back();
+    const uint32_t parent = parents.back();
+    stack.pop_back();
+    parents.pop_back();
+    const auto id = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({block, parent});
+    for (size_t i = block->GetNumChildren(); i > 0; i--) {
+      stack.push_back(block->GetChild(i - 1));
+      parents.push_back(id);
+    }
+  }
+  std::vector<uint32_t> subtree_sizes(nodes.size(), 1);
+  for (size_t id = nodes.size(); id > 1; id--) {
+    subtree_sizes[nodes[id - 1].parent] += subtree_sizes[id - 1];
+  }
+
+  ParseCacheHeader header;
+  memcpy(header.magic, parse_cache_magic, sizeof(header.magic));
+  header.version = parse_cache_version;
+  header.hash = hash;
+  header.source_size = source.size();
+  header.num_tokens = tokens.size();
+  header.num_names = name_ends.size();
+  header.names_size = name_text.size();
+  header.num_nodes = nodes.size();
+  header.body_hash = 0;
+  const EntryLayout layout(header);
+
+  std::string out(layout.size, '\0');
+  char *base = &out[0];
+  auto put_u32 = [&](size_t section, size_t idx, uint32_t val) {
+    memcpy(base + section + 4 * idx, &val, sizeof(val));
+  };
+  for (size_t i = 0; i < tokens.size(); i++) {
+    put_u32(layout.offsets, i, tokens[i].offset);
+    put_u32(layout.lengths, i, tokens[i].length);
+    put_u32(layout.lines, i, tokens[i].line);
+    put_u32(layout.names, i, names[i]);
+    base[layout.labels + i] = static_cast<char>(tokens[i].label);
+  }
+  for (size_t i = 0; i < name_ends.size(); i++) {
+    put_u32(layout.name_ends, i, name_ends[i]);
+  }
+  if (!name_text.empty()) {
+    memcpy(base + layout.name_text, name_text.data(), name_text.size());
+  }
+  for (size_t id = 0; id < nodes.size(); id++) {
+    const BasicBlock *block = nodes[id].block;
+    const auto &span = block->GetInstrAsRef().tokens;
+    const size_t begin = span.empty() ? 0 : span.data() - tokens.data();
+    assert(begin + span.size() <= tokens.size());
+    base[layout.types + id] = static_cast<char>(block->GetType());
+    base[layout.brackets + id] = block->IsBracketed();
+    put_u32(layout.subtree_sizes, id, subtree_sizes[id]);
+    put_u32(layout.token_begin, id, static_cast<uint32_t>(begin));
+    put_u32(layout.token_end, id, static_cast<uint32_t>(begin + span.size()));
+  }
+  header.body_hash = Hash64(std::string_view(out).substr(sizeof(ParseCacheHeader)));
+  memcpy(base, &header, sizeof(header));
+
+  // written aside, then renamed, so that readers never see a partial entry.
+  // failures are ignored: the entry is made again by the next run.
+  const std::string tmp = path + "." + std::to_string(getpid());
+  FILE *fout = fopen(tmp.c_str(), "wb");
+  if (fout == nullptr) {
+    return;
+  }
+  const bool written = fwrite(out.data(), 1, out.size(), fout) == out.size();
+  if (fclose(fout) != 0 || !written || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+  }
+}
+
+auto ParseSource(std::string_view source) -> ParsedSource {
+  auto cache = ParseCache::FromEnv();
+  if (cache) {
+    return cache->Parse(source);
+  }
+  auto tokens = Lex::CLangTokenize(source, true);
+  auto tree = CLangParser(tokens);
+  return ParsedSource{std::move(tokens), std::move(tree)};
+}
+
+auto TokenizeSource(std::string_view source) -> std::vector<Lex::Token> {
+  auto cache = ParseCache::FromEnv();
+  if (cache) {
+    return cache->Tokenize(source);
+  }
+  return Lex::CLangTokenize(source, true);
+}
+
+} // namespace Parser
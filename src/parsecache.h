@@ -0,0 +1,102 @@
+#ifndef __PARSECACHE_H__
+#define __PARSECACHE_H__
+
+// Parse cache: the tokens and the parse tree of source files, saved in a
+// directory so that later runs on unchanged files skip the tokenizer and
+// the parser.
+//
+// An entry is named after a 64-bit xxHash (XXH64) of the source and the
+// format version. It is laid out as
+//   header | tokens | names | nodes
+// where tokens are parallel arrays of offsets, lengths, lines, name
+// indexes and labels; names are the distinct identifiers, interned once
+// when the entry is loaded; and nodes are the blocks of the tree in
+// pre-order, with their type, bracket, subtree size and token range.
+// An entry made by Tokenize has no nodes; Parse completes it.
+// Each section starts at a multiple of 8 bytes. The entry is read through
+// mmap, and integers are in host byte order. An entry whose sections do
+// not match their hash is ignored, and made again.
+
+#include "lex.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Parser {
+
+struct ParseCacheHeader {
+  char magic[4];        // "TLXP"
+  uint32_t version;
+  uint64_t hash;        // of the source
+  uint64_t source_size;
+  uint64_t num_tokens;
+  uint64_t num_names;
+  uint64_t names_size;  // bytes of text
+  uint64_t num_nodes;
+  uint64_t body_hash;   // of the sections after the header
+};
+
+constexpr uint32_t parse_cache_version = 1;
+
+// The tokens of a source, without null tokens, and its parse tree, whose
+// instructions are spans of the tokens. Both point into the source.
+struct ParsedSource {
+  std::vector<Lex::Token> tokens;
+  ParseTree tree;
+};
+
+class ParseCache {
+ public:
+  // Entries are kept in `dir`, which is made if it does not exist.
+  // @throw std::runtime_error if it cannot be made.
+  explicit ParseCache(const std::string &dir);
+  ~ParseCache() = default;
+
+  // disallow copy
+  ParseCache(const ParseCache &) = delete;
+  ParseCache &operator=(const ParseCache &) = delete;
+
+  // Returns the cache in the directory of $TLEX_CACHE, or null if it is
+  // not set.
+  static auto FromEnv() -> std::unique_ptr<ParseCache>;
+
+  // Returns the tokens and the tree of `source`, which must outlive them.
+  // They are loaded from the entry of `source` if there is a valid one,
+  // otherwise they are made, and saved if the directory is writable.
+  // Tokens of an entry without nodes are parsed, and the entry rewritten.
+  auto Parse(std::string_view source) -> ParsedSource;
+  // Returns the tokens of `source`, the same as Parse, but without the
+  // tree: on a miss, the source is only tokenized.
+  auto Tokenize(std::string_view source) -> std::vector<Lex::Token>;
+
+  auto NumHits() const -> size_t { return this->hits_; }
+  auto NumMisses() const -> size_t { return this->misses_; }
+
+ private:
+  auto EntryPath(uint64_t hash) const -> std::string;
+  // Loads the tokens of the entry at `path`, and its tree into `tree` if
+  // `tree` is not null and the entry has nodes. Returns false if there is
+  // no valid entry.
+  auto Load(const std::string &path, std::string_view source, uint64_t hash,
+            std::vector<Lex::Token> &tokens, std::unique_ptr<ParseTree> *tree) -> bool;
+  // Saves `tokens`, and the tree of `root` if it is not null.
+  auto Save(const std::string &path, std::string_view source, uint64_t hash,
+            const std::vector<Lex::Token> &tokens, const BasicBlock *root) -> void;
+
+  std::string dir_;
+  size_t hits_{0};
+  size_t misses_{0};
+};
+
+// Returns the tokens and the tree of `source`, through the cache of
+// $TLEX_CACHE if it is set. `source` must outlive them.
+auto ParseSource(std::string_view source) -> ParsedSource;
+// Returns the tokens of `source`, the same as ParseSource without the tree.
+auto TokenizeSource(std::string_view source) -> std::vector<Lex::Token>;
+
+} // namespace Parser
+
+#endif // __PARSECACHE_H__
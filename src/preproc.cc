@@ -0,0 +1,1093 @@
+#include "preproc.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Preprocessor {
+
+using Lex::Token;
+using Lex::TokenLabel;
+
+// nested #include
+static const size_t max_include_depth = 200;
+
+[[noreturn]] static auto ErrorAt(const std::string &path, uint32_t line,
+                                 const std::string &msg) -> void {
+  throw std::runtime_error(path + ":" + std::to_string(line) + ": " + msg);
+}
+
+// Returns true if `b` follows `a` without blanks in between.
+static inline auto Adjacent(const Token &a, const Token &b) -> bool {
+  return a.src == b.src && a.offset + a.length == b.offset;
+}
+
+// Returns the macro name of an identifier or a keyword, as in
+// #define bool _Bool, or null_atom.
+static auto NameOf(const Token &token) -> Lex::Atom {
+  if (token.label == TokenLabel::TALPHA) {
+    return token.atom;
+  }
+  if (token.label >= TokenLabel::TBOOL) {
+    return Lex::Intern(token.Text());
+  }
+  return Lex::null_atom;
+}
+
+// Returns a token of `text`, which is copied into the interner.
+static auto MakeToken(std::string_view text, TokenLabel label, uint32_t line) -> Token {
+  const Lex::Atom atom = Lex::Intern(text);
+  const std::string_view stored = Lex::AtomText(atom);
+  return Token(stored.data(), 0, stored.size(), label, line,
+               label == TokenLabel::TALPHA ? atom : Lex::null_atom);
+}
+
+// Tokenize `src` as the body of a command, where '#' is a token.
+static auto TokenizeCommand(std::string_view src, size_t from, uint32_t line,
+                            std::vector<Token> &out) -> void {
+  Lex::Lexer lexer(src, from, line, true);
+  lexer.SetDirectives(Lex::Lexer::Directives::TOKENS);
+  Token token;
+  while (lexer.Next(&token)) {
+    out.push_back(token);
+  }
+}
+
+// Returns the macro of the include guard of `tokens`: the file starts with
+// #ifndef, and the matching #endif ends it.
+static auto FindGuard(const std::vector<Token> &tokens) -> Lex::Atom {
+  if (tokens.size() < 4 || tokens[0].label != TokenLabel::TSHARP ||
+      tokens[1].Text() != "ifndef" || tokens[2].label != TokenLabel::TALPHA ||
+      tokens[3].label != TokenLabel::TNULL) {
+    return Lex::null_atom;
+  }
+
+  size_t depth = 0;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (tokens[i].label != TokenLabel::TSHARP) {
+      continue;
+    }
+    size_t end = i + 1;
+    while (tokens[end].label != TokenLabel::TNULL) {
+      end++;
+    }
+    if (end > i + 1) {
+      const auto name = tokens[i + 1].Text();
+      if (name == "if" || name == "ifdef" || name == "ifndef") {
+        depth++;
+      } else if (name == "endif" && --depth == 0) {
+        return end + 1 == tokens.size() ? tokens[2].atom : Lex::null_atom;
+      }
+    }
+    i = end;
+  }
+  return Lex::null_atom;
+}
+
+static auto TokenizeFile(const std::string &path) -> std::shared_ptr<CachedFile> {
+  auto file = std::make_shared<CachedFile>();
+  file->path = path;
+  file->source.reset(new FileSource(path.c_str()));
+  const std::string_view src = file->source->View();
+
+  Lex::Lexer lexer(src, true);
+  lexer.SetDirectives(Lex::Lexer::Directives::KEEP);
+  Token token;
+  while (lexer.Next(&token)) {
+    if (token.label != TokenLabel::TSHARP) {
+      file->tokens.push_back(token);
+      continue;
+    }
+    // the command, between a TSHARP and a TNULL token.
+    const size_t begin = file->tokens.size();
+    file->tokens.push_back(Token(src.data(), token.offset, 1, TokenLabel::TSHARP, token.line));
+    TokenizeCommand(src.substr(0, token.offset + token.length), token.offset + 1,
+                    token.line, file->tokens);
+    file->tokens.push_back(Token(src.data(), token.offset + token.length, 0,
+                                 TokenLabel::TNULL, token.line));
+    if (file->tokens.size() == begin + 4 && file->tokens[begin + 1].Text() == "pragma" &&
+        file->tokens[begin + 2].Text() == "once") {
+      file->pragma_once = true;
+    }
+  }
+
+  file->guard = FindGuard(file->tokens);
+  return file;
+}
+
+struct CacheEntry {
+  std::shared_ptr<const CachedFile> file;
+  struct timespec mtime;
+  off_t size;
+};
+
+static std::mutex cache_mutex;
+
+auto GetCachedFile(const std::string &path) -> std::shared_ptr<const CachedFile> {
+  if (path == "-") {
+    // stdin cannot be cached.
+    return TokenizeFile(path);
+  }
+
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+
+  // never destroyed, cached tokens may be used until exit.
+  static auto *cache = new std::unordered_map<std::string, CacheEntry>();
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache->find(path);
+    if (it != cache->end() && it->second.size == st.st_size &&
+        it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+        it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      return it->second.file;
+    }
+  }
+
+  // tokenize without holding the lock.
+  std::shared_ptr<const CachedFile> file = TokenizeFile(path);
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  (*cache)[path] = CacheEntry{file, st.st_mtim, st.st_size};
+  return file;
+}
+
+// Evaluates the expression of #if, whose macros are expanded.
+class CondEval {
+ public:
+  CondEval(const std::vector<Token> &tokens, const std::string &path, uint32_t line)
+    : tokens_(tokens), path_(path), line_(line) {}
+
+  auto Eval() -> int64_t {
+    if (this->tokens_.empty()) {
+      ErrorAt(this->path_, this->line_, "#if with no expression");
+    }
+    const int64_t ret = this->Ternary();
+    if (this->pos_ < this->tokens_.size()) {
+      ErrorAt(this->path_, this->line_, "missing binary operator before " +
+              std::string(this->tokens_[this->pos_].Text()));
+    }
+    return ret;
+  }
+
+ private:
+  auto Peek(size_t k = 0) const -> TokenLabel {
+    return this->pos_ + k < this->tokens_.size() ?
+      this->tokens_[this->pos_ + k].label : TokenLabel::TNULL;
+  }
+
+  // Arithmetic is done on uint64_t, so that it wraps around on overflow.
+  static auto Wrap(uint64_t value) -> int64_t {
+    return static_cast<int64_t>(value);
+  }
+
+  // `<<` and `>>` are two adjacent tokens.
+  auto PeekShift(TokenLabel half) const -> bool {
+    return this->Peek() == half && this->Peek(1) == half &&
+      Adjacent(this->tokens_[this->pos_], this->tokens_[this->pos_ + 1]);
+  }
+
+  auto Expect(TokenLabel label, const char *what) -> void {
+    if (this->Peek() != label) {
+      ErrorAt(this->path_, this->line_, std::string("expected ") + what + " in #if");
+    }
+    this->pos_++;
+  }
+
+  auto Ternary() -> int64_t {
+    const int64_t cond = this->LogicalOr();
+    if (this->Peek() != TokenLabel::TQUESTION) {
+      return cond;
+    }
+    this->pos_++;
+    this->skip_ += !cond;
+    const int64_t lhs = this->Ternary();
+    this->skip_ -= !cond;
+    this->Expect(TokenLabel::TCOLON, "':'");
+    this->skip_ += !!cond;
+    const int64_t rhs = this->Ternary();
+    this->skip_ -= !!cond;
+    return cond ? lhs : rhs;
+  }
+
+  auto LogicalOr() -> int64_t {
+    int64_t ret = this->LogicalAnd();
+    while (this->Peek() == TokenLabel::TOR) {
+      this->pos_++;
+      this->skip_ += !!ret;
+      const int64_t rhs = this->LogicalAnd();
+      this->skip_ -= !!ret;
+      ret = ret || rhs;
+    }
+    return ret;
+  }
+
+  auto LogicalAnd() -> int64_t {
+    int64_t ret = this->BitOr();
+    while (this->Peek() == TokenLabel::TAND) {
+      this->pos_++;
+      this->skip_ += !ret;
+      const int64_t rhs = this->BitOr();
+      this->skip_ -= !ret;
+      ret = ret && rhs;
+    }
+    return ret;
+  }
+
+  auto BitOr() -> int64_t {
+    int64_t ret = this->BitXor();
+    while (this->Peek() == TokenLabel::TPIPE) {
+      this->pos_++;
+      ret |= this->BitXor();
+    }
+    return ret;
+  }
+
+  auto BitXor() -> int64_t {
+    int64_t ret = this->BitAnd();
+    while (this->Peek() == TokenLabel::TXOR) {
+      this->pos_++;
+      ret ^= this->BitAnd();
+    }
+    return ret;
+  }
+
+  auto BitAnd() -> int64_t {
+    int64_t ret = this->Equality();
+    while (this->Peek() == TokenLabel::TADRP) {
+      this->pos_++;
+      ret &= this->Equality();
+    }
+    return ret;
+  }
+
+  auto Equality() -> int64_t {
+    int64_t ret = this->Relational();
+    while (true) {
+      if (this->Peek() == TokenLabel::TEQ) {
+        this->pos_++;
+        ret = ret == this->Relational();
+      } else if (this->Peek() == TokenLabel::TNE) {
+        this->pos_++;
+        ret = ret != this->Relational();
+      } else {
+        return ret;
+      }
+    }
+  }
+
+  auto Relational() -> int64_t {
+    int64_t ret = this->Shift();
+    while (true) {
+      const auto label = this->Peek();
+      if ((label == TokenLabel::TLE && !this->PeekShift(TokenLabel::TLE)) ||
+          (label == TokenLabel::TGE && !this->PeekShift(TokenLabel::TGE)) ||
+          label == TokenLabel::TLEQ || label == TokenLabel::TGEQ) {
+        this->pos_++;
+        const int64_t rhs = this->Shift();
+        switch (label) {
+        case (TokenLabel::TLE): ret = ret < rhs; break;
+        case (TokenLabel::TGE): ret = ret > rhs; break;
+        case (TokenLabel::TLEQ): ret = ret <= rhs; break;
+        default: ret = ret >= rhs; break;
+        }
+      } else {
+        return ret;
+      }
+    }
+  }
+
+  auto Shift() -> int64_t {
+    int64_t ret = this->Additive();
+    while (true) {
+      if (this->PeekShift(TokenLabel::TLE)) {
+        this->pos_ += 2;
+        ret = Wrap(static_cast<uint64_t>(ret) << (this->Additive() & 63));
+      } else if (this->PeekShift(TokenLabel::TGE)) {
+        this->pos_ += 2;
+        ret >>= (this->Additive() & 63);
+      } else {
+        return ret;
+      }
+    }
+  }
+
+  auto Additive() -> int64_t {
+    int64_t ret = this->Multiplicative();
+    while (true) {
+      if (this->Peek() == TokenLabel::TADD) {
+        this->pos_++;
+        ret = Wrap(static_cast<uint64_t>(ret) + static_cast<uint64_t>(this->Multiplicative()));
+      } else if (this->Peek() == TokenLabel::TSUB) {
+        this->pos_++;
+        ret = Wrap(static_cast<uint64_t>(ret) - static_cast<uint64_t>(this->Multiplicative()));
+      } else {
+        return ret;
+      }
+    }
+  }
+
+  auto Multiplicative() -> int64_t {
+    int64_t ret = this->Unary();
+    while (true) {
+      const auto label = this->Peek();
+      if (label != TokenLabel::TMUL && label != TokenLabel::TDIV &&
+          label != TokenLabel::TREM) {
+        return ret;
+      }
+      this->pos_++;
+      const int64_t rhs = this->Unary();
+      if (label == TokenLabel::TMUL) {
+        ret = Wrap(static_cast<uint64_t>(ret) * static_cast<uint64_t>(rhs));
+      } else if (rhs == 0) {
+        if (!this->skip_) {
+          ErrorAt(this->path_, this->line_, "division by zero in #if");
+        }
+        ret = 0;
+      } else if (rhs == -1) {
+        // INT64_MIN / -1 overflows.
+        ret = label == TokenLabel::TDIV ? Wrap(0 - static_cast<uint64_t>(ret)) : 0;
+      } else {
+        ret = label == TokenLabel::TDIV ? ret / rhs : ret % rhs;
+      }
+    }
+  }
+
+  auto Unary() -> int64_t {
+    switch (this->Peek()) {
+    case (TokenLabel::TNOT): this->pos_++; return !this->Unary();
+    case (TokenLabel::TFLIP): this->pos_++; return ~this->Unary();
+    case (TokenLabel::TSUB): this->pos_++; return Wrap(0 - static_cast<uint64_t>(this->Unary()));
+    case (TokenLabel::TADD): this->pos_++; return this->Unary();
+    default: return this->Primary();
+    }
+  }
+
+  auto Primary() -> int64_t {
+    if (this->pos_ >= this->tokens_.size()) {
+      ErrorAt(this->path_, this->line_, "#if with no expression");
+    }
+    const Token &token = this->tokens_[this->pos_++];
+    switch (token.label) {
+    case (TokenLabel::TLEFTPARENT): {
+      const int64_t ret = this->Ternary();
+      this->Expect(TokenLabel::TRIGHTPARENT, "')'");
+      return ret;
+    }
+    case (TokenLabel::TQUOTE): {
+      return this->Char(token.Text());
+    }
+    default: {
+      break;
+    }
+    }
+
+    const auto text = token.Text();
+    if (!text.empty() && isdigit(static_cast<uint8_t>(text[0]))) {
+      return this->Number(text);
+    }
+    // L'c', u'c' and U'c'
+    if ((text == "L" || text == "u" || text == "U") && this->Peek() == TokenLabel::TQUOTE &&
+        Adjacent(token, this->tokens_[this->pos_])) {
+      return this->Char(this->tokens_[this->pos_++].Text());
+    }
+    // identifiers left after expansion, keywords included, are 0.
+    if (!text.empty() && (isalpha(static_cast<uint8_t>(text[0])) || text[0] == '_')) {
+      return 0;
+    }
+    ErrorAt(this->path_, this->line_, "token \"" + std::string(text) +
+            "\" is not valid in #if");
+  }
+
+  auto Number(std::string_view text) -> int64_t {
+    // drop the suffix
+    while (!text.empty() && strchr("uUlL", text.back()) != nullptr) {
+      text.remove_suffix(1);
+    }
+    const std::string str(text);
+    char *end = nullptr;
+    const uint64_t ret = strtoull(str.c_str(), &end, 0);
+    if (str.empty() || *end != '\0') {
+      ErrorAt(this->path_, this->line_, "invalid integer \"" + str + "\" in #if");
+    }
+    return static_cast<int64_t>(ret);
+  }
+
+  auto Char(std::string_view text) -> int64_t {
+    // 'c' or '\c'
+    if (text.size() == 3) {
+      return static_cast<int8_t>(text[1]);
+    }
+    if (text.size() == 4 && text[1] == '\\') {
+      switch (text[2]) {
+      case ('n'): return '\n';
+      case ('t'): return '\t';
+      case ('r'): return '\r';
+      case ('0'): return 0;
+      default: return static_cast<int8_t>(text[2]);
+      }
+    }
+    ErrorAt(this->path_, this->line_, "invalid character constant in #if");
+  }
+
+  const std::vector<Token> &tokens_;
+  const std::string &path_;
+  uint32_t line_;
+  size_t pos_{0};
+  // in a branch that is not evaluated
+  int skip_{0};
+};
+
+Preprocessor::Preprocessor() {
+  // not gcc: __GNUC__ is not defined.
+  const std::pair<const char *, const char *> predefined[] = {
+    {"__STDC__", "1"},
+    {"__STDC_VERSION__", "201710L"},
+    {"__STDC_HOSTED__", "1"},
+    {"__x86_64__", "1"},
+    {"__linux__", "1"},
+    {"__unix__", "1"},
+    {"__LP64__", "1"},
+    {"__CHAR_BIT__", "8"},
+    {"__SIZEOF_INT__", "4"},
+    {"__SIZEOF_LONG__", "8"},
+    {"__SIZEOF_POINTER__", "8"},
+    {"__SCHAR_MAX__", "0x7f"},
+    {"__SHRT_MAX__", "0x7fff"},
+    {"__INT_MAX__", "0x7fffffff"},
+    {"__LONG_MAX__", "0x7fffffffffffffffL"},
+    {"__SIZE_TYPE__", "long unsigned int"},
+    {"__PTRDIFF_TYPE__", "long int"},
+    {"__WCHAR_TYPE__", "int"},
+    {"__WCHAR_MAX__", "0x7fffffff"},
+    {"__WINT_TYPE__", "unsigned int"},
+  };
+  for (const auto &macro : predefined) {
+    this->Define(macro.first, macro.second);
+  }
+}
+
+auto Preprocessor::AddIncludeDir(const std::string &dir) -> void {
+  this->include_dirs_.push_back(dir);
+  this->resolved_.clear();
+}
+
+auto Preprocessor::AddSystemIncludeDirs() -> void {
+  this->AddIncludeDir("/usr/local/include");
+
+  // headers of the compiler, e.g. stddef.h.
+  const char *gcc_dir = "/usr/lib/gcc/x86_64-linux-gnu";
+  if (DIR *dir = opendir(gcc_dir)) {
+    std::string best;
+    while (struct dirent *ent = readdir(dir)) {
+      if (isdigit(static_cast<uint8_t>(ent->d_name[0])) &&
+          (best.empty() || atoi(ent->d_name) > atoi(best.c_str()))) {
+        best = ent->d_name;
+      }
+    }
+    closedir(dir);
+    if (!best.empty()) {
+      this->AddIncludeDir(std::string(gcc_dir) + "/" + best + "/include");
+    }
+  }
+
+  this->AddIncludeDir("/usr/include/x86_64-linux-gnu");
+  this->AddIncludeDir("/usr/include");
+}
+
+auto Preprocessor::Define(std::string_view name, std::string_view value) -> void {
+  // tokens of the command must outlive the macro, keep the text interned.
+  const std::string text = std::string(name) + " " + std::string(value);
+  const std::string_view stored = Lex::AtomText(Lex::Intern(text));
+  std::vector<Token> tokens;
+  TokenizeCommand(stored, 0, 1, tokens);
+  this->DefineMacro(tokens.data(), tokens.data() + tokens.size());
+}
+
+auto Preprocessor::Undefine(std::string_view name) -> void {
+  this->macros_.erase(Lex::Intern(name));
+}
+
+auto Preprocessor::Error(uint32_t line, const std::string &msg) const -> void {
+  ErrorAt(this->file_ ? this->file_->path : "<command line>", line, msg);
+}
+
+auto Preprocessor::Run(const std::string &path) -> std::vector<Lex::Token> {
+  this->out_.clear();
+  this->in_condition_ = false;
+  this->ProcessFile(GetCachedFile(path), 0);
+  return std::move(this->out_);
+}
+
+auto Preprocessor::ProcessFile(std::shared_ptr<const CachedFile> file,
+                               size_t dir_index) -> void {
+  if (file->pragma_once && this->once_.count(file->path)) {
+    return;
+  }
+  // included again, but its guard is defined.
+  if (file->guard != Lex::null_atom && this->macros_.count(file->guard)) {
+    return;
+  }
+  if (this->depth_ >= max_include_depth) {
+    this->Error(1, "#include nested too deeply");
+  }
+  if (file->pragma_once) {
+    this->once_.insert(file->path);
+  }
+  this->files_.push_back(file);
+
+  const CachedFile *saved_file = this->file_;
+  const size_t saved_dir = this->dir_index_;
+  this->file_ = file.get();
+  this->dir_index_ = dir_index;
+  this->depth_++;
+
+  std::vector<Cond> conds;
+  const Token *tok = file->tokens.data();
+  const Token *end = tok + file->tokens.size();
+  std::vector<Lex::Atom> active;
+  while (tok < end) {
+    if (tok->label == TokenLabel::TSHARP) {
+      const Token *cmd_end = tok + 1;
+      while (cmd_end->label != TokenLabel::TNULL) {
+        cmd_end++;
+      }
+      this->Directive(tok + 1, cmd_end, conds);
+      tok = cmd_end + 1;
+      continue;
+    }
+
+    const Token *text_end = tok;
+    while (text_end < end && text_end->label != TokenLabel::TSHARP) {
+      text_end++;
+    }
+    if (conds.empty() || conds.back().taking) {
+      this->Expand(tok, text_end, this->out_, active);
+    }
+    tok = text_end;
+  }
+
+  if (!conds.empty()) {
+    this->Error(conds.back().line, "unterminated #if");
+  }
+
+  this->depth_--;
+  this->file_ = saved_file;
+  this->dir_index_ = saved_dir;
+}
+
+auto Preprocessor::Directive(const Token *begin, const Token *end,
+                             std::vector<Cond> &conds) -> void {
+  if (begin == end) {
+    // null directive
+    return;
+  }
+  const bool taking = conds.empty() || conds.back().taking;
+  const auto name = begin->Text();
+  const uint32_t line = begin->line;
+
+  if (name == "ifdef" || name == "ifndef") {
+    if (!taking) {
+      conds.push_back({false, true, false, line});
+      return;
+    }
+    if (begin + 1 == end || NameOf(begin[1]) == Lex::null_atom) {
+      this->Error(line, "no macro name given in #" + std::string(name));
+    }
+    const bool defined = this->macros_.count(NameOf(begin[1])) != 0;
+    const bool cond = name == "ifdef" ? defined : !defined;
+    conds.push_back({cond, cond, false, line});
+    return;
+  }
+  if (name == "if") {
+    if (!taking) {
+      conds.push_back({false, true, false, line});
+      return;
+    }
+    const bool cond = this->EvalCondition(begin + 1, end);
+    conds.push_back({cond, cond, false, line});
+    return;
+  }
+  if (name == "elif" || name == "else" || name == "endif") {
+    if (conds.empty()) {
+      this->Error(line, "#" + std::string(name) + " without #if");
+    }
+    auto &cond = conds.back();
+    if (name == "endif") {
+      conds.pop_back();
+      return;
+    }
+    if (cond.seen_else) {
+      this->Error(line, "#" + std::string(name) + " after #else");
+    }
+    if (name == "else") {
+      cond.seen_else = true;
+      cond.taking = !cond.taken;
+      cond.taken = true;
+    } else if (cond.taken) {
+      cond.taking = false;
+    } else {
+      cond.taking = cond.taken = this->EvalCondition(begin + 1, end);
+    }
+    return;
+  }
+
+  if (!taking) {
+    return;
+  }
+
+  if (name == "include" || name == "include_next") {
+    this->Include(begin + 1, end, name == "include_next");
+  } else if (name == "define") {
+    this->DefineMacro(begin + 1, end);
+  } else if (name == "undef") {
+    if (begin + 1 == end || NameOf(begin[1]) == Lex::null_atom) {
+      this->Error(line, "no macro name given in #undef");
+    }
+    this->macros_.erase(NameOf(begin[1]));
+  } else if (name == "error" || name == "warning") {
+    std::string msg = "#" + std::string(name);
+    if (begin + 1 < end) {
+      const Token &last = end[-1];
+      msg += " " + std::string(begin[1].src + begin[1].offset,
+                               last.offset + last.length - begin[1].offset);
+    }
+    if (name == "error") {
+      this->Error(line, msg);
+    }
+    fprintf(stderr, "%s:%u: %s\n", this->file_->path.c_str(), line, msg.c_str());
+  } else if (name != "pragma" && name != "line" && name != "ident") {
+    this->Error(line, "invalid preprocessing directive #" + std::string(name));
+  }
+}
+
+auto Preprocessor::Include(const Token *begin, const Token *end, bool next) -> void {
+  const uint32_t line = begin[-1].line;
+  std::vector<Token> expanded;
+  if (begin < end && begin->label != TokenLabel::TDOUBLEQUOTE &&
+      begin->label != TokenLabel::TLE) {
+    // computed include
+    std::vector<Lex::Atom> active;
+    this->Expand(begin, end, expanded, active);
+    begin = expanded.data();
+    end = begin + expanded.size();
+  }
+
+  std::string name;
+  bool quoted = false;
+  if (begin < end && begin->label == TokenLabel::TDOUBLEQUOTE) {
+    const auto text = begin->Text();
+    name = std::string(text.substr(1, text.size() - 2));
+    quoted = true;
+  } else if (begin < end && begin->label == TokenLabel::TLE) {
+    const Token *p = begin + 1;
+    for (; p < end && p->label != TokenLabel::TGE; p++) {
+      if (p > begin + 1 && !Adjacent(p[-1], *p)) {
+        name += ' ';
+      }
+      name += p->Text();
+    }
+    if (p == end) {
+      this->Error(line, "missing terminating > character");
+    }
+  } else {
+    this->Error(line, "#include expects \"FILENAME\" or <FILENAME>");
+  }
+
+  const auto found = this->Resolve(name, quoted && !next, next ? this->dir_index_ : 0);
+  if (found.first.empty()) {
+    this->Error(line, name + ": No such file or directory");
+  }
+  this->ProcessFile(GetCachedFile(found.first), found.second);
+}
+
+auto Preprocessor::Resolve(const std::string &name, bool quoted, size_t from_dir)
+    -> std::pair<std::string, size_t> {
+  auto exists = [](const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+  };
+  if (!name.empty() && name[0] == '/') {
+    return {exists(name) ? name : std::string(), 0};
+  }
+
+  // files of the current directory only depend on it.
+  std::string dir;
+  if (quoted) {
+    const auto &path = this->file_->path;
+    const size_t slash = path.rfind('/');
+    dir = slash == std::string::npos ? "." : path.substr(0, slash);
+  }
+  const std::string key = dir + '\0' + name + '\0' + std::to_string(from_dir);
+  auto it = this->resolved_.find(key);
+  if (it != this->resolved_.end()) {
+    return it->second;
+  }
+
+  std::pair<std::string, size_t> ret;
+  if (quoted && exists(dir + "/" + name)) {
+    ret = {dir + "/" + name, 0};
+  } else {
+    for (size_t i = from_dir; i < this->include_dirs_.size(); i++) {
+      const std::string path = this->include_dirs_[i] + "/" + name;
+      if (exists(path)) {
+        ret = {path, i + 1};
+        break;
+      }
+    }
+  }
+  this->resolved_[key] = ret;
+  return ret;
+}
+
+auto Preprocessor::DefineMacro(const Token *begin, const Token *end) -> void {
+  const uint32_t line = begin == end ? 1 : begin->line;
+  const Lex::Atom name = begin == end ? Lex::null_atom : NameOf(*begin);
+  if (name == Lex::null_atom) {
+    this->Error(line, "macro names must be identifiers");
+  }
+  this->keyword_macros_ |= begin->label != TokenLabel::TALPHA;
+  Macro macro;
+  std::vector<Lex::Atom> params;
+  const Token *p = begin + 1;
+
+  // a function-like macro has a '(' right after its name.
+  if (p < end && p->label == TokenLabel::TLEFTPARENT && Adjacent(*begin, *p)) {
+    macro.function_like = true;
+    p++;
+    while (p < end && p->label != TokenLabel::TRIGHTPARENT) {
+      if (p + 2 < end && p[0].label == TokenLabel::TDOT &&
+          p[1].label == TokenLabel::TDOT && p[2].label == TokenLabel::TDOT) {
+        macro.variadic = true;
+        params.push_back(Lex::Intern("__VA_ARGS__"));
+        p += 3;
+      } else if (p->label == TokenLabel::TALPHA) {
+        params.push_back(p->atom);
+        p++;
+        // GNU named variadic parameter, as in args...
+        if (p + 2 < end && p[0].label == TokenLabel::TDOT &&
+            p[1].label == TokenLabel::TDOT && p[2].label == TokenLabel::TDOT) {
+          macro.variadic = true;
+          p += 3;
+        }
+      } else {
+        this->Error(line, "expected parameter name in macro parameter list");
+      }
+      if (p < end && p->label == TokenLabel::TCOMMA && !macro.variadic) {
+        p++;
+      } else if (p >= end || p->label != TokenLabel::TRIGHTPARENT) {
+        this->Error(line, "expected ',' or ')' in macro parameter list");
+      }
+    }
+    if (p == end) {
+      this->Error(line, "missing ')' in macro parameter list");
+    }
+    p++;
+  }
+  macro.num_params = params.size();
+
+  auto param_of = [&](const Token &token) -> size_t {
+    if (token.label != TokenLabel::TALPHA) {
+      return params.size();
+    }
+    return std::find(params.begin(), params.end(), token.atom) - params.begin();
+  };
+
+  for (; p < end; p++) {
+    if (p->label == TokenLabel::TSHARP && p + 1 < end &&
+        p[1].label == TokenLabel::TSHARP && Adjacent(p[0], p[1])) {
+      if (macro.body.empty() || p + 2 == end) {
+        this->Error(line, "'##' cannot appear at either end of a macro expansion");
+      }
+      // the operands of ## are not expanded.
+      if (macro.body.back().kind == Macro::PARAM) {
+        macro.body.back().kind = Macro::RAW_PARAM;
+      }
+      macro.body.push_back({Macro::PASTE, *p, 0});
+      p++;
+      continue;
+    }
+    const bool after_paste = !macro.body.empty() && macro.body.back().kind == Macro::PASTE;
+    if (macro.function_like && p->label == TokenLabel::TSHARP) {
+      if (p + 1 == end || param_of(p[1]) == params.size()) {
+        this->Error(line, "'#' is not followed by a macro parameter");
+      }
+      macro.body.push_back({Macro::STRINGIZE, *p, param_of(p[1])});
+      p++;
+      continue;
+    }
+    const size_t param = param_of(*p);
+    if (param < params.size()) {
+      macro.body.push_back({after_paste ? Macro::RAW_PARAM : Macro::PARAM, *p, param});
+    } else {
+      macro.body.push_back({Macro::TOKEN, *p, 0});
+    }
+  }
+
+  this->macros_[name] = std::move(macro);
+}
+
+auto Preprocessor::EvalCondition(const Token *begin, const Token *end) -> bool {
+  const uint32_t line = begin[-1].line;
+
+  // `defined` is replaced while expanding, see Expand.
+  std::vector<Token> expanded;
+  std::vector<Lex::Atom> active;
+  this->in_condition_ = true;
+  this->Expand(begin, end, expanded, active);
+  this->in_condition_ = false;
+  return CondEval(expanded, this->file_->path, line).Eval() != 0;
+}
+
+// Returns "text" of `tokens`, for # param.
+static auto Stringize(const std::vector<Token> &tokens, uint32_t line) -> Token {
+  std::string str = "\"";
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (i > 0 && !Adjacent(tokens[i - 1], tokens[i])) {
+      str += ' ';
+    }
+    const bool literal = tokens[i].label == TokenLabel::TDOUBLEQUOTE ||
+                         tokens[i].label == TokenLabel::TQUOTE;
+    for (const char ch : tokens[i].Text()) {
+      if (literal && (ch == '\\' || ch == '\"')) {
+        str += '\\';
+      }
+      str += ch;
+    }
+  }
+  str += '\"';
+  return MakeToken(str, TokenLabel::TDOUBLEQUOTE, line);
+}
+
+auto Preprocessor::Substitute(const Macro &macro,
+                              const std::vector<std::vector<Token>> &args,
+                              uint32_t line, std::vector<Token> &out,
+                              std::vector<Lex::Atom> &active) -> void {
+  auto append = [&](const std::vector<Token> &tokens) {
+    for (Token token : tokens) {
+      token.line = line;
+      out.push_back(token);
+    }
+  };
+
+  // the last item put nothing, e.g. an empty argument.
+  bool empty = false;
+  for (size_t i = 0; i < macro.body.size(); i++) {
+    const auto &item = macro.body[i];
+    const size_t size = out.size();
+    switch (item.kind) {
+    case (Macro::TOKEN): {
+      append({item.token});
+      break;
+    }
+    case (Macro::PARAM): {
+      std::vector<Token> expanded;
+      const auto &arg = args[item.param];
+      this->Expand(arg.data(), arg.data() + arg.size(), expanded, active);
+      append(expanded);
+      break;
+    }
+    case (Macro::RAW_PARAM): {
+      append(args[item.param]);
+      break;
+    }
+    case (Macro::STRINGIZE): {
+      append({Stringize(args[item.param], line)});
+      break;
+    }
+    case (Macro::PASTE): {
+      // the right operand is the next item.
+      const auto &next = macro.body[++i];
+      std::vector<Token> rhs;
+      if (next.kind == Macro::RAW_PARAM) {
+        rhs = args[next.param];
+      } else if (next.kind == Macro::STRINGIZE) {
+        rhs = {Stringize(args[next.param], line)};
+      } else {
+        rhs = {next.token};
+      }
+
+      // `, ## __VA_ARGS__` drops the comma if there are no variadic args,
+      // and pastes nothing otherwise.
+      if (next.kind == Macro::RAW_PARAM && macro.variadic &&
+          next.param + 1 == macro.num_params && !empty &&
+          out.back().label == TokenLabel::TCOMMA) {
+        if (rhs.empty()) {
+          out.pop_back();
+        }
+        append(rhs);
+        break;
+      }
+      if (empty || rhs.empty()) {
+        append(rhs);
+        break;
+      }
+
+      const std::string text = std::string(out.back().Text()) + std::string(rhs[0].Text());
+      const std::string_view stored = Lex::AtomText(Lex::Intern(text));
+      std::vector<Token> pasted;
+      Lex::Lexer lexer(stored, true);
+      Token token;
+      while (lexer.Next(&token)) {
+        pasted.push_back(token);
+      }
+      if (pasted.size() != 1) {
+        this->Error(line, "pasting \"" + std::string(out.back().Text()) + "\" and \"" +
+                    std::string(rhs[0].Text()) + "\" does not give a valid token");
+      }
+      out.back() = pasted[0];
+      out.back().line = line;
+      append(std::vector<Token>(rhs.begin() + 1, rhs.end()));
+      break;
+    }
+    }
+    empty = out.size() == size && item.kind != Macro::PASTE;
+  }
+}
+
+auto Preprocessor::Expand(const Token *begin, const Token *end,
+                          std::vector<Token> &out, std::vector<Lex::Atom> &active) -> void {
+  static const Lex::Atom line_atom = Lex::Intern("__LINE__");
+  static const Lex::Atom file_atom = Lex::Intern("__FILE__");
+  static const Lex::Atom defined_atom = Lex::Intern("defined");
+
+  // replacements to rescan with the rest of the input, last token first.
+  // Each ends with a TNULL token, past which the macro it replaced can be
+  // expanded again.
+  std::vector<Token> pending;
+  const size_t base = active.size();
+  const Token *t = begin;
+  // Returns the next token, or null at the end of the input.
+  auto peek = [&]() -> const Token * {
+    while (!pending.empty() && pending.back().label == TokenLabel::TNULL) {
+      pending.pop_back();
+      active.pop_back();
+    }
+    return !pending.empty() ? &pending.back() : (t < end ? t : nullptr);
+  };
+  auto advance = [&]() {
+    if (!pending.empty()) {
+      pending.pop_back();
+    } else {
+      t++;
+    }
+  };
+
+  for (const Token *next = peek(); next != nullptr; next = peek()) {
+    const Token tok = *next;
+    advance();
+    // keywords are only looked up if one of them is a macro.
+    const Lex::Atom atom = tok.label == TokenLabel::TALPHA ? tok.atom :
+      (this->keyword_macros_ ? NameOf(tok) : Lex::null_atom);
+    if (atom == Lex::null_atom) {
+      out.push_back(tok);
+      continue;
+    }
+    // `defined X` and `defined(X)` in #if, also when a macro gives them, as
+    // in gcc. X is not expanded.
+    if (atom == defined_atom && this->in_condition_) {
+      const Token *name = peek();
+      const bool paren = name != nullptr && name->label == TokenLabel::TLEFTPARENT;
+      if (paren) {
+        advance();
+        name = peek();
+      }
+      if (name == nullptr || NameOf(*name) == Lex::null_atom) {
+        this->Error(tok.line, "operator \"defined\" requires an identifier");
+      }
+      const bool defined = this->macros_.count(NameOf(*name)) != 0;
+      advance();
+      if (paren) {
+        const Token *close = peek();
+        if (close == nullptr || close->label != TokenLabel::TRIGHTPARENT) {
+          this->Error(tok.line, "missing ')' after \"defined\"");
+        }
+        advance();
+      }
+      out.push_back(MakeToken(defined ? "1" : "0", TokenLabel::TDIGIT, tok.line));
+      continue;
+    }
+    if (atom == line_atom) {
+      out.push_back(MakeToken(std::to_string(tok.line), TokenLabel::TDIGIT, tok.line));
+      continue;
+    }
+    if (atom == file_atom) {
+      out.push_back(MakeToken("\"" + this->file_->path + "\"", TokenLabel::TDOUBLEQUOTE,
+                              tok.line));
+      continue;
+    }
+
+    auto it = this->macros_.find(atom);
+    if (it == this->macros_.end() ||
+        std::find(active.begin(), active.end(), atom) != active.end()) {
+      out.push_back(tok);
+      continue;
+    }
+    const Macro &macro = it->second;
+    const uint32_t line = tok.line;
+    std::vector<std::vector<Token>> args;
+
+    if (macro.function_like) {
+      // not an invocation without arguments. The '(' may come after the
+      // end of a replacement, e.g. `g(2)` with `#define g f`.
+      const Token *paren = peek();
+      if (paren == nullptr || paren->label != TokenLabel::TLEFTPARENT) {
+        out.push_back(tok);
+        continue;
+      }
+      advance();
+
+      args.emplace_back();
+      size_t depth = 0;
+      const Token *p = peek();
+      for (; p != nullptr; advance(), p = peek()) {
+        if (p->label == TokenLabel::TLEFTPARENT) {
+          depth++;
+        } else if (p->label == TokenLabel::TRIGHTPARENT) {
+          if (depth == 0) {
+            break;
+          }
+          depth--;
+        } else if (p->label == TokenLabel::TCOMMA && depth == 0 &&
+                   !(macro.variadic && args.size() == macro.num_params)) {
+          args.emplace_back();
+          continue;
+        }
+        args.back().push_back(*p);
+      }
+      const std::string name(tok.Text());
+      if (p == nullptr) {
+        this->Error(line, "unterminated argument list invoking macro \"" + name + "\"");
+      }
+      advance();
+      if (macro.num_params == 0 && args.size() == 1 && args[0].empty()) {
+        args.clear();
+      }
+      if (macro.variadic && args.size() + 1 == macro.num_params) {
+        args.emplace_back();
+      }
+      if (args.size() != macro.num_params) {
+        this->Error(line, "macro \"" + name + "\" requires " +
+                    std::to_string(macro.num_params) + " arguments, but " +
+                    std::to_string(args.size()) + " given");
+      }
+    }
+
+    std::vector<Token> replaced;
+    this->Substitute(macro, args, line, replaced, active);
+    // rescan with the rest of the input, without expanding the macro again
+    // before the end of its replacement.
+    pending.emplace_back();
+    pending.insert(pending.end(), replaced.rbegin(), replaced.rend());
+    active.push_back(it->first);
+  }
+  assert(active.size() == base);
+}
+
+} // namespace Preprocessor
@@ -0,0 +1,146 @@
+#ifndef __PREPROC_H__
+#define __PREPROC_H__
+
+// A C preprocessor working on tokens, between the tokenizer and the parser.
+//
+// It handles #include, object-like and function-like #define (with # and
+// ##), #undef, #if/#ifdef/#ifndef/#elif/#else/#endif, #error and
+// #pragma once. Files are tokenized once per process and cached by path
+// and mtime, and headers with an include guard are skipped without being
+// looked at once their guard macro is defined.
+//
+// Tokens of macro expansions take the line of the macro invocation.
+
+#include "lex.h"
+#include "intern.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Preprocessor {
+
+// A tokenized file, shared by all the preprocessors of the process.
+struct CachedFile {
+  std::string path;
+  std::unique_ptr<FileSource> source;
+  // null tokens dropped. each command is a TSHARP token, the tokens of the
+  // command, then a TNULL token.
+  std::vector<Lex::Token> tokens;
+  // macro of the include guard, if any.
+  Lex::Atom guard{Lex::null_atom};
+  bool pragma_once{false};
+};
+
+// Returns the tokens of the file at `path`, tokenized once per process
+// for each modification time. Thread-safe.
+// @throw std::runtime_error if the file cannot be read.
+auto GetCachedFile(const std::string &path) -> std::shared_ptr<const CachedFile>;
+
+struct Macro {
+  enum Kind {
+    TOKEN = 0, // copied as is
+    PARAM,     // replaced with the expanded argument
+    RAW_PARAM, // replaced with the argument, next to ##
+    STRINGIZE, // # param
+    PASTE,     // ##
+  };
+  struct Item {
+    Kind kind;
+    Lex::Token token;
+    size_t param;
+  };
+
+  std::vector<Item> body;
+  size_t num_params{0};
+  bool function_like{false};
+  bool variadic{false};
+};
+
+class Preprocessor {
+ public:
+  Preprocessor();
+  ~Preprocessor() = default;
+
+  // disallow copy
+  Preprocessor(const Preprocessor &) = delete;
+  Preprocessor &operator=(const Preprocessor &) = delete;
+
+  // Add a directory to search for included files, after the ones added.
+  auto AddIncludeDir(const std::string &dir) -> void;
+
+  // Add the usual system directories.
+  auto AddSystemIncludeDirs() -> void;
+
+  // Same as `#define name value`.
+  auto Define(std::string_view name, std::string_view value) -> void;
+
+  auto Undefine(std::string_view name) -> void;
+
+  // Preprocess the file at `path` (- for stdin). Returns the tokens
+  // without null tokens, which are valid while the preprocessor lives.
+  // Macros defined by the file remain defined.
+  // @throw std::runtime_error on errors, with the file and line.
+  auto Run(const std::string &path) -> std::vector<Lex::Token>;
+
+ private:
+  struct Cond {
+    bool taking;     // the current group is taken
+    bool taken;      // a group of this #if was taken
+    bool seen_else;
+    uint32_t line;   // of the #if
+  };
+
+  auto ProcessFile(std::shared_ptr<const CachedFile> file, size_t dir_index) -> void;
+
+  // Handle the command in [begin, end) of the current file.
+  auto Directive(const Lex::Token *begin, const Lex::Token *end,
+                 std::vector<Cond> &conds) -> void;
+  auto Include(const Lex::Token *begin, const Lex::Token *end, bool next) -> void;
+  auto DefineMacro(const Lex::Token *begin, const Lex::Token *end) -> void;
+  auto EvalCondition(const Lex::Token *begin, const Lex::Token *end) -> bool;
+
+  // Expand the macros of [begin, end) into `out`. Macros in `active` are
+  // being expanded, and are not expanded again.
+  auto Expand(const Lex::Token *begin, const Lex::Token *end,
+              std::vector<Lex::Token> &out, std::vector<Lex::Atom> &active) -> void;
+  // Substitute the arguments of a function-like macro.
+  auto Substitute(const Macro &macro, const std::vector<std::vector<Lex::Token>> &args,
+                  uint32_t line, std::vector<Lex::Token> &out,
+                  std::vector<Lex::Atom> &active) -> void;
+
+  // Returns the path of an included file, and the index of the directory
+  // it was found in, or an empty path.
+  auto Resolve(const std::string &name, bool quoted, size_t from_dir)
+    -> std::pair<std::string, size_t>;
+
+  [[noreturn]] auto Error(uint32_t line, const std::string &msg) const -> void;
+
+  std::unordered_map<Lex::Atom, Macro> macros_;
+  // a keyword is defined as a macro, e.g. bool
+  bool keyword_macros_{false};
+  std::vector<std::string> include_dirs_;
+  // files in use, so that their tokens stay valid.
+  std::vector<std::shared_ptr<const CachedFile>> files_;
+  std::unordered_set<std::string> once_;
+  // (directory, name) to resolved path and directory index.
+  std::unordered_map<std::string, std::pair<std::string, size_t>> resolved_;
+
+  // the file being processed
+  const CachedFile *file_{nullptr};
+  // where #include_next of the file starts searching
+  size_t dir_index_{0};
+  size_t depth_{0};
+  // the tokens expanded are the expression of an #if
+  bool in_condition_{false};
+  std::vector<Lex::Token> out_;
+};
+
+} // namespace Preprocessor
+
+#endif // __PREPROC_H__
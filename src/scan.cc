@@ -0,0 +1,377 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace Lex {
+namespace Scan {
+
+static const char *isa_names[] = {
+  "scalar",
+  "sse2",
+  "avx2",
+};
+
+const char *GetNameOfIsa(Isa isa) {
+  return isa_names[static_cast<int>(isa)];
+}
+
+static inline bool IsIdentifierChar(char ch) {
+  return (ch >= 'a' && ch <= 'z') ||
+         (ch >= 'A' && ch <= 'Z') ||
+         (ch >= '0' && ch <= '9') ||
+         (ch == '_');
+}
+
+static inline bool IsBlankChar(char ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+// scalar kernels, also used for the tails of the vector kernels.
+
+static size_t SkipIdentifierScalar(const char *str, size_t from, size_t len) {
+  while (from < len && IsIdentifierChar(str[from])) {
+    from++;
+  }
+  return from;
+}
+
+static size_t SkipBlanksScalar(const char *str, size_t from, size_t len,
+                               uint32_t *newlines) {
+  while (from < len && IsBlankChar(str[from])) {
+    if (str[from] == '\n') {
+      *newlines += 1;
+    }
+    from++;
+  }
+  return from;
+}
+
+static size_t FindCharOrEscapeScalar(const char *str, size_t from, size_t len,
+                                     char ch, uint32_t *newlines) {
+  while (from < len && str[from] != ch && str[from] != '\\') {
+    if (str[from] == '\n') {
+      *newlines += 1;
+    }
+    from++;
+  }
+  return from;
+}
+
+static size_t FindCommentEndScalar(const char *str, size_t from, size_t len,
+                                   uint32_t *newlines) {
+  while (from < len) {
+    if (str[from] == '*' && from + 1 < len && str[from + 1] == '/') {
+      break;
+    }
+    if (str[from] == '\n') {
+      *newlines += 1;
+    }
+    from++;
+  }
+  return from;
+}
+
+static size_t CountNewlinesScalar(const char *str, size_t from, size_t to) {
+  size_t ret = 0;
+  for (; from < to; from++) {
+    ret += (str[from] == '\n');
+  }
+  return ret;
+}
+
+static const Kernels scalar_kernels = {
+  SkipIdentifierScalar,
+  SkipBlanksScalar,
+  FindCharOrEscapeScalar,
+  FindCommentEndScalar,
+  CountNewlinesScalar,
+};
+
+#ifdef SCAN_X86
+
+// Bits below the first set bit of `mask`.
+static inline uint32_t BitsBelow(uint32_t mask) {
+  return (mask & -mask) - 1;
+}
+
+// sse2 kernels, 16 bytes at a time.
+//
+// Unsigned range checks are done with signed compares: with
+// t = x - lo + 0x80, lo <= x < lo + n iff t < -128 + n.
+
+__attribute__((target("sse2")))
+static inline __m128i InRange16(__m128i x, char lo, int n) {
+  const __m128i t = _mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(0x80 - lo)));
+  return _mm_cmplt_epi8(t, _mm_set1_epi8(static_cast<char>(-128 + n)));
+}
+
+__attribute__((target("sse2")))
+static inline uint32_t IdentifierMask16(__m128i x) {
+  const __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+  const __m128i alpha = InRange16(lower, 'a', 26);
+  const __m128i digit = InRange16(x, '0', 10);
+  const __m128i under = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+  return _mm_movemask_epi8(_mm_or_si128(alpha, _mm_or_si128(digit, under)));
+}
+
+__attribute__((target("sse2")))
+static inline uint32_t ByteMask16(__m128i x, char ch) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8(ch)));
+}
+
+__attribute__((target("sse2")))
+static size_t SkipIdentifierSSE2(const char *str, size_t from, size_t len) {
+  while (from + 16 <= len) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from));
+    const uint32_t stop = ~IdentifierMask16(x) & 0xffff;
+    if (stop) {
+      return from + __builtin_ctz(stop);
+    }
+    from += 16;
+  }
+  return SkipIdentifierScalar(str, from, len);
+}
+
+__attribute__((target("sse2")))
+static size_t SkipBlanksSSE2(const char *str, size_t from, size_t len,
+                             uint32_t *newlines) {
+  while (from + 16 <= len) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from));
+    const __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                       InRange16(x, '\t', 5));
+    const uint32_t stop = ~_mm_movemask_epi8(blank) & 0xffff;
+    const uint32_t nl = ByteMask16(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 16;
+  }
+  return SkipBlanksScalar(str, from, len, newlines);
+}
+
+__attribute__((target("sse2")))
+static size_t FindCharOrEscapeSSE2(const char *str, size_t from, size_t len,
+                                   char ch, uint32_t *newlines) {
+  while (from + 16 <= len) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from));
+    const uint32_t stop = ByteMask16(x, ch) | ByteMask16(x, '\\');
+    const uint32_t nl = ByteMask16(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 16;
+  }
+  return FindCharOrEscapeScalar(str, from, len, ch, newlines);
+}
+
+__attribute__((target("sse2")))
+static size_t FindCommentEndSSE2(const char *str, size_t from, size_t len,
+                                 uint32_t *newlines) {
+  // the second load reads one byte ahead.
+  while (from + 17 <= len) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from));
+    const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from + 1));
+    const uint32_t stop = ByteMask16(x, '*') & ByteMask16(y, '/');
+    const uint32_t nl = ByteMask16(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 16;
+  }
+  return FindCommentEndScalar(str, from, len, newlines);
+}
+
+__attribute__((target("sse2")))
+static size_t CountNewlinesSSE2(const char *str, size_t from, size_t to) {
+  size_t ret = 0;
+  while (from + 16 <= to) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + from));
+    ret += __builtin_popcount(ByteMask16(x, '\n'));
+    from += 16;
+  }
+  return ret + CountNewlinesScalar(str, from, to);
+}
+
+static const Kernels sse2_kernels = {
+  SkipIdentifierSSE2,
+  SkipBlanksSSE2,
+  FindCharOrEscapeSSE2,
+  FindCommentEndSSE2,
+  CountNewlinesSSE2,
+};
+
+// avx2 kernels, 32 bytes at a time.
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt,bmi")))
+
+AVX2_TARGET
+static inline __m256i InRange32(__m256i x, char lo, int n) {
+  const __m256i t = _mm256_add_epi8(x, _mm256_set1_epi8(static_cast<char>(0x80 - lo)));
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(-128 + n)), t);
+}
+
+AVX2_TARGET
+static inline uint32_t IdentifierMask32(__m256i x) {
+  const __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+  const __m256i alpha = InRange32(lower, 'a', 26);
+  const __m256i digit = InRange32(x, '0', 10);
+  const __m256i under = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+  return _mm256_movemask_epi8(_mm256_or_si256(alpha, _mm256_or_si256(digit, under)));
+}
+
+AVX2_TARGET
+static inline uint32_t ByteMask32(__m256i x, char ch) {
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(ch)));
+}
+
+AVX2_TARGET
+static size_t SkipIdentifierAVX2(const char *str, size_t from, size_t len) {
+  while (from + 32 <= len) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from));
+    const uint32_t stop = ~IdentifierMask32(x);
+    if (stop) {
+      return from + __builtin_ctz(stop);
+    }
+    from += 32;
+  }
+  return SkipIdentifierSSE2(str, from, len);
+}
+
+AVX2_TARGET
+static size_t SkipBlanksAVX2(const char *str, size_t from, size_t len,
+                             uint32_t *newlines) {
+  while (from + 32 <= len) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from));
+    const __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                                          InRange32(x, '\t', 5));
+    const uint32_t stop = ~static_cast<uint32_t>(_mm256_movemask_epi8(blank));
+    const uint32_t nl = ByteMask32(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 32;
+  }
+  return SkipBlanksSSE2(str, from, len, newlines);
+}
+
+AVX2_TARGET
+static size_t FindCharOrEscapeAVX2(const char *str, size_t from, size_t len,
+                                   char ch, uint32_t *newlines) {
+  while (from + 32 <= len) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from));
+    const uint32_t stop = ByteMask32(x, ch) | ByteMask32(x, '\\');
+    const uint32_t nl = ByteMask32(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 32;
+  }
+  return FindCharOrEscapeSSE2(str, from, len, ch, newlines);
+}
+
+AVX2_TARGET
+static size_t FindCommentEndAVX2(const char *str, size_t from, size_t len,
+                                 uint32_t *newlines) {
+  // the second load reads one byte ahead.
+  while (from + 33 <= len) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from));
+    const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from + 1));
+    const uint32_t stop = ByteMask32(x, '*') & ByteMask32(y, '/');
+    const uint32_t nl = ByteMask32(x, '\n');
+    if (stop) {
+      *newlines += __builtin_popcount(nl & BitsBelow(stop));
+      return from + __builtin_ctz(stop);
+    }
+    *newlines += __builtin_popcount(nl);
+    from += 32;
+  }
+  return FindCommentEndSSE2(str, from, len, newlines);
+}
+
+AVX2_TARGET
+static size_t CountNewlinesAVX2(const char *str, size_t from, size_t to) {
+  size_t ret = 0;
+  while (from + 32 <= to) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + from));
+    ret += __builtin_popcount(ByteMask32(x, '\n'));
+    from += 32;
+  }
+  return ret + CountNewlinesSSE2(str, from, to);
+}
+
+#undef AVX2_TARGET
+
+static const Kernels avx2_kernels = {
+  SkipIdentifierAVX2,
+  SkipBlanksAVX2,
+  FindCharOrEscapeAVX2,
+  FindCommentEndAVX2,
+  CountNewlinesAVX2,
+};
+
+#endif // SCAN_X86
+
+auto DetectIsa() -> Isa {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") &&
+      __builtin_cpu_supports("bmi")) {
+    return Isa::AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return Isa::SSE2;
+  }
+#endif
+  return Isa::SCALAR;
+}
+
+static auto KernelsOf(Isa isa) -> const Kernels * {
+  switch (isa) {
+#ifdef SCAN_X86
+  case (Isa::AVX2): {
+    return &avx2_kernels;
+  }
+  case (Isa::SSE2): {
+    return &sse2_kernels;
+  }
+#endif
+  default: {
+    return &scalar_kernels;
+  }
+  }
+}
+
+// start with the scalar kernels, which need no initialization, and switch
+// to the best ones once the cpu is known.
+const Kernels *kernels = &scalar_kernels;
+static Isa current_isa = SetIsa(DetectIsa());
+
+auto GetIsa() -> Isa {
+  return current_isa;
+}
+
+auto SetIsa(Isa isa) -> Isa {
+  const Isa best = DetectIsa();
+  if (static_cast<int>(isa) > static_cast<int>(best)) {
+    isa = best;
+  }
+  kernels = KernelsOf(isa);
+  current_isa = isa;
+  return isa;
+}
+
+} // namespace Scan
+} // namespace Lex
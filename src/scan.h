@@ -0,0 +1,88 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+// Byte-scanning kernels used by the tokenizer.
+// Each kernel has a scalar version and SSE2/AVX2 versions on x86. The best
+// one supported by the cpu is selected at startup; all of them produce
+// identical results.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Lex {
+namespace Scan {
+
+enum class Isa {
+  SCALAR = 0,
+  SSE2,
+  AVX2,
+};
+
+const char *GetNameOfIsa(Isa isa);
+
+struct Kernels {
+  // Returns the first index in [from, len) that is not [a-zA-Z0-9_],
+  // or len.
+  size_t (*skip_identifier)(const char *str, size_t from, size_t len);
+
+  // Returns the first index in [from, len) that is not a blank
+  // (' ', '\t', '\n', '\v', '\f', '\r'), or len.
+  // Newlines skipped are added to *newlines.
+  size_t (*skip_blanks)(const char *str, size_t from, size_t len,
+                        uint32_t *newlines);
+
+  // Returns the first index in [from, len) of `ch` or a backslash, or len.
+  // Newlines before that index are added to *newlines.
+  size_t (*find_char_or_escape)(const char *str, size_t from, size_t len,
+                                char ch, uint32_t *newlines);
+
+  // Returns the index of the '*' of the first "*/" in [from, len), or len.
+  // Newlines before that index are added to *newlines.
+  size_t (*find_comment_end)(const char *str, size_t from, size_t len,
+                             uint32_t *newlines);
+
+  // Returns the number of '\n' in [from, to).
+  size_t (*count_newlines)(const char *str, size_t from, size_t to);
+};
+
+// kernels in use, selected at startup.
+extern const Kernels *kernels;
+
+// Returns the best instruction set supported by the cpu.
+auto DetectIsa() -> Isa;
+
+// Returns the instruction set of the kernels in use.
+auto GetIsa() -> Isa;
+
+// Switch to the kernels of `isa`, or the best supported one below it.
+// Returns the instruction set actually selected.
+// Not thread-safe, call it before tokenizing.
+auto SetIsa(Isa isa) -> Isa;
+
+inline auto SkipIdentifier(const char *str, size_t from, size_t len) -> size_t {
+  return kernels->skip_identifier(str, from, len);
+}
+
+inline auto SkipBlanks(const char *str, size_t from, size_t len,
+                       uint32_t *newlines) -> size_t {
+  return kernels->skip_blanks(str, from, len, newlines);
+}
+
+inline auto FindCharOrEscape(const char *str, size_t from, size_t len,
+                             char ch, uint32_t *newlines) -> size_t {
+  return kernels->find_char_or_escape(str, from, len, ch, newlines);
+}
+
+inline auto FindCommentEnd(const char *str, size_t from, size_t len,
+                           uint32_t *newlines) -> size_t {
+  return kernels->find_comment_end(str, from, len, newlines);
+}
+
+inline auto CountNewlines(const char *str, size_t from, size_t to) -> size_t {
+  return kernels->count_newlines(str, from, to);
+}
+
+} // namespace Scan
+} // namespace Lex
+
+#endif // __SCAN_H__
@@ -0,0 +1,213 @@
+#include "tokfile.h"
+#include "utils.h"
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Lex {
+
+static const char token_file_magic[4] = {'T', 'L', 'X', 'T'};
+
+static auto EndsWith(const std::string &str, const char *suffix) -> bool {
+  const size_t len = strlen(suffix);
+  return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+static auto PutVarint(std::string &out, uint64_t val) -> void {
+  while (val >= 0x80) {
+    out.push_back(static_cast<char>((val & 0x7f) | 0x80));
+    val >>= 7;
+  }
+  out.push_back(static_cast<char>(val));
+}
+
+// Signed deltas as varints: 0, -1, 1, -2, ... map to 0, 1, 2, 3, ...
+static inline auto ZigZag(int64_t val) -> uint64_t {
+  return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+static inline auto UnZigZag(uint64_t val) -> int64_t {
+  return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+// Returns false if the varint runs past `end`.
+static inline auto GetVarint(const uint8_t *data, size_t end, size_t *pos,
+                             uint64_t *val) -> bool {
+  uint64_t ret = 0;
+  for (unsigned shift = 0; *pos < end && shift < 64; shift += 7) {
+    const uint8_t byte = data[(*pos)++];
+    ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *val = ret;
+      return true;
+    }
+  }
+  return false;
+}
+
+TokenWriter::TokenWriter(const std::string &path)
+  : fout_(fopen(path.c_str(), "wb")), csv_(EndsWith(path, ".csv")) {
+  if (this->fout_ == nullptr) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  if (!this->csv_) {
+    // the header is written again by Finish().
+    TokenFileHeader header = {};
+    fwrite(&header, sizeof(header), 1, this->fout_);
+  }
+}
+
+TokenWriter::~TokenWriter() {
+  if (this->fout_ != nullptr) {
+    try {
+      this->Finish();
+    } catch (const std::runtime_error &) {
+    }
+  }
+}
+
+auto TokenWriter::Write(const Token &token) -> void {
+  assert(this->fout_ != nullptr);
+  if (this->csv_) {
+    fprintf(this->fout_, "%s,%u,%s\n", EncodeString(token.Text()).c_str(),
+            token.line, GetNameOfLabel(token.label));
+    return;
+  }
+
+  fwrite(token.src + token.offset, 1, token.length, this->fout_);
+  this->records_.push_back(static_cast<char>(token.label));
+  PutVarint(this->records_, ZigZag(static_cast<int64_t>(token.line) - this->line_));
+  PutVarint(this->records_, token.length);
+  this->line_ = token.line;
+  this->blob_size_ += token.length;
+  this->num_tokens_ ++;
+}
+
+auto TokenWriter::Finish() -> void {
+  assert(this->fout_ != nullptr);
+  FILE *fout = this->fout_;
+  this->fout_ = nullptr;
+
+  if (!this->csv_) {
+    fwrite(this->records_.data(), 1, this->records_.size(), fout);
+
+    TokenFileHeader header;
+    memcpy(header.magic, token_file_magic, sizeof(header.magic));
+    header.version = token_file_version;
+    header.num_tokens = this->num_tokens_;
+    header.blob_size = this->blob_size_;
+    header.records_size = this->records_.size();
+    if (fseek(fout, 0, SEEK_SET) == 0) {
+      fwrite(&header, sizeof(header), 1, fout);
+    }
+  }
+
+  const bool failed = ferror(fout);
+  if (fclose(fout) != 0 || failed) {
+    throw std::runtime_error("Failed to write token file");
+  }
+}
+
+auto WriteTokenFile(const std::string &path, const std::vector<Token> &tokens) -> void {
+  TokenWriter writer(path);
+  for (const auto &token : tokens) {
+    writer.Write(token);
+  }
+  writer.Finish();
+}
+
+TokenFile::TokenFile(const std::string &path) : data_(nullptr), size_(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(TokenFileHeader)) {
+    close(fd);
+    throw std::runtime_error("Not a token file: " + path);
+  }
+  this->size_ = st.st_size;
+  void *data = mmap(nullptr, this->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Failed to map " + path);
+  }
+  this->data_ = static_cast<const char *>(data);
+
+  memcpy(&this->header_, this->data_, sizeof(this->header_));
+  const auto &header = this->header_;
+  const size_t body = this->size_ - sizeof(header);
+  if (memcmp(header.magic, token_file_magic, sizeof(header.magic)) != 0 ||
+      header.version != token_file_version ||
+      header.blob_size > body || header.records_size != body - header.blob_size ||
+      header.blob_size > UINT32_MAX ||
+      // a record is a label and two varints, at least 3 bytes.
+      header.num_tokens > header.records_size / 3) {
+    munmap(const_cast<char *>(this->data_), this->size_);
+    throw std::runtime_error("Not a token file: " + path);
+  }
+  this->blob_ = this->data_ + sizeof(header);
+  this->records_ = reinterpret_cast<const uint8_t *>(this->blob_ + header.blob_size);
+}
+
+TokenFile::~TokenFile() {
+  munmap(const_cast<char *>(this->data_), this->size_);
+}
+
+TokenFile::iterator::iterator(const TokenFile *file, size_t index)
+  : file_(file), pos_(0), index_(index) {
+  if (file != nullptr && index < file->Size()) {
+    // tokens are decoded from the start.
+    assert(index == 0);
+    this->token_ = Token(file->blob_, 0, 0, TokenLabel::TNULL, 0);
+    this->Decode();
+  }
+}
+
+auto TokenFile::iterator::operator++() -> iterator & {
+  this->index_ ++;
+  if (this->index_ < this->file_->Size()) {
+    this->Decode();
+  }
+  return *this;
+}
+
+auto TokenFile::iterator::Decode() -> void {
+  const size_t end = this->file_->header_.records_size;
+  const uint8_t *records = this->file_->records_;
+  uint64_t delta, length;
+  if (this->pos_ >= end ||
+      records[this->pos_] > static_cast<uint8_t>(TokenLabel::TEXTERN)) {
+    throw std::runtime_error("Corrupted token file");
+  }
+  const auto label = static_cast<TokenLabel>(records[this->pos_++]);
+  if (!GetVarint(records, end, &this->pos_, &delta) ||
+      !GetVarint(records, end, &this->pos_, &length)) {
+    throw std::runtime_error("Corrupted token file");
+  }
+
+  const uint64_t offset = this->token_.offset + this->token_.length;
+  const int64_t line = this->token_.line + UnZigZag(delta);
+  if (length > this->file_->header_.blob_size - offset || line < 0 || line > UINT32_MAX) {
+    throw std::runtime_error("Corrupted token file");
+  }
+  this->token_ = Token(this->file_->blob_, offset, length, label, line);
+}
+
+auto TokenFile::Load() const -> std::vector<Token> {
+  std::vector<Token> tokens;
+  tokens.reserve(this->Size());
+  AtomCache atoms;
+  for (const auto &token : *this) {
+    tokens.push_back(token);
+    if (token.label == TokenLabel::TALPHA) {
+      tokens.back().atom = atoms.Intern(token.Text());
+    }
+  }
+  return tokens;
+}
+
+} // namespace Lex
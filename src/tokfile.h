@@ -0,0 +1,119 @@
+#ifndef __TOKFILE_H__
+#define __TOKFILE_H__
+
+// Token files: the output of the tokenizer, saved for later jobs.
+//
+// A binary token file is laid out as
+//   header | blob | records
+// where the blob holds the text of all the tokens back to back, and each
+// record is the label (1 byte), then the line and the length of a token as
+// LEB128 varints. The line is stored as the delta from the previous token,
+// zigzag-encoded: lines go back in preprocessed or multi-file streams.
+// The offset of a token in the blob is the sum of the previous lengths.
+// The file is read through mmap, and its tokens point into the mapping.
+// Integers are in host byte order.
+
+#include "lex.h"
+#include "intern.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace Lex {
+
+struct TokenFileHeader {
+  char magic[4];        // "TLXT"
+  uint32_t version;
+  uint64_t num_tokens;
+  uint64_t blob_size;   // bytes of text
+  uint64_t records_size;
+};
+
+constexpr uint32_t token_file_version = 2;
+
+// Writes tokens to a file, either as a binary token file, or as text
+// (one "text,line,label" per line) if the path ends with ".csv".
+// Tokens are streamed: only their records are kept until Finish().
+class TokenWriter {
+ public:
+  explicit TokenWriter(const std::string &path);
+  ~TokenWriter();
+
+  // disallow copy
+  TokenWriter(const TokenWriter &) = delete;
+  TokenWriter &operator=(const TokenWriter &) = delete;
+
+  auto Write(const Token &token) -> void;
+
+  // Write the rest of the file and close it. Called by the destructor
+  // otherwise, which cannot report errors.
+  auto Finish() -> void;
+
+ private:
+  FILE *fout_;
+  bool csv_;
+  std::string records_;
+  uint64_t num_tokens_{0};
+  uint64_t blob_size_{0};
+  uint32_t line_{0};
+};
+
+// Write all `tokens` to `path`, see TokenWriter.
+auto WriteTokenFile(const std::string &path, const std::vector<Token> &tokens) -> void;
+
+// A memory-mapped binary token file.
+// Its tokens point into the mapping, so keep it alive while they are used.
+class TokenFile {
+ public:
+  // @throw std::runtime_error if the file cannot be read or is not valid.
+  explicit TokenFile(const std::string &path);
+  ~TokenFile();
+
+  // disallow copy
+  TokenFile(const TokenFile &) = delete;
+  TokenFile &operator=(const TokenFile &) = delete;
+
+  auto Size() const -> size_t { return this->header_.num_tokens; }
+
+  // Decodes the tokens one by one, without interning identifiers.
+  class iterator {
+   public:
+    iterator(): file_(nullptr), pos_(0), index_(0) {}
+    iterator(const TokenFile *file, size_t index);
+
+    auto operator*() const -> const Token & { return this->token_; }
+    auto operator->() const -> const Token * { return &this->token_; }
+
+    auto operator++() -> iterator &;
+
+    auto operator==(const iterator &other) const -> bool { return this->index_ == other.index_; }
+    auto operator!=(const iterator &other) const -> bool { return this->index_ != other.index_; }
+
+   private:
+    auto Decode() -> void;
+
+    const TokenFile *file_;
+    size_t pos_;   // next record
+    size_t index_; // index of token_
+    Token token_;
+  };
+
+  auto begin() const -> iterator { return iterator(this, 0); }
+  auto end() const -> iterator { return iterator(nullptr, this->Size()); }
+
+  // Returns all the tokens, with identifiers interned.
+  auto Load() const -> std::vector<Token>;
+
+ private:
+  const char *data_;
+  size_t size_;
+  TokenFileHeader header_;
+  const char *blob_;
+  const uint8_t *records_;
+};
+
+} // namespace Lex
+
+#endif // __TOKFILE_H__
@@ -0,0 +1,99 @@
+#include "treehash.h"
+#include "utils.h"
+#include "visit.h"
+#include <cassert>
+#include <string_view>
+
+namespace Parser {
+
+static auto HashOfWords(const std::vector<uint64_t> &words, size_t begin) -> uint64_t {
+  const auto *data = reinterpret_cast<const char *>(words.data() + begin);
+  return Hash64(std::string_view(data, (words.size() - begin) * sizeof(uint64_t)));
+}
+
+// Tokens whose label does not tell their text.
+static auto HasOwnText(Lex::TokenLabel label) -> bool {
+  switch (label) {
+  case (Lex::TokenLabel::TALPHA):
+  case (Lex::TokenLabel::TDIGIT):
+  case (Lex::TokenLabel::TQUOTE):
+  case (Lex::TokenLabel::TDOUBLEQUOTE):
+  case (Lex::TokenLabel::TOPERATOR): {
+    return true;
+  }
+  default: {
+    return false;
+  }
+  }
+}
+
+auto TreeHasher::HashOfIdentifier(Lex::Atom atom) -> uint64_t {
+  if (atom == this->self_) {
+    // neither a hash of a text nor a number from 1.
+    return 0;
+  }
+  if (this->mode_ == IdentifierMode::INORMALIZED) {
+    // numbered from 1, in order of appearance.
+    return this->numbers_.emplace(atom, this->numbers_.size() + 1).first->second;
+  }
+  auto it = this->identifiers_.find(atom);
+  if (it == this->identifiers_.end()) {
+    it = this->identifiers_.emplace(atom, Hash64(Lex::AtomText(atom))).first;
+  }
+  return it->second;
+}
+
+// Each token is its label, followed by a hash of its text if the label
+// does not tell it.
+auto TreeHasher::HashOfInstruction(const Instruction &instr) -> uint64_t {
+  this->scratch_.clear();
+  for (const auto &token : instr.tokens) {
+    this->scratch_.push_back(static_cast<uint64_t>(token.label));
+    if (token.atom != Lex::null_atom) {
+      this->scratch_.push_back(this->HashOfIdentifier(token.atom));
+    } else if (HasOwnText(token.label)) {
+      this->scratch_.push_back(Hash64(token.Text()));
+    }
+  }
+  return HashOfWords(this->scratch_, 0);
+}
+
+void TreeHasher::Enter(BasicBlock *block, size_t depth) {
+  if (depth == 0) {
+    // a new tree.
+    this->numbers_.clear();
+    this->words_.clear();
+    this->starts_.clear();
+    if (block->GetType() == BlockType::BFUNCTION) {
+      const auto fns = block->GetInstrAsRef().GetFuncCalls();
+      this->self_ = fns.empty() ? Lex::null_atom : fns[0];
+    }
+  }
+  this->starts_.push_back(this->words_.size());
+  this->words_.push_back(static_cast<uint64_t>(block->GetType()) |
+                         static_cast<uint64_t>(block->IsBracketed()) << 8);
+  this->words_.push_back(this->HashOfInstruction(block->GetInstrAsRef()));
+}
+
+void TreeHasher::Leave(BasicBlock *block, size_t depth) {
+  const size_t start = this->starts_.back();
+  this->starts_.pop_back();
+  const uint64_t hash = HashOfWords(this->words_, start);
+  block->SetHash(hash);
+  // a word of the parent.
+  this->words_.resize(start);
+  this->words_.push_back(hash);
+  if (depth == 0) {
+    assert(this->starts_.empty());
+    this->hash_ = hash;
+    this->self_ = Lex::null_atom;
+  }
+}
+
+auto HashBlockTree(BasicBlock *root, IdentifierMode mode) -> uint64_t {
+  TreeHasher hasher(mode);
+  VisitBlocks(root, hasher);
+  return hasher.GetHash();
+}
+
+} // namespace Parser
@@ -0,0 +1,71 @@
+#ifndef __TREEHASH_H__
+#define __TREEHASH_H__
+
+// Structural hashes of block trees, to find identical code.
+// The hash of a block is a Merkle hash: it covers the type of the block,
+// its bracket, the labels of its tokens, and the hashes of its children in
+// order. Equal trees have equal hashes, whatever their formatting.
+//
+// Identifiers are covered by their text, or with IdentifierMode::INORMALIZED
+// by the order in which they first appear in the tree that is hashed, so
+// that trees which differ by a consistent renaming have the same hash.
+// The text of numbers, characters and strings is always covered.
+//
+// The name of a function whose tree is hashed is left out, in its head and
+// in calls to itself, so that copies of a function under other names have
+// the same hash.
+
+#include "lex.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace Parser {
+
+enum class IdentifierMode {
+  IEXACT = 0,
+  INORMALIZED,
+};
+
+// A visitor (see src/visit.h) which sets the hash of each block when it
+// leaves it. It can be reused for several trees, and run with other
+// visitors in one walk.
+class TreeHasher {
+ public:
+  explicit TreeHasher(IdentifierMode mode = IdentifierMode::IEXACT): mode_(mode) {}
+
+  void Enter(BasicBlock *block, size_t depth);
+  void Leave(BasicBlock *block, size_t depth);
+
+  // Returns the hash of the root of the last tree walked.
+  auto GetHash() const -> uint64_t { return this->hash_; }
+
+ private:
+  auto HashOfInstruction(const Instruction &instr) -> uint64_t;
+  auto HashOfIdentifier(Lex::Atom atom) -> uint64_t;
+
+  IdentifierMode mode_;
+  uint64_t hash_{0};
+  // the name of the function whose tree is hashed, if it is one.
+  Lex::Atom self_{Lex::null_atom};
+  // hashes of the text of identifiers, kept from tree to tree.
+  std::unordered_map<Lex::Atom, uint64_t> identifiers_;
+  // with INORMALIZED, the order of the identifiers in the tree.
+  std::unordered_map<Lex::Atom, uint64_t> numbers_;
+  // the words hashed for the open blocks: a header, the hash of the
+  // instruction, then the hashes of the children left so far.
+  std::vector<uint64_t> words_;
+  std::vector<size_t> starts_;
+  std::vector<uint64_t> scratch_;
+};
+
+// Sets the hash of every block of the tree of `root`, and returns the hash
+// of `root`.
+auto HashBlockTree(BasicBlock *root, IdentifierMode mode = IdentifierMode::IEXACT)
+  -> uint64_t;
+
+} // namespace Parser
+
+#endif // __TREEHASH_H__
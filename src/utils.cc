@@ -3,8 +3,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-auto EncodeString(const std::string &str) -> std::string {
+auto EncodeString(std::string_view str) -> std::string {
     std::ostringstream ss;
     ss << "\"";
     for (const auto &ch : str) {
@@ -60,28 +64,70 @@ auto EncodeString(const std::string &str) -> std::string {
     return ss.str();
 }
 
-auto ReadAll(const char *filename) -> std::string {
-    std::ostringstream ss;
-    static char buf[512];
-
+FileSource::FileSource(const char *filename)
+  : data_(nullptr), size_(0), mapped_(false) {
     // if file name is -, read from stdin.
-    int fd = strcmp("-", filename) ? open(filename, O_RDONLY) : 0;
+    const bool is_stdin = strcmp("-", filename) == 0;
+    int fd = is_stdin ? 0 : open(filename, O_RDONLY);
     if (fd < 0) {
         throw std::runtime_error("Failed to open file");
     }
 
-    long nread = read(fd, buf, sizeof(buf));
-    while (nread > 0) {
-        ss.write(buf, nread);
-        nread = read(fd, buf, sizeof(buf));
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            this->data_ = static_cast<const char *>(data);
+            this->size_ = st.st_size;
+            this->mapped_ = true;
+            if (!is_stdin) {
+                close(fd);
+            }
+            return;
+        }
     }
 
-    close(fd);
-    return ss.str();
+    // not a regular file, read it in blocks.
+    const size_t block_size = 1024 * 1024;
+    size_t len = 0;
+    while (true) {
+        this->buffer_.resize(len + block_size);
+        long nread = read(fd, &this->buffer_[len], block_size);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0) {
+            if (!is_stdin) {
+                close(fd);
+            }
+            throw std::runtime_error("Failed to read file");
+        }
+        if (nread == 0) {
+            break;
+        }
+        len += nread;
+    }
+    this->buffer_.resize(len);
+    this->data_ = this->buffer_.data();
+    this->size_ = len;
+    if (!is_stdin) {
+        close(fd);
+    }
+}
+
+FileSource::~FileSource() {
+    if (this->mapped_) {
+        munmap(const_cast<char *>(this->data_), this->size_);
+    }
+}
+
+auto ReadAll(const char *filename) -> std::string {
+    return std::string(FileSource(filename).View());
 }
 
 
-auto Atoi(const std::string &str) -> long {
+auto Atoi(std::string_view str) -> long {
     long ret = 0;
     long base = 10;
     // FIXME: handle negative number
@@ -144,3 +190,87 @@ auto Atoi(const std::string &str) -> long {
 
     return ret;
 }
+
+// constants of XXH64.
+static constexpr uint64_t prime1 = 11400714785074694791ULL;
+static constexpr uint64_t prime2 = 14029467366897019727ULL;
+static constexpr uint64_t prime3 = 1609587929392839161ULL;
+static constexpr uint64_t prime4 = 9650029242287828579ULL;
+static constexpr uint64_t prime5 = 2870177450012600261ULL;
+
+static inline auto Rotl(uint64_t x, int r) -> uint64_t {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline auto Read64(const char *p) -> uint64_t {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline auto Read32(const char *p) -> uint32_t {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline auto Round(uint64_t acc, uint64_t input) -> uint64_t {
+    acc += input * prime2;
+    acc = Rotl(acc, 31);
+    return acc * prime1;
+}
+
+static inline auto MergeRound(uint64_t acc, uint64_t val) -> uint64_t {
+    acc ^= Round(0, val);
+    return acc * prime1 + prime4;
+}
+
+auto Hash64(std::string_view data, uint64_t seed) -> uint64_t {
+    const char *p = data.data();
+    const char *end = p + data.size();
+    uint64_t h;
+
+    if (data.size() >= 32) {
+        // four lanes of 8 bytes.
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+        }
+        h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+        h = MergeRound(h, v1);
+        h = MergeRound(h, v2);
+        h = MergeRound(h, v3);
+        h = MergeRound(h, v4);
+    } else {
+        h = seed + prime5;
+    }
+    h += data.size();
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(Read32(p)) * prime1;
+        h = Rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= static_cast<uint8_t>(*p) * prime5;
+        h = Rotl(h, 11) * prime1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
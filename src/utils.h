@@ -1,14 +1,43 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 typedef int (*TestFunc)(void);
 
 // convert inprintable characters to hexadecimal,
 // '\n' to '\\n', etc.
-auto EncodeString(const std::string &str) -> std::string;
+auto EncodeString(std::string_view str) -> std::string;
+
+// Read-only contents of a file.
+// Regular files are mapped into memory, so that no copy is made. Other
+// files (pipes, or stdin if the file name is -) are read in large blocks.
+class FileSource {
+ public:
+  // @throw std::runtime_error if the file cannot be read.
+  explicit FileSource(const char *filename);
+  ~FileSource();
+
+  // disallow copy
+  FileSource(const FileSource &) = delete;
+  FileSource &operator=(const FileSource &) = delete;
+
+  auto View() const -> std::string_view { return std::string_view(data_, size_); }
+  auto IsMapped() const -> bool { return mapped_; }
+
+ private:
+  const char *data_;
+  size_t size_;
+  bool mapped_;
+  // contents of files that cannot be mapped
+  std::string buffer_;
+};
+
+// Returns the XXH64 hash of `data`.
+auto Hash64(std::string_view data, uint64_t seed = 0) -> uint64_t;
 
 // read all the contents of a file
 auto ReadAll(const char *filename) -> std::string;
@@ -16,7 +45,7 @@ auto ReadAll(const char *filename) -> std::string;
 /* will only handle hexidemical(0x) numbers and decimal numbers
  * @throw std::invalid_argument if the string is not a valid number
  */
-auto Atoi(const std::string &str) -> long;
+auto Atoi(std::string_view str) -> long;
 
 // Remove the first ocurrence of `val` in `vec`.
 template <typename T>
@@ -0,0 +1,285 @@
+#ifndef __VISIT_H__
+#define __VISIT_H__
+
+// Walks of the block tree with visitors.
+//
+// A visitor is a class with any of these members, which are looked up when
+// the walk is compiled. A member a visitor does not have costs nothing.
+//   Enter(Block *block, size_t depth)       before the children of a block
+//   Leave(Block *block, size_t depth)       after them
+//   EnterScope(Block *block, size_t depth)  before the first child
+//   LeaveScope(Block *block, size_t depth)  after the last child
+// Enter and Leave may also take the type of the block first, e.g.
+//   Enter(BlockTag<BlockType::BFOR>, Block *block, size_t depth)
+// which is called for the blocks of that type instead of the plain one.
+// A template over BlockTag<T> catches the other types.
+//
+// Enter may return a VisitAction: VSKIP to not visit the children (Leave
+// is still called), VSTOP to not be called again in this walk.
+//
+// Several visitors are run in one walk, in the order they are given:
+//   VisitBlocks(root, calls, vars);
+// Each of them is called as it would be if it were run alone.
+// The root is at depth 0. The walk uses a stack on the heap, so the depth
+// of the tree is not limited.
+
+#include "lex.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Parser {
+
+template <BlockType T>
+struct BlockTag {
+  static constexpr BlockType type = T;
+};
+
+enum class VisitAction {
+  VCONTINUE = 0,
+  VSKIP,
+  VSTOP,
+};
+
+namespace VisitDetail {
+
+constexpr size_t num_block_types = static_cast<size_t>(BlockType::BENUM) + 1;
+
+template <typename Void, template <typename...> class Op, typename... Args>
+struct Detect : std::false_type {};
+template <template <typename...> class Op, typename... Args>
+struct Detect<std::void_t<Op<Args...>>, Op, Args...> : std::true_type {};
+
+// true if Op<Args...> is a valid type, e.g. a call which compiles.
+template <template <typename...> class Op, typename... Args>
+constexpr bool is_detected = Detect<void, Op, Args...>::value;
+
+template <typename V, typename Block>
+using EnterCall = decltype(std::declval<V &>().Enter(std::declval<Block *>(), size_t()));
+template <typename V, typename Block, typename Tag>
+using TaggedEnterCall =
+  decltype(std::declval<V &>().Enter(Tag(), std::declval<Block *>(), size_t()));
+template <typename V, typename Block>
+using LeaveCall = decltype(std::declval<V &>().Leave(std::declval<Block *>(), size_t()));
+template <typename V, typename Block, typename Tag>
+using TaggedLeaveCall =
+  decltype(std::declval<V &>().Leave(Tag(), std::declval<Block *>(), size_t()));
+template <typename V, typename Block>
+using EnterScopeCall =
+  decltype(std::declval<V &>().EnterScope(std::declval<Block *>(), size_t()));
+template <typename V, typename Block>
+using LeaveScopeCall =
+  decltype(std::declval<V &>().LeaveScope(std::declval<Block *>(), size_t()));
+
+template <typename V, typename Block, size_t... I>
+constexpr auto AnyTaggedEnter(std::index_sequence<I...>) -> bool {
+  return (is_detected<TaggedEnterCall, V, Block, BlockTag<static_cast<BlockType>(I)>> || ...);
+}
+template <typename V, typename Block, size_t... I>
+constexpr auto AnyTaggedLeave(std::index_sequence<I...>) -> bool {
+  return (is_detected<TaggedLeaveCall, V, Block, BlockTag<static_cast<BlockType>(I)>> || ...);
+}
+
+template <typename V, typename Block>
+constexpr bool has_tagged_enter =
+  AnyTaggedEnter<V, Block>(std::make_index_sequence<num_block_types>());
+template <typename V, typename Block>
+constexpr bool has_tagged_leave =
+  AnyTaggedLeave<V, Block>(std::make_index_sequence<num_block_types>());
+
+// whether the walk must come back to a block after its children.
+template <typename V, typename Block>
+constexpr bool needs_leave = is_detected<LeaveCall, V, Block> ||
+  has_tagged_leave<V, Block> || is_detected<LeaveScopeCall, V, Block>;
+
+// Call `fn`, which returns a VisitAction or nothing.
+template <typename Fn>
+inline auto ActionOf(Fn &&fn) -> VisitAction {
+  if constexpr (std::is_void_v<decltype(fn())>) {
+    fn();
+    return VisitAction::VCONTINUE;
+  } else {
+    return fn();
+  }
+}
+
+template <BlockType T, typename V, typename Block>
+inline auto EnterAs(V &visitor, Block *block, size_t depth) -> VisitAction {
+  if constexpr (is_detected<TaggedEnterCall, V, Block, BlockTag<T>>) {
+    return ActionOf([&]() { return visitor.Enter(BlockTag<T>(), block, depth); });
+  } else if constexpr (is_detected<EnterCall, V, Block>) {
+    return ActionOf([&]() { return visitor.Enter(block, depth); });
+  } else {
+    return VisitAction::VCONTINUE;
+  }
+}
+
+template <BlockType T, typename V, typename Block>
+inline auto LeaveAs(V &visitor, Block *block, size_t depth) -> void {
+  if constexpr (is_detected<TaggedLeaveCall, V, Block, BlockTag<T>>) {
+    visitor.Leave(BlockTag<T>(), block, depth);
+  } else if constexpr (is_detected<LeaveCall, V, Block>) {
+    visitor.Leave(block, depth);
+  }
+}
+
+// One comparison per type, which compilers turn into a jump table.
+template <typename V, typename Block, size_t... I>
+inline auto EnterByType(V &visitor, Block *block, size_t depth, std::index_sequence<I...>)
+  -> VisitAction {
+  const auto type = static_cast<size_t>(block->GetType());
+  VisitAction action = VisitAction::VCONTINUE;
+  (void)((type == I &&
+          (action = EnterAs<static_cast<BlockType>(I)>(visitor, block, depth), true)) || ...);
+  return action;
+}
+template <typename V, typename Block, size_t... I>
+inline auto LeaveByType(V &visitor, Block *block, size_t depth, std::index_sequence<I...>)
+  -> void {
+  const auto type = static_cast<size_t>(block->GetType());
+  (void)((type == I && (LeaveAs<static_cast<BlockType>(I)>(visitor, block, depth), true)) || ...);
+}
+
+template <typename V, typename Block>
+inline auto Enter(V &visitor, Block *block, size_t depth) -> VisitAction {
+  if constexpr (has_tagged_enter<V, Block>) {
+    return EnterByType(visitor, block, depth, std::make_index_sequence<num_block_types>());
+  } else {
+    // the type is not looked at.
+    return EnterAs<BlockType::BCOMMON>(visitor, block, depth);
+  }
+}
+
+template <typename V, typename Block>
+inline auto Leave(V &visitor, Block *block, size_t depth) -> void {
+  if constexpr (has_tagged_leave<V, Block>) {
+    LeaveByType(visitor, block, depth, std::make_index_sequence<num_block_types>());
+  } else {
+    LeaveAs<BlockType::BCOMMON>(visitor, block, depth);
+  }
+}
+
+template <typename V, typename Block>
+inline auto EnterScope(V &visitor, Block *block, size_t depth) -> void {
+  if constexpr (is_detected<EnterScopeCall, V, Block>) {
+    visitor.EnterScope(block, depth);
+  }
+}
+
+template <typename V, typename Block>
+inline auto LeaveScope(V &visitor, Block *block, size_t depth) -> void {
+  if constexpr (is_detected<LeaveScopeCall, V, Block>) {
+    visitor.LeaveScope(block, depth);
+  }
+}
+
+template <typename Tuple, typename Fn, size_t... I>
+inline auto ForEach(Tuple &visitors, Fn &&fn, std::index_sequence<I...>) -> void {
+  (fn(std::get<I>(visitors), I), ...);
+}
+
+} // namespace VisitDetail
+
+// Walk the tree of `root` once, calling each of `visitors`.
+// `Block` is BasicBlock for visitors which change the blocks, and const
+// BasicBlock otherwise. Children must not be added or removed during the
+// walk. Returns false if all the visitors stopped before the end.
+template <typename Block, typename... Visitors>
+auto VisitBlocks(Block *root, Visitors &...visitors) -> bool {
+  static_assert(sizeof...(Visitors) > 0, "no visitor");
+  using namespace VisitDetail;
+  constexpr size_t num_visitors = sizeof...(Visitors);
+  constexpr auto indexes = std::make_index_sequence<num_visitors>();
+  constexpr bool any_leave = (needs_leave<Visitors, Block> || ...);
+
+  // the state of each visitor: active, stopped, or the depth of the block
+  // whose children it skips. It is active again at the next block which
+  // is not deeper.
+  constexpr size_t active = SIZE_MAX;
+  constexpr size_t stopped = SIZE_MAX - 1;
+  std::array<size_t, num_visitors> states;
+  states.fill(active);
+  size_t num_stopped = 0;
+  std::tuple<Visitors &...> all(visitors...);
+
+  struct Frame {
+    Block *block;
+    size_t depth;
+    bool leaving; // the children were visited
+  };
+  std::vector<Frame> stack = {{root, 0, false}};
+  while (!stack.empty()) {
+    const Frame frame = stack.back();
+    stack.pop_back();
+    Block *block = frame.block;
+    const size_t depth = frame.depth;
+
+    if constexpr (any_leave) {
+      if (frame.leaving) {
+        ForEach(all, [&](auto &visitor, size_t i) {
+          const size_t state = states[i];
+          if (state == stopped || state < depth) {
+            // stopped, or skipping an ancestor.
+            return;
+          }
+          if (state > depth && block->HasChildren()) {
+            LeaveScope(visitor, block, depth);
+          }
+          Leave(visitor, block, depth);
+        }, indexes);
+        continue;
+      }
+    }
+
+    bool descend = false;
+    ForEach(all, [&](auto &visitor, size_t i) {
+      size_t &state = states[i];
+      if (state == stopped || (state != active && state < depth)) {
+        return;
+      }
+      switch (Enter(visitor, block, depth)) {
+      case (VisitAction::VCONTINUE): {
+        state = active;
+        descend = true;
+        break;
+      }
+      case (VisitAction::VSKIP): {
+        state = depth;
+        break;
+      }
+      case (VisitAction::VSTOP): {
+        state = stopped;
+        num_stopped++;
+        break;
+      }
+      }
+    }, indexes);
+    if (num_stopped == num_visitors) {
+      return false;
+    }
+
+    if constexpr (any_leave) {
+      stack.push_back({block, depth, true});
+    }
+    if (descend && block->HasChildren()) {
+      ForEach(all, [&](auto &visitor, size_t i) {
+        if (states[i] == active) {
+          EnterScope(visitor, block, depth);
+        }
+      }, indexes);
+      for (size_t i = block->GetNumChildren(); i > 0; i--) {
+        stack.push_back({block->GetChild(i - 1), depth + 1, false});
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace Parser
+
+#endif // __VISIT_H__
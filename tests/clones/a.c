@@ -0,0 +1,19 @@
+// Functions with copies in b.c.
+int sum(int *a, int n) {
+  int s;
+  int i;
+  s = 0;
+  i = 0;
+  while (i < n) {
+    s = s + a[i];
+    i = i + 1;
+  }
+  return s;
+}
+
+int fact(int n) {
+  if (n < 2) {
+    return 1;
+  }
+  return n * fact(n - 1);
+}
@@ -0,0 +1,53 @@
+// Copies of the functions of a.c, and near-misses.
+
+// an exact copy, formatted and commented differently: grouped with sum.
+int sum(int *a, int n)
+{
+  int s; int i;
+  s = 0; /* start */
+  i = 0;
+  while (i < n) { s = s + a[i]; i = i + 1; }
+  return s;
+}
+
+// sum with its variables renamed: grouped with sum by clones -n only.
+int total(int *values, int count) {
+  int acc;
+  int j;
+  acc = 0;
+  j = 0;
+  while (j < count) {
+    acc = acc + values[j];
+    j = j + 1;
+  }
+  return acc;
+}
+
+// fact under another name, calling itself: grouped with fact.
+int factorial(int n) {
+  if (n < 2) {
+    return 1;
+  }
+  return n * factorial(n - 1);
+}
+
+// a near-miss of sum, - instead of +: never grouped.
+int diff(int *a, int n) {
+  int s;
+  int i;
+  s = 0;
+  i = 0;
+  while (i < n) {
+    s = s - a[i];
+    i = i + 1;
+  }
+  return s;
+}
+
+// a near-miss of fact, which calls fact rather than itself: never grouped.
+int fact2(int n) {
+  if (n < 2) {
+    return 1;
+  }
+  return n * fact(n - 1);
+}
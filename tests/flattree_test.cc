@@ -0,0 +1,144 @@
+// Flatten the parse trees of files, and check the flat trees against walks
+// of the blocks: the pre-order, the links between nodes and the tokens.
+// Usage: flattree_test <files...>
+// Returns 0 if every flat tree matches its parse tree, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/parsecache.h>
+#include <src/visit.h>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace Parser {
+
+// the blocks in pre-order, with what the flat tree keeps of them.
+struct PreOrder {
+  std::vector<const BasicBlock *> blocks;
+  std::vector<size_t> depths;
+  std::vector<size_t> sizes;
+  std::vector<FlatTree::NodeId> parents;
+  std::vector<FlatTree::NodeId> open;
+
+  void Enter(const BasicBlock *block, size_t depth) {
+    this->parents.push_back(this->open.empty() ? FlatTree::npos : this->open.back());
+    this->open.push_back(this->blocks.size());
+    this->blocks.push_back(block);
+    this->depths.push_back(depth);
+    this->sizes.push_back(0);
+  }
+  void Leave(const BasicBlock *, size_t) {
+    const FlatTree::NodeId id = this->open.back();
+    this->open.pop_back();
+    this->sizes[id] = this->blocks.size() - id;
+  }
+};
+
+static auto SameTokens(std::pair<const Lex::Token *, const Lex::Token *> range,
+                       const Lex::TokenSpan &tokens) -> bool {
+  if (static_cast<size_t>(range.second - range.first) != tokens.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < tokens.size(); i++) {
+    const auto &a = range.first[i];
+    const auto &b = tokens[i];
+    if (a.Text() != b.Text() || a.label != b.label || a.line != b.line || a.atom != b.atom) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns an empty string if `flat` matches the tree of `root`, or what
+// differs.
+static auto CheckFlatTree(const FlatTree &flat, const BasicBlock *root) -> std::string {
+  PreOrder order;
+  VisitBlocks(root, order);
+  if (flat.Size() != order.blocks.size()) {
+    return "the number of nodes differs";
+  }
+  std::unordered_map<const BasicBlock *, FlatTree::NodeId> ids;
+  FlatTree::NodeId expected = 0;
+  for (const FlatTree::NodeId id : flat.Nodes()) {
+    if (id != expected++) {
+      return "the nodes are not in order";
+    }
+    ids[order.blocks[id]] = id;
+  }
+
+  for (FlatTree::NodeId id = 0; id < flat.Size(); id++) {
+    const BasicBlock *block = order.blocks[id];
+    const auto &instr = block->GetInstrAsRef();
+    const std::string node = "node " + std::to_string(id) + ": ";
+    if (flat.GetType(id) != block->GetType() || flat.IsBracketed(id) != block->IsBracketed()) {
+      return node + "the type differs";
+    }
+    if (flat.GetDepth(id) != order.depths[id] || flat.SubtreeSize(id) != order.sizes[id] ||
+        flat.GetParent(id) != order.parents[id]) {
+      return node + "the place in the tree differs";
+    }
+    if (!SameTokens(flat.GetTokens(id), instr.tokens) ||
+        flat.GetFuncCalls(id) != instr.GetFuncCalls() ||
+        flat.GetVarNames(id) != instr.GetVarNames()) {
+      return node + "the tokens differ";
+    }
+
+    const size_t num_children = block->GetNumChildren();
+    const FlatTree::NodeId first = num_children == 0 ? FlatTree::npos :
+      ids[block->GetChild(0)];
+    if (flat.FirstChild(id) != first) {
+      return node + "the first child differs";
+    }
+    size_t k = 0;
+    for (const FlatTree::NodeId child : flat.Children(id)) {
+      if (k >= num_children || child != ids[block->GetChild(k)]) {
+        return node + "the children differ";
+      }
+      const FlatTree::NodeId next = k + 1 < num_children ? ids[block->GetChild(k + 1)] :
+        FlatTree::npos;
+      if (flat.NextSibling(child) != next) {
+        return node + "the next sibling of a child differs";
+      }
+      k++;
+    }
+    if (k != num_children) {
+      return node + "the number of children differs";
+    }
+  }
+  if (flat.NextSibling(flat.Root()) != FlatTree::npos) {
+    return "the root has a sibling";
+  }
+  return "";
+}
+
+} // namespace Parser
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    try {
+      FileSource fobj(argv[i]);
+      auto parsed = Parser::ParseSource(fobj.View());
+      const Parser::FlatTree flat(parsed.tree.get());
+      const std::string error = Parser::CheckFlatTree(flat, parsed.tree.get());
+      if (!error.empty()) {
+        fprintf(stderr, "%s: %s\n", argv[i], error.c_str());
+        ok = false;
+      }
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", argv[i], e.what());
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("flattree_test: %d files: OK\n", argc - 1);
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Tokenize and parse a large input with several threads, and check the
+// results against serial runs. The input is made of the given files, over
+// and over, with comments and strings longer than a chunk between them, so
+// that chunks start inside them and have to be stitched.
+// Usage: parallel_test [-m megabytes] <files...>
+// Returns 0 if the threads give the serial results, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/utils.h>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+// the size of the chunks which are tokenized by different threads.
+static const size_t chunk_size = 256 * 1024;
+
+// The index of the first token which differs, or -1 if there is none.
+static auto FirstDifference(const std::vector<Lex::Token> &a,
+                            const std::vector<Lex::Token> &b) -> long {
+  for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+    if (a[i].src != b[i].src || a[i].offset != b[i].offset || a[i].length != b[i].length ||
+        a[i].label != b[i].label || a[i].line != b[i].line || a[i].atom != b[i].atom) {
+      return i;
+    }
+  }
+  return a.size() == b.size() ? -1 : std::min(a.size(), b.size());
+}
+
+// Returns an empty string if the trees are the same, or what differs.
+static auto CompareTrees(const Parser::FlatTree &a, const Parser::FlatTree &b)
+  -> std::string {
+  if (a.Size() != b.Size()) {
+    return "the number of nodes differs";
+  }
+  for (Parser::FlatTree::NodeId id = 0; id < a.Size(); id++) {
+    const std::string node = "node " + std::to_string(id) + ": ";
+    if (a.GetType(id) != b.GetType(id) || a.IsBracketed(id) != b.IsBracketed(id)) {
+      return node + "the type differs";
+    }
+    if (a.GetDepth(id) != b.GetDepth(id) || a.SubtreeSize(id) != b.SubtreeSize(id)) {
+      return node + "the place in the tree differs";
+    }
+    const auto ta = a.GetTokens(id);
+    const auto tb = b.GetTokens(id);
+    if (ta.second - ta.first != tb.second - tb.first) {
+      return node + "the tokens differ";
+    }
+    for (auto p = ta.first, q = tb.first; p != ta.second; p++, q++) {
+      if (p->offset != q->offset || p->length != q->length || p->label != q->label ||
+          p->line != q->line) {
+        return node + "the tokens differ";
+      }
+    }
+  }
+  return "";
+}
+
+// `files` over and over, up to `size` bytes, with a block comment, a
+// spliced string and spliced line comments longer than a chunk. Small
+// functions between them give the parser enough tokens for its threads.
+static auto MakeInput(const std::vector<std::string> &files, size_t size) -> std::string {
+  std::string comment = "/*";
+  while (comment.size() < 2 * chunk_size) {
+    comment += " a comment line, with \"quotes\", 'c' and // in it\n";
+  }
+  comment += "*/\n";
+  std::string str = "char *s = \"";
+  while (str.size() < chunk_size + chunk_size / 2) {
+    str += "a string line /* not a comment */ \\\n";
+  }
+  str += "\";\n";
+  std::string line_comment;
+  while (line_comment.size() < chunk_size + chunk_size / 3) {
+    line_comment += "// a line comment which goes on \\\n";
+  }
+  line_comment += "\n";
+  std::string functions;
+  for (size_t i = 0; functions.size() < chunk_size; i++) {
+    const std::string n = std::to_string(i);
+    functions += "int f" + n + "(int a) {\n  while (a > " + n + ") { a = a - 1; }\n"
+      "  if (a) return g(a, " + n + "); else return 0;\n}\n";
+  }
+
+  const std::string *long_tokens[] = {&comment, &str, &line_comment};
+  std::string buf;
+  for (size_t k = 0; buf.size() < size; k++) {
+    switch (k % 4) {
+    case (0): {
+      for (size_t i = 0; i < 64; i++) {
+        buf += files[i % files.size()];
+      }
+      break;
+    }
+    case (1): buf += *long_tokens[k / 4 % 3]; break;
+    default: buf += functions; break;
+    }
+  }
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:")) != -1) {
+    switch (opt) {
+    case ('m'): {
+      megabytes = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-m megabytes] <files...>\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-m megabytes] <files...>\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> files;
+  for (int i = optind; i < argc; i++) {
+    files.emplace_back(FileSource(argv[i]).View());
+    // files may not end with a newline.
+    files.back() += "\n";
+  }
+  const std::string buf = MakeInput(files, megabytes << 20);
+
+  bool ok = true;
+  static const size_t counts[] = {2, 3, 5, 8, 13};
+  for (const bool ignore_null : {false, true}) {
+    const auto expected = Lex::CLangTokenize(buf, ignore_null);
+    for (const size_t nchunks : counts) {
+      const long diff = FirstDifference(Lex::CLangTokenize(buf, ignore_null, nchunks),
+                                        expected);
+      if (diff >= 0) {
+        fprintf(stderr, "%zu chunks%s: token %ld differs\n", nchunks,
+                ignore_null ? ", without null tokens" : "", diff);
+        ok = false;
+      }
+    }
+  }
+
+  const auto tokens = Lex::CLangTokenize(buf, true);
+  const auto serial = Parser::CLangParser(tokens);
+  const Parser::FlatTree expected(serial.get());
+  for (const size_t nthreads : counts) {
+    const auto parsed = Parser::CLangParser(tokens, nthreads);
+    const auto diff = CompareTrees(Parser::FlatTree(parsed.get()), expected);
+    if (!diff.empty()) {
+      fprintf(stderr, "%zu threads: %s\n", nthreads, diff.c_str());
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("parallel_test: %zu bytes, %zu tokens: OK\n", buf.size(), tokens.size());
+  return 0;
+}
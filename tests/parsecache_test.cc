@@ -0,0 +1,186 @@
+// Parse files through a parse cache in a new directory, and check that
+// entries are made on the first parse and loaded on the next, and that an
+// entry with a flipped byte is made again rather than loaded. Whatever
+// comes out of the cache must match a parse without it.
+// Usage: parsecache_test <files...>
+// Returns 0 if every file passes, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/parsecache.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace Parser {
+
+static auto SameTokens(const Lex::Token *a, const Lex::Token *b, size_t size) -> bool {
+  for (size_t i = 0; i < size; i++) {
+    if (a[i].offset != b[i].offset || a[i].length != b[i].length ||
+        a[i].label != b[i].label || a[i].line != b[i].line || a[i].atom != b[i].atom) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns an empty string if `tokens` and the tree of `root` match
+// `expected`, or what differs. The tree is not checked if `root` is null.
+static auto Compare(const std::vector<Lex::Token> &tokens, const BasicBlock *root,
+                    const ParsedSource &expected) -> std::string {
+  if (tokens.size() != expected.tokens.size() ||
+      !SameTokens(tokens.data(), expected.tokens.data(), expected.tokens.size())) {
+    return "the tokens differ";
+  }
+  if (root == nullptr) {
+    return "";
+  }
+
+  const FlatTree flat(root);
+  const FlatTree expected_flat(expected.tree.get());
+  if (flat.Size() != expected_flat.Size()) {
+    return "the number of nodes differs";
+  }
+  for (FlatTree::NodeId id = 0; id < flat.Size(); id++) {
+    const auto range = flat.GetTokens(id);
+    const auto expected_range = expected_flat.GetTokens(id);
+    const size_t size = range.second - range.first;
+    if (flat.GetType(id) != expected_flat.GetType(id) ||
+        flat.IsBracketed(id) != expected_flat.IsBracketed(id) ||
+        flat.SubtreeSize(id) != expected_flat.SubtreeSize(id) ||
+        size != static_cast<size_t>(expected_range.second - expected_range.first) ||
+        !SameTokens(range.first, expected_range.first, size)) {
+      return "node " + std::to_string(id) + " differs";
+    }
+  }
+  return "";
+}
+
+// Returns the path of the only entry in `dir`.
+static auto OnlyEntry(const std::string &dir) -> std::string {
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    throw std::runtime_error("Failed to open " + dir);
+  }
+  std::string path;
+  size_t num_entries = 0;
+  while (const struct dirent *ent = readdir(d)) {
+    if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+      path = dir + "/" + ent->d_name;
+      num_entries++;
+    }
+  }
+  closedir(d);
+  if (num_entries != 1) {
+    throw std::runtime_error(dir + " has " + std::to_string(num_entries) + " entries");
+  }
+  return path;
+}
+
+// Flips a byte in the middle of the sections after the header of `path`.
+static void FlipBodyByte(const std::string &path) {
+  FILE *f = fopen(path.c_str(), "r+b");
+  if (f == nullptr) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  const long header = sizeof(ParseCacheHeader);
+  if (size <= header) {
+    fclose(f);
+    throw std::runtime_error(path + " has no sections");
+  }
+  const long pos = header + (size - header) / 2;
+  fseek(f, pos, SEEK_SET);
+  const int c = fgetc(f);
+  fseek(f, pos, SEEK_SET);
+  fputc(c ^ 0x5a, f);
+  fclose(f);
+}
+
+// Runs the checks on `source` with a cache in the empty directory `dir`.
+// Returns an empty string if they pass, or the first that fails.
+static auto CheckCache(std::string_view source, const std::string &dir) -> std::string {
+  auto tokens = Lex::CLangTokenize(source, true);
+  auto tree = CLangParser(tokens);
+  const ParsedSource expected = {std::move(tokens), std::move(tree)};
+
+  ParseCache cache(dir);
+  size_t hits = 0;
+  size_t misses = 0;
+  // parses `source`, and checks the result and whether the cache was hit.
+  auto step = [&](const char *what, bool hit, bool with_tree) -> std::string {
+    std::string error;
+    if (with_tree) {
+      const auto parsed = cache.Parse(source);
+      error = Compare(parsed.tokens, parsed.tree.get(), expected);
+    } else {
+      error = Compare(cache.Tokenize(source), nullptr, expected);
+    }
+    (hit ? hits : misses)++;
+    if (cache.NumHits() != hits || cache.NumMisses() != misses) {
+      return std::string(what) + ": the entry was " + (hit ? "not loaded" : "loaded");
+    }
+    return error.empty() ? "" : std::string(what) + ": " + error;
+  };
+
+  std::string error;
+  if (!(error = step("cold parse", false, true)).empty() ||
+      !(error = step("warm parse", true, true)).empty()) {
+    return error;
+  }
+  const std::string entry = OnlyEntry(dir);
+  FlipBodyByte(entry);
+  if (!(error = step("parse of a corrupted entry", false, true)).empty() ||
+      !(error = step("parse of a rebuilt entry", true, true)).empty()) {
+    return error;
+  }
+  // an entry rebuilt by Tokenize has no tree, which the next parse adds.
+  FlipBodyByte(entry);
+  if (!(error = step("tokenize a corrupted entry", false, false)).empty() ||
+      !(error = step("parse of an entry without a tree", false, true)).empty() ||
+      !(error = step("parse of a completed entry", true, true)).empty()) {
+    return error;
+  }
+  unlink(OnlyEntry(dir).c_str());
+  return "";
+}
+
+} // namespace Parser
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    char dir[] = "/tmp/parsecache_test.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+      perror("mkdtemp");
+      return 1;
+    }
+    try {
+      FileSource fobj(argv[i]);
+      const std::string error = Parser::CheckCache(fobj.View(), dir);
+      if (!error.empty()) {
+        fprintf(stderr, "%s: %s\n", argv[i], error.c_str());
+        ok = false;
+      }
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", argv[i], e.what());
+      ok = false;
+    }
+    rmdir(dir);
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("parsecache_test: %d files: OK\n", argc - 1);
+  return 0;
+}
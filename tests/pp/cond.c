@@ -0,0 +1,20 @@
+// #if arithmetic wraps around instead of overflowing.
+#if (-9223372036854775807 - 1) / -1 == (-9223372036854775807 - 1)
+int div_wraps;
+#endif
+#if (-9223372036854775807 - 1) % -1 == 0
+int rem_wraps;
+#endif
+#if 9223372036854775807 + 1 < 0 && -9223372036854775807 - 2 > 0
+int add_wraps;
+#endif
+#if 4611686018427387904 * 2 < 0 && -(-9223372036854775807 - 1) < 0
+int mul_wraps;
+#endif
+// defined given by a macro; its operand is not expanded.
+#define Y 1
+#define HAS_Y defined(Y)
+#define HAS_Z defined Z
+#if HAS_Y && !HAS_Z
+int defined_from_macros;
+#endif
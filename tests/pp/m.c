@@ -0,0 +1,7 @@
+
+
+
+
+int a;
+#include "h.h"
+int b;
@@ -0,0 +1,17 @@
+// the replacement of a macro is rescanned with the tokens after it.
+#define f(x) (x + 1)
+#define g f
+#define h() g
+#define id(x) x
+#define call(m) m
+int a = g(2);
+int b = h()(3);
+int c = id(g)(4);
+int d = call(f)(5) * call(g)(6);
+int e = f;
+// a macro is not expanded again in its own replacement.
+#define self self + 1
+#define loop1 loop2
+#define loop2 loop1
+int s = self;
+int l = loop1;
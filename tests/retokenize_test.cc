@@ -0,0 +1,104 @@
+// Edit files at random, re-tokenize around each edit, and check the tokens
+// against a full tokenization of the edited buffer.
+// Insertions are taken from fragments that change the tokens around them:
+// comment and string delimiters, line splices, operators, names, numbers.
+// Usage: retokenize_test [-n edits] [-s seed] <files...>
+// Returns 0 if the tokens always match, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/utils.h>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+// The index of the first token which differs, or -1 if there is none.
+static auto FirstDifference(const std::vector<Lex::Token> &a,
+                            const std::vector<Lex::Token> &b) -> long {
+  for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+    if (a[i].src != b[i].src || a[i].offset != b[i].offset || a[i].length != b[i].length ||
+        a[i].Text() != b[i].Text() || a[i].label != b[i].label ||
+        a[i].line != b[i].line || a[i].atom != b[i].atom) {
+      return i;
+    }
+  }
+  return a.size() == b.size() ? -1 : std::min(a.size(), b.size());
+}
+
+static const char *fragments[] = {
+  "/*", "*/", "//", "\"", "'", "\\\n", "\n", " ", "\t",
+  "<", "<<", "=", ">>=", "-", ">", "+", "&&", "|", ".", "...", "#",
+  "x", "name_1", "int", "while", "0", "0x1f", "42", "(", ")", "{", "}", ";",
+  "\"str\\\"ing\"", "'\\n'", "/* a\nb */", "// c\n",
+};
+
+// Edit `buf` and its tokens `n` times. Returns false at the first edit
+// after which they differ from a full tokenization.
+static auto CheckEdits(const char *filename, std::string buf, bool ignore_null, size_t n,
+                       std::mt19937 &rng) -> bool {
+  auto tokens = Lex::CLangTokenize(buf, ignore_null);
+  for (size_t k = 0; k < n; k++) {
+    Lex::Edit edit;
+    edit.offset = std::uniform_int_distribution<size_t>(0, buf.size())(rng);
+    const size_t max_removed = std::min<size_t>(buf.size() - edit.offset, 16);
+    edit.removed = rng() % 2 ? std::uniform_int_distribution<size_t>(0, max_removed)(rng) : 0;
+    std::string inserted;
+    if (edit.removed == 0 || rng() % 2) {
+      inserted = fragments[rng() % (sizeof(fragments) / sizeof(fragments[0]))];
+    }
+    edit.inserted = inserted.size();
+    // a new string, so that the buffer moves as it would in an editor.
+    buf = buf.substr(0, edit.offset) + inserted + buf.substr(edit.offset + edit.removed);
+
+    Lex::CLangRetokenize(tokens, buf, edit, ignore_null);
+    const auto expected = Lex::CLangTokenize(buf, ignore_null);
+    const long diff = FirstDifference(tokens, expected);
+    if (diff >= 0) {
+      fprintf(stderr, "%s: edit %zu (offset %zu, removed %zu, inserted \"%s\"%s): "
+              "token %ld differs\n", filename, k, edit.offset, edit.removed,
+              inserted.c_str(), ignore_null ? ", without null tokens" : "", diff);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t edits = 200;
+  unsigned long seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+    case ('n'): {
+      edits = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    case ('s'): {
+      seed = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-n edits] [-s seed] <files...>\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-n edits] [-s seed] <files...>\n", argv[0]);
+    return 1;
+  }
+
+  std::mt19937 rng(seed);
+  bool ok = true;
+  for (int i = optind; i < argc; i++) {
+    FileSource fobj(argv[i]);
+    const std::string buf(fobj.View());
+    ok &= CheckEdits(argv[i], buf, false, edits, rng);
+    ok &= CheckEdits(argv[i], buf, true, edits, rng);
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("retokenize_test: %d files, %zu edits each: OK\n", argc - optind, edits);
+  return 0;
+}
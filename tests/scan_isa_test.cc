@@ -0,0 +1,119 @@
+// Tokenize files with the scanning kernels of each instruction set the cpu
+// supports, and check that they give the tokens of the scalar kernels.
+// The kernels are also compared one by one, from every offset of the files,
+// so that the tails shorter than a vector are checked too.
+// Usage: scan_isa_test <files...>
+// Returns 0 if every instruction set gives the same results, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/scan.h>
+#include <src/utils.h>
+#include <memory>
+
+using Lex::Scan::Isa;
+
+static auto SameTokens(const std::vector<Lex::Token> &a, const std::vector<Lex::Token> &b)
+  -> bool {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].src != b[i].src || a[i].offset != b[i].offset || a[i].length != b[i].length ||
+        a[i].label != b[i].label || a[i].line != b[i].line || a[i].atom != b[i].atom) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the name of the first kernel of `kernels` whose results differ
+// from `expected` on `text`, or null.
+static auto DifferentKernel(const Lex::Scan::Kernels &expected,
+                            const Lex::Scan::Kernels &kernels, std::string_view text)
+  -> const char * {
+  const char *str = text.data();
+  const size_t len = text.size();
+  static const char quotes[] = {'"', '\''};
+  for (size_t from = 0; from <= len; from++) {
+    if (kernels.skip_identifier(str, from, len) != expected.skip_identifier(str, from, len)) {
+      return "skip_identifier";
+    }
+    uint32_t newlines = 0;
+    uint32_t expected_newlines = 0;
+    if (kernels.skip_blanks(str, from, len, &newlines) !=
+        expected.skip_blanks(str, from, len, &expected_newlines) ||
+        newlines != expected_newlines) {
+      return "skip_blanks";
+    }
+    for (const char ch : quotes) {
+      newlines = expected_newlines = 0;
+      if (kernels.find_char_or_escape(str, from, len, ch, &newlines) !=
+          expected.find_char_or_escape(str, from, len, ch, &expected_newlines) ||
+          newlines != expected_newlines) {
+        return "find_char_or_escape";
+      }
+    }
+    newlines = expected_newlines = 0;
+    if (kernels.find_comment_end(str, from, len, &newlines) !=
+        expected.find_comment_end(str, from, len, &expected_newlines) ||
+        newlines != expected_newlines) {
+      return "find_comment_end";
+    }
+    if (kernels.count_newlines(str, from, len) != expected.count_newlines(str, from, len)) {
+      return "count_newlines";
+    }
+  }
+  return nullptr;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  // the scalar run.
+  const Isa best = Lex::Scan::DetectIsa();
+  Lex::Scan::SetIsa(Isa::SCALAR);
+  const Lex::Scan::Kernels scalar = *Lex::Scan::kernels;
+  std::vector<std::unique_ptr<FileSource>> files;
+  std::vector<std::vector<Lex::Token>> expected;
+  for (int i = 1; i < argc; i++) {
+    files.emplace_back(new FileSource(argv[i]));
+    expected.push_back(Lex::CLangTokenize(files.back()->View(), false));
+  }
+
+  bool ok = true;
+  size_t num_isas = 0;
+  for (int k = static_cast<int>(Isa::SSE2); k <= static_cast<int>(best); k++) {
+    const Isa isa = Lex::Scan::SetIsa(static_cast<Isa>(k));
+    if (isa != static_cast<Isa>(k)) {
+      fprintf(stderr, "%s: not selected\n", Lex::Scan::GetNameOfIsa(static_cast<Isa>(k)));
+      ok = false;
+      continue;
+    }
+    num_isas++;
+    for (size_t i = 0; i < files.size(); i++) {
+      const auto tokens = Lex::CLangTokenize(files[i]->View(), false);
+      if (!SameTokens(tokens, expected[i])) {
+        fprintf(stderr, "%s: tokens differ with %s\n", argv[i + 1],
+                Lex::Scan::GetNameOfIsa(isa));
+        ok = false;
+      }
+      if (const char *kernel = DifferentKernel(scalar, *Lex::Scan::kernels,
+                                               files[i]->View())) {
+        fprintf(stderr, "%s: %s differs with %s\n", argv[i + 1], kernel,
+                Lex::Scan::GetNameOfIsa(isa));
+        ok = false;
+      }
+    }
+  }
+  Lex::Scan::SetIsa(best);
+
+  if (!ok) {
+    return 1;
+  }
+  printf("scan_isa_test: %zu files, scalar and %zu other instruction sets: OK\n",
+         files.size(), num_isas);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Compile files with declarations that have errors, and check that each
+// error is reported and its declaration skipped, while the others are still
+// compiled. The files say what to expect in comments:
+//   `// error: <message>` on the line of each error,
+//   `// kept: <name>` for each function whose code is generated.
+// Usage: skip_test <files...>
+// Returns 0 if the errors and the code are the expected ones, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/utils.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// the text after `tag` in each line, by line number.
+static auto Comments(std::string_view text, const std::string &tag)
+  -> std::map<uint32_t, std::string> {
+  std::map<uint32_t, std::string> ret;
+  uint32_t line = 1;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string_view::npos) {
+      end = text.size();
+    }
+    const auto pos = text.substr(start, end - start).find(tag);
+    if (pos != std::string_view::npos) {
+      ret[line] = std::string(text.substr(start + pos + tag.size(), end - start - pos - tag.size()));
+    }
+    start = end + 1;
+    line++;
+  }
+  return ret;
+}
+
+static auto CheckFile(const char *filename) -> bool {
+  FileSource fobj(filename);
+  auto tokens = Lex::CLangTokenize(fobj.View(), true);
+  auto root = Parser::CLangParser(tokens);
+  auto diagnostics = Parser::BasicBlock::MergeIfElseBlockTree(root.get());
+  auto generator = Generator::X86Generator();
+  const auto asm_code = generator.GenerateCode(root.get());
+  const auto &more = generator.GetDiagnostics();
+  diagnostics.insert(diagnostics.end(), more.begin(), more.end());
+
+  bool ok = true;
+  auto errors = Comments(fobj.View(), "// error: ");
+  for (const auto &diag : diagnostics) {
+    auto it = errors.find(diag.line);
+    if (it == errors.end() || it->second != diag.message) {
+      fprintf(stderr, "%s:%u: unexpected error: %s\n", filename, diag.line,
+              diag.message.c_str());
+      ok = false;
+    } else {
+      errors.erase(it);
+    }
+  }
+  for (const auto &[line, message] : errors) {
+    fprintf(stderr, "%s:%u: error not reported: %s\n", filename, line, message.c_str());
+    ok = false;
+  }
+
+  for (const auto &[line, name] : Comments(fobj.View(), "// kept: ")) {
+    if (asm_code.find("\n" + name + ":\n") == std::string::npos) {
+      fprintf(stderr, "%s:%u: no code for %s\n", filename, line, name.c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    try {
+      ok &= CheckFile(argv[i]);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "%s: %s\n", argv[i], e.what());
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("skip_test: %d files: OK\n", argc - 1);
+  return 0;
+}
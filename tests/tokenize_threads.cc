@@ -0,0 +1,89 @@
+// Tokenize files from several threads at once, and check that every thread
+// gets the same tokens as a serial run.
+// Usage: tokenize_threads [-j threads] [-r rounds] <files...>
+// Returns 0 if all the token streams match, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/utils.h>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+static auto SameTokens(const std::vector<Lex::Token> &a, const std::vector<Lex::Token> &b)
+  -> bool {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].src != b[i].src || a[i].offset != b[i].offset || a[i].length != b[i].length ||
+        a[i].label != b[i].label || a[i].line != b[i].line || a[i].atom != b[i].atom) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t threads = 8;
+  size_t rounds = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:r:")) != -1) {
+    switch (opt) {
+    case ('j'): {
+      threads = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    case ('r'): {
+      rounds = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-j threads] [-r rounds] <files...>\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-j threads] [-r rounds] <files...>\n", argv[0]);
+    return 1;
+  }
+
+  // the serial run.
+  std::vector<std::unique_ptr<FileSource>> files;
+  std::vector<std::vector<Lex::Token>> expected;
+  for (int i = optind; i < argc; i++) {
+    files.emplace_back(new FileSource(argv[i]));
+    expected.push_back(Lex::CLangTokenize(files.back()->View(), true));
+  }
+
+  // each thread starts with another file, so that different files are
+  // tokenized at the same time.
+  std::atomic<size_t> failures{0};
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < threads; k++) {
+    workers.emplace_back([&, k]() {
+      for (size_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < files.size(); i++) {
+          const size_t idx = (i + k) % files.size();
+          const auto tokens = Lex::CLangTokenize(files[idx]->View(), true);
+          if (!SameTokens(tokens, expected[idx])) {
+            fprintf(stderr, "%s: tokens differ in thread %zu\n", argv[optind + idx], k);
+            failures++;
+          }
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  if (failures != 0) {
+    fprintf(stderr, "tokenize_threads: %zu failures\n", failures.load());
+    return 1;
+  }
+  printf("tokenize_threads: %zu files, %zu threads: OK\n", files.size(), threads);
+  return 0;
+}
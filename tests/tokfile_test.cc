@@ -0,0 +1,122 @@
+// Write token files and read them back, with lines which go back: the
+// tokens of preprocessed files, one by one and all in one file, as
+// `parse -E -o` and `preprocess -o` write them.
+// A header which claims more tokens than its records hold is refused.
+// Usage: tokfile_test <files...>
+// Returns 0 if the tokens read are the ones written, 1 otherwise.
+
+#include <src/preproc.h>
+#include <src/tokfile.h>
+#include <cstdlib>
+#include <unistd.h>
+
+static auto CheckRoundTrip(const std::string &what, const std::vector<Lex::Token> &tokens)
+  -> bool {
+  char path[] = "/tmp/tokfile_test.XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot make a temporary file\n", what.c_str());
+    return false;
+  }
+  close(fd);
+
+  bool ok = true;
+  try {
+    Lex::WriteTokenFile(path, tokens);
+    Lex::TokenFile file(path);
+    const auto loaded = file.Load();
+    ok = loaded.size() == tokens.size();
+    for (size_t i = 0; ok && i < tokens.size(); i++) {
+      ok = loaded[i].Text() == tokens[i].Text() && loaded[i].label == tokens[i].label &&
+        loaded[i].line == tokens[i].line;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: tokens read differ from the ones written\n", what.c_str());
+    }
+  } catch (const std::runtime_error &e) {
+    fprintf(stderr, "%s: %s\n", what.c_str(), e.what());
+    ok = false;
+  }
+  unlink(path);
+  return ok;
+}
+
+// Returns true if a token file whose header claims too many tokens is
+// refused when opened.
+static auto CheckTooManyTokens() -> bool {
+  char path[] = "/tmp/tokfile_test.XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "too many tokens: cannot make a temporary file\n");
+    return false;
+  }
+  close(fd);
+
+  static const char text[] = "a b";
+  Lex::WriteTokenFile(path, {
+    Lex::Token(text, 0, 1, Lex::TokenLabel::TALPHA, 1),
+    Lex::Token(text, 2, 1, Lex::TokenLabel::TALPHA, 1),
+  });
+  Lex::TokenFileHeader header;
+  FILE *file = fopen(path, "r+b");
+  bool ok = file != nullptr && fread(&header, sizeof(header), 1, file) == 1;
+  if (ok) {
+    header.num_tokens = UINT64_MAX / 2;
+    ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+  }
+  if (file != nullptr) {
+    ok &= fclose(file) == 0;
+  }
+  if (ok) {
+    try {
+      Lex::TokenFile loaded(path);
+      fprintf(stderr, "too many tokens: the file was opened\n");
+      ok = false;
+    } catch (const std::runtime_error &) {
+    }
+  } else {
+    fprintf(stderr, "too many tokens: cannot rewrite the header\n");
+  }
+  unlink(path);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  // lines far apart, in both directions.
+  static const char text[] = "a b c d";
+  ok &= CheckRoundTrip("lines", {
+    Lex::Token(text, 0, 1, Lex::TokenLabel::TALPHA, 5),
+    Lex::Token(text, 2, 1, Lex::TokenLabel::TALPHA, 1),
+    Lex::Token(text, 4, 1, Lex::TokenLabel::TALPHA, UINT32_MAX),
+    Lex::Token(text, 6, 1, Lex::TokenLabel::TALPHA, 0),
+  });
+
+  ok &= CheckTooManyTokens();
+
+  std::vector<Lex::Token> all;
+  Preprocessor::Preprocessor pp;
+  for (int i = 1; i < argc; i++) {
+    std::vector<Lex::Token> tokens;
+    try {
+      tokens = pp.Run(argv[i]);
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+    ok &= CheckRoundTrip(argv[i], tokens);
+    all.insert(all.end(), tokens.begin(), tokens.end());
+  }
+  ok &= CheckRoundTrip("all files", all);
+
+  if (!ok) {
+    return 1;
+  }
+  printf("tokfile_test: %d files: OK\n", argc - 1);
+  return 0;
+}
@@ -0,0 +1,211 @@
+// Walk parse trees with visitors, and check the calls they get against a
+// recursive walk: one visitor alone, visitors which skip or stop next to
+// ones which go on, and a visitor with tagged Enter and Leave next to a
+// plain one.
+// Usage: visit_test <files...>
+// Returns 0 if every visitor gets the calls of the recursive walk, 1 otherwise.
+
+#include <src/lex.h>
+#include <src/utils.h>
+#include <src/visit.h>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace Parser {
+
+// the blocks of a tree, numbered in pre-order.
+typedef std::unordered_map<const BasicBlock *, size_t> BlockIds;
+
+static auto NumberBlocks(const BasicBlock *block, BlockIds &ids) -> void {
+  const size_t id = ids.size();
+  ids[block] = id;
+  for (size_t i = 0; i < block->GetNumChildren(); i++) {
+    NumberBlocks(block->GetChild(i), ids);
+  }
+}
+
+// what a visitor does at each block.
+struct Plan {
+  // skip the children of blocks with id % skip_every == skip_at.
+  size_t skip_every{0};
+  size_t skip_at{0};
+  // stop at the block with this id.
+  size_t stop_at{SIZE_MAX};
+
+  auto ActionAt(size_t id) const -> VisitAction {
+    if (id == this->stop_at) {
+      return VisitAction::VSTOP;
+    }
+    if (this->skip_every != 0 && id % this->skip_every == this->skip_at) {
+      return VisitAction::VSKIP;
+    }
+    return VisitAction::VCONTINUE;
+  }
+};
+
+static auto Event(const char *what, size_t id, size_t depth) -> std::string {
+  return std::string(what) + " " + std::to_string(id) + " " + std::to_string(depth) + "\n";
+}
+
+// The calls a visitor following `plan` gets, by recursion.
+// Returns false once it stops.
+static auto ReferenceWalk(const BasicBlock *block, size_t depth, const BlockIds &ids,
+                          const Plan &plan, std::string &log) -> bool {
+  const size_t id = ids.at(block);
+  log += Event("enter", id, depth);
+  const auto action = plan.ActionAt(id);
+  if (action == VisitAction::VSTOP) {
+    return false;
+  }
+  if (action == VisitAction::VCONTINUE && block->HasChildren()) {
+    log += Event("enter scope", id, depth);
+    for (size_t i = 0; i < block->GetNumChildren(); i++) {
+      if (!ReferenceWalk(block->GetChild(i), depth + 1, ids, plan, log)) {
+        return false;
+      }
+    }
+    log += Event("leave scope", id, depth);
+  }
+  log += Event("leave", id, depth);
+  return true;
+}
+
+// logs the calls it gets, and follows its plan.
+struct Recorder {
+  const BlockIds &ids;
+  Plan plan;
+  std::string log;
+
+  auto Enter(const BasicBlock *block, size_t depth) -> VisitAction {
+    const size_t id = this->ids.at(block);
+    this->log += Event("enter", id, depth);
+    return this->plan.ActionAt(id);
+  }
+  void Leave(const BasicBlock *block, size_t depth) {
+    this->log += Event("leave", this->ids.at(block), depth);
+  }
+  void EnterScope(const BasicBlock *block, size_t depth) {
+    this->log += Event("enter scope", this->ids.at(block), depth);
+  }
+  void LeaveScope(const BasicBlock *block, size_t depth) {
+    this->log += Event("leave scope", this->ids.at(block), depth);
+  }
+};
+
+// logs the type of each block, from the tag of the call.
+struct TaggedRecorder {
+  std::string log;
+
+  void Enter(BlockTag<BlockType::BFUNCTION>, const BasicBlock *, size_t depth) {
+    this->log += "enter function " + std::to_string(depth) + "\n";
+  }
+  template <BlockType T>
+  void Enter(BlockTag<T>, const BasicBlock *, size_t depth) {
+    this->log += "enter " + BlockTypeToString(T) + " " + std::to_string(depth) + "\n";
+  }
+  template <BlockType T>
+  void Leave(BlockTag<T>, const BasicBlock *, size_t depth) {
+    this->log += "leave " + BlockTypeToString(T) + " " + std::to_string(depth) + "\n";
+  }
+};
+
+// logs the type of each block, from the block.
+struct TypeRecorder {
+  std::string log;
+
+  void Enter(const BasicBlock *block, size_t depth) {
+    const auto type = block->GetType();
+    this->log += "enter " + (type == BlockType::BFUNCTION ? std::string("function") :
+      BlockTypeToString(type)) + " " + std::to_string(depth) + "\n";
+  }
+  void Leave(const BasicBlock *block, size_t depth) {
+    this->log += "leave " + BlockTypeToString(block->GetType()) + " " +
+      std::to_string(depth) + "\n";
+  }
+};
+
+// Returns an empty string if the visitors of the tree of `root` get the
+// calls of the recursive walk, or which one does not.
+static auto CheckWalks(const BasicBlock *root) -> std::string {
+  BlockIds ids;
+  NumberBlocks(root, ids);
+  auto expected = [&](const Plan &plan) {
+    std::string log;
+    ReferenceWalk(root, 0, ids, plan, log);
+    return log;
+  };
+
+  Recorder alone{ids};
+  if (!VisitBlocks(root, alone) || alone.log != expected(alone.plan)) {
+    return "a visitor alone";
+  }
+
+  // each of them as if it were alone, whichever stops or skips first.
+  const size_t size = ids.size();
+  Recorder skips{ids, {3, 1}};
+  Recorder skips_more{ids, {2, 0}};
+  Recorder stops{ids, {5, 2, size / 2}};
+  Recorder plain{ids};
+  VisitBlocks(root, skips, stops, skips_more, plain);
+  if (skips.log != expected(skips.plan)) {
+    return "a visitor which skips";
+  }
+  if (skips_more.log != expected(skips_more.plan)) {
+    return "a visitor which skips more";
+  }
+  if (stops.log != expected(stops.plan)) {
+    return "a visitor which stops";
+  }
+  if (plain.log != expected(plain.plan)) {
+    return "a visitor next to ones which skip and stop";
+  }
+
+  // all of them stop: the walk ends there.
+  Recorder first{ids, {0, 0, 0}};
+  Recorder second{ids, {0, 0, size - 1}};
+  if (VisitBlocks(root, first, second) || first.log != expected(first.plan) ||
+      second.log != expected(second.plan)) {
+    return "visitors which all stop";
+  }
+
+  TaggedRecorder tagged;
+  TypeRecorder types;
+  VisitBlocks(root, tagged, types);
+  if (tagged.log != types.log) {
+    return "a tagged visitor";
+  }
+  return "";
+}
+
+} // namespace Parser
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <files...>\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int i = 1; i < argc; i++) {
+    try {
+      FileSource fobj(argv[i]);
+      const auto tokens = Lex::CLangTokenize(fobj.View(), true);
+      const auto root = Parser::CLangParser(tokens);
+      const auto what = Parser::CheckWalks(root.get());
+      if (!what.empty()) {
+        fprintf(stderr, "%s: %s differs from the recursive walk\n", argv[i], what.c_str());
+        ok = false;
+      }
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", argv[i], e.what());
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("visit_test: %d files: OK\n", argc - 1);
+  return 0;
+}
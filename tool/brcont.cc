@@ -4,7 +4,11 @@
 // Returns 0 if successful, 2 if all possibilities
 // are exhausted.
 
+// With $TLEX_CACHE set to a directory, parses are cached there
+// (see src/parsecache.h).
+
 #include <src/lex.h>
+#include <src/parsecache.h>
 #include <iostream>
 
 int main(int argc, char **argv) {
@@ -14,21 +18,17 @@ int main(int argc, char **argv) {
     return 1;
   }    
 
-  auto fobj = ReadAll(argv[1]);
+  FileSource fobj(argv[1]);
   size_t idx = atol(argv[2]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
-
-  // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
-  bool ret = BugInsertor::MissingBreakOrCont(root, idx);
+  auto parsed = Parser::ParseSource(fobj.View());
+  const auto &root = parsed.tree;
+  bool ret = BugInsertor::MissingBreakOrCont(root.get(), idx);
 
   if (!ret) {
     printf("/* cannot insert */\n");
-    delete root;
     return 2;
   }
 
   root->Print(std::cout);
-  delete root;
   return 0;
 }
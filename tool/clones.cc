@@ -0,0 +1,150 @@
+// Find identical functions in C source files.
+// Usage: clones [-n] [-m min_tokens] [C source files]
+// With no files, their names are read from stdin, one per line.
+
+// Functions are grouped by the structural hash of their trees (see
+// src/treehash.h), so formatting and comments do not matter. With -n,
+// identifiers are normalized: functions which differ only by a consistent
+// renaming are grouped too. Functions with fewer than min_tokens tokens
+// (default 20) are left out.
+// With $TLEX_CACHE set to a directory, parses are cached there
+// (see src/parsecache.h).
+
+// The output is in CSV format, one group per paragraph, largest first:
+// hash, number_of_functions, number_of_tokens
+// file, function_name, start_line, end_line
+
+#include <src/lex.h>
+#include <src/parsecache.h>
+#include <src/treehash.h>
+#include <src/visit.h>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+
+namespace Parser {
+
+// the number of tokens and the lines of a tree.
+struct Extent {
+  size_t num_tokens{0};
+  std::pair<size_t, size_t> lines{-1, 0};
+
+  void Enter(const BasicBlock *block, size_t) {
+    const auto &tokens = block->GetInstrAsRef().tokens;
+    if (tokens.empty()) {
+      return;
+    }
+    this->num_tokens += tokens.size();
+    this->lines.first = std::min<size_t>(this->lines.first, tokens.front().line);
+    this->lines.second = std::max<size_t>(this->lines.second, tokens.back().line);
+  }
+};
+
+} // namespace Parser
+
+struct Function {
+  uint32_t file;
+  std::string name;
+  std::pair<size_t, size_t> lines;
+};
+
+struct Group {
+  size_t num_tokens;
+  std::vector<Function> functions;
+};
+
+int main(int argc, char **argv) {
+  auto mode = Parser::IdentifierMode::IEXACT;
+  size_t min_tokens = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "nm:")) != -1) {
+    switch (opt) {
+    case ('n'): {
+      mode = Parser::IdentifierMode::INORMALIZED;
+      break;
+    }
+    case ('m'): {
+      min_tokens = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-n] [-m min_tokens] [files]\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if (files.empty()) {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (!line.empty()) {
+        files.push_back(line);
+      }
+    }
+  }
+
+  // one pass over the files: only the groups are kept.
+  std::unordered_map<uint64_t, Group> groups;
+  Parser::TreeHasher hasher(mode);
+  int ret = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    try {
+      FileSource fobj(files[i].c_str());
+      auto parsed = Parser::ParseSource(fobj.View());
+      const auto &root = parsed.tree;
+      for (size_t j = 0; j < root->GetNumChildren(); j++) {
+        auto *func = root->GetChild(j);
+        if (func->GetType() != Parser::BlockType::BFUNCTION) {
+          continue;
+        }
+
+        // the hash and the extent in one walk.
+        Parser::Extent extent;
+        Parser::VisitBlocks(func, hasher, extent);
+        if (extent.num_tokens < min_tokens) {
+          continue;
+        }
+
+        const auto fns = func->GetInstrAsRef().GetFuncCalls();
+        auto &group = groups[hasher.GetHash()];
+        group.num_tokens = extent.num_tokens;
+        group.functions.push_back({static_cast<uint32_t>(i),
+          fns.empty() ? "(\?\?)" : std::string(Lex::AtomText(fns[0])), extent.lines});
+      }
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", files[i].c_str(), e.what());
+      ret = 1;
+    }
+  }
+
+  std::vector<std::pair<uint64_t, const Group *>> clones;
+  for (const auto &entry : groups) {
+    if (entry.second.functions.size() > 1) {
+      clones.push_back({entry.first, &entry.second});
+    }
+  }
+  // largest first, then by hash, so that the output is stable.
+  std::sort(clones.begin(), clones.end(), [](const auto &a, const auto &b) {
+    const size_t size_a = a.second->functions.size() * a.second->num_tokens;
+    const size_t size_b = b.second->functions.size() * b.second->num_tokens;
+    return size_a != size_b ? size_a > size_b : a.first < b.first;
+  });
+
+  for (const auto &clone : clones) {
+    const Group &group = *clone.second;
+    printf("%016llx, %zu, %zu\n", static_cast<unsigned long long>(clone.first),
+           group.functions.size(), group.num_tokens);
+    for (const auto &fn : group.functions) {
+      printf("%s, %s, %zu, %zu\n", files[fn.file].c_str(), fn.name.c_str(),
+             fn.lines.first, fn.lines.second);
+    }
+    printf("\n");
+  }
+
+  return ret;
+}
@@ -2,6 +2,8 @@
 // in a tree structure.
 
 // Usage: fntree [C source file]
+// With $TLEX_CACHE set to a directory, parses are cached there
+// (see src/parsecache.h).
 
 // Example output:
 // _strlen
@@ -11,38 +13,29 @@
 //   exit
 
 #include <src/lex.h>
+#include <src/parsecache.h>
 #include <iostream>
 
 namespace Parser {
 
-static size_t indent = 0;
-
-static auto PrintIndent(std::ostream &os) -> std::ostream & {
+static auto PrintIndent(std::ostream &os, size_t indent) -> std::ostream & {
   for (size_t i = 1; i < indent; i++)
     os << '\t';
   return os;
 }
 
-static auto PrintFuncCall(BasicBlock *root, std::ostream &os) 
+// a scan of the flat tree, nodes are indented by their depth.
+static auto PrintFuncCall(const FlatTree &tree, std::ostream &os) 
   -> std::ostream & {
-  
-  {
-    const auto &instr = root->GetInstrAsRef();
-    const auto fns = instr.GetFuncCalls();
+  for (const auto id : tree.Nodes()) {
+    const auto fns = tree.GetFuncCalls(id);
 
     for (const auto &fn : fns) {
-      PrintIndent(os);
-      os << fn << std::endl;
+      PrintIndent(os, tree.GetDepth(id));
+      os << Lex::AtomText(fn) << std::endl;
     }
   }
 
-  indent ++;
-  size_t num_children = root->GetNumChildren();
-  for (size_t i = 0; i < num_children; i++) {
-    PrintFuncCall(root->GetChild(i), os);
-  }
-  indent --;
-
   return os;
 }
 
@@ -54,13 +47,10 @@ int main(int argc, char **argv, char **envp) {
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
-
-  // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
-  Parser::PrintFuncCall(root, std::cout);
+  FileSource fobj(argv[1]);
+  auto parsed = Parser::ParseSource(fobj.View());
+  const auto &root = parsed.tree;
+  Parser::PrintFuncCall(Parser::FlatTree(root.get()), std::cout);
 
-  delete root;
   return 0;
 }
@@ -13,8 +13,12 @@
 //  
 //  The lines that follow are the code of the function.
 
+// With $TLEX_CACHE set to a directory, tokens are cached there
+// (see src/parsecache.h).
+
 #include <iostream>
 #include <src/lex.h>
+#include <src/parsecache.h>
 #include <cstdlib>
 
 int main(int argc, char **argv, char **envp) {
@@ -24,21 +28,20 @@ int main(int argc, char **argv, char **envp) {
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
+  FileSource fobj(argv[1]);
   size_t idx = atol(argv[2]);
   int ret = 0;
-  auto tokens = Lex::CLangTokenize(fobj, true);
+  // tokens are loaded from the parse cache if there is one.
+  auto tokens = Parser::TokenizeSource(fobj.View());
 
-  // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
-  size_t num_children = root->GetNumChildren();
+  // only the body of the function asked for is parsed.
+  const auto units = Parser::CLangScanTopLevel(tokens);
 
-  std::vector<Parser::BasicBlock *> funcs;
+  std::vector<const Parser::TopLevelUnit *> funcs;
 
-  for (size_t i = 0; i < num_children; i++) {
-    auto *child = root->GetChild(i);
-    if (child->GetType() == Parser::BlockType::BFUNCTION) {
-      funcs.push_back(child);
+  for (const auto &unit : units) {
+    if (unit.type == Parser::BlockType::BFUNCTION) {
+      funcs.push_back(&unit);
     }
   }
 
@@ -46,13 +49,14 @@ int main(int argc, char **argv, char **envp) {
     printf("0 0\n(null)\n");
     ret = 2;
   } else {
-    auto *func = funcs[idx];
-    auto rg = func->GetLineRange();
+    const auto *func = funcs[idx];
+    auto rg = func->lines;
     printf("%lu %lu\n", rg.first, rg.second);
-    func->Print(std::cout);
+    // the unit is the only child of the root.
+    auto root = Parser::CLangParser(func->tokens);
+    root->GetChild(0)->Print(std::cout);
     std::cout << std::endl;
   }
 
-  delete root;
   return ret;
 }
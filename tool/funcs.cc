@@ -4,8 +4,12 @@
 // The output is in CSV format:
 // function_name, start_line, end_line
 
+// With $TLEX_CACHE set to a directory, tokens are cached there
+// (see src/parsecache.h).
+
 #include <iostream>
 #include <src/lex.h>
+#include <src/parsecache.h>
 
 int main(int argc, char **argv, char **envp) {
   if (argc < 2) {
@@ -14,21 +18,20 @@ int main(int argc, char **argv, char **envp) {
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
+  FileSource fobj(argv[1]);
+  // tokens are loaded from the parse cache if there is one.
+  auto tokens = Parser::TokenizeSource(fobj.View());
 
-  // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
-  size_t num_children = root->GetNumChildren();
+  // the functions are found without parsing their bodies.
+  const auto units = Parser::CLangScanTopLevel(tokens);
 
-  for (size_t i = 0; i < num_children; i++) {
-    auto *child = root->GetChild(i);
-    if (child->GetType() == Parser::BlockType::BFUNCTION) {
-      auto rg = child->GetLineRange();
-      const auto &insn = child->GetInstrAsRef();
-      const auto fns = insn.GetFuncCalls();
+  for (const auto &unit : units) {
+    if (unit.type == Parser::BlockType::BFUNCTION) {
+      const auto &rg = unit.lines;
+      const auto fns = Parser::Instruction(unit.head).GetFuncCalls();
       if (fns.size()) {
-        printf("%s", fns[0].c_str());
+        const auto name = Lex::AtomText(fns[0]);
+        printf("%.*s", static_cast<int>(name.size()), name.data());
       }
       else {
         printf("(\?\?)");
@@ -37,6 +40,5 @@ int main(int argc, char **argv, char **envp) {
     }
   }
 
-  delete root;
   return 0;
 }
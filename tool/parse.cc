@@ -2,33 +2,84 @@
 // the corresponding AST.
 // Beta feature. PLEASE USE WITH CAUTION, AND REPORT BUG TO
 // ITS AUTHOR.
-// Usage: parse [c source file]
+// Usage: parse [-E] [-I dir] [-D name[=value]] [-j threads] [-o tokens] [c source file]
+// Tokens are dumped to tokens.csv, or the file given by -o.
+// With -j, the functions of a large file are parsed by several threads.
+// With -E, the file is preprocessed first (see src/preproc.h), searching
+// the directories of -I, then the system ones.
 
 #include <src/lex.h>
+#include <src/preproc.h>
+#include <src/tokfile.h>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <unistd.h>
 
-int main(int argc, char ** argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <file>\n", argv[0]) ;
+int main(int argc, char **argv) {
+  std::string output = "tokens.csv";
+  bool preprocess = false;
+  size_t threads = 1;
+  Preprocessor::Preprocessor pp;
+  int opt;
+  while ((opt = getopt(argc, argv, "EI:D:j:o:")) != -1) {
+    switch (opt) {
+    case ('E'): {
+      preprocess = true;
+      break;
+    }
+    case ('I'): {
+      pp.AddIncludeDir(optarg);
+      break;
+    }
+    case ('D'): {
+      const char *eq = strchr(optarg, '=');
+      pp.Define(eq ? std::string(optarg, eq - optarg) : optarg, eq ? eq + 1 : "1");
+      break;
+    }
+    case ('j'): {
+      threads = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    case ('o'): {
+      output = optarg;
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-E] [-I dir] [-D name[=value]] [-j threads] [-o tokens] <file>\n",
+              argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-E] [-I dir] [-D name[=value]] [-j threads] [-o tokens] <file>\n",
+            argv[0]);
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
+  std::unique_ptr<FileSource> fobj;
+  std::vector<Lex::Token> tokens;
+  if (preprocess) {
+    pp.AddSystemIncludeDirs();
+    try {
+      tokens = pp.Run(argv[optind]);
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  } else {
+    fobj.reset(new FileSource(argv[optind]));
+    tokens = Lex::CLangTokenize(fobj->View(), true);
+  }
 
   // dump tokenizer output for debugging
-  FILE *fout = fopen("tokens.csv", "w");
-  assert( fout != nullptr );
-  for (const auto &token : tokens) {
-    fprintf(fout, "%s,%u,%s\n", EncodeString(token.buf).c_str(), token.line,
-            GetNameOfLabel(token.label));
-  }
-  fclose(fout);
+  Lex::WriteTokenFile(output, tokens);
+
   // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
+  auto root = Parser::CLangParser(tokens, threads);
   root->Print(std::cout);
 
-  delete root;
   return 0;
 }
 
@@ -0,0 +1,107 @@
+// Preprocess C source files with the built-in preprocessor.
+// Usage: preprocess [-I dir] [-D name[=value]] [-U name] [-o tokens] <files...>
+// The output is printed as text, a line of tokens per source line, unless
+// -o is given: then the tokens of all the files are written to a token file
+// (see src/tokfile.h).
+// Files are preprocessed in a single process, so that headers they share
+// are tokenized only once.
+#include <src/preproc.h>
+#include <src/tokfile.h>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+static auto Usage(const char *prog) -> int {
+  fprintf(stderr, "Usage: %s [-I dir] [-D name[=value]] [-U name] [-o tokens] <files...>\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> include_dirs;
+  // (name, value), value is null for -U.
+  std::vector<std::pair<std::string, const char *>> macros;
+  std::string output;
+  int opt;
+  while ((opt = getopt(argc, argv, "I:D:U:o:")) != -1) {
+    switch (opt) {
+    case ('I'): {
+      include_dirs.push_back(optarg);
+      break;
+    }
+    case ('D'): {
+      const char *eq = strchr(optarg, '=');
+      if (eq == nullptr) {
+        macros.emplace_back(optarg, "1");
+      } else {
+        macros.emplace_back(std::string(optarg, eq - optarg), eq + 1);
+      }
+      break;
+    }
+    case ('U'): {
+      macros.emplace_back(optarg, nullptr);
+      break;
+    }
+    case ('o'): {
+      output = optarg;
+      break;
+    }
+    default: {
+      return Usage(argv[0]);
+    }
+    }
+  }
+  if (optind >= argc) {
+    return Usage(argv[0]);
+  }
+
+  std::unique_ptr<Lex::TokenWriter> writer;
+  if (!output.empty()) {
+    writer.reset(new Lex::TokenWriter(output));
+  }
+
+  for (int i = optind; i < argc; i++) {
+    // each file starts with the macros of the command line.
+    Preprocessor::Preprocessor pp;
+    for (const auto &dir : include_dirs) {
+      pp.AddIncludeDir(dir);
+    }
+    pp.AddSystemIncludeDirs();
+    for (const auto &macro : macros) {
+      if (macro.second) {
+        pp.Define(macro.first, macro.second);
+      } else {
+        pp.Undefine(macro.first);
+      }
+    }
+
+    std::vector<Lex::Token> tokens;
+    try {
+      tokens = pp.Run(argv[i]);
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+
+    if (writer) {
+      for (const auto &token : tokens) {
+        writer->Write(token);
+      }
+      continue;
+    }
+    uint32_t line = 0;
+    for (const auto &token : tokens) {
+      if (line != 0) {
+        std::cout << (token.line != line ? '\n' : ' ');
+      }
+      std::cout << token.Text();
+      line = token.line;
+    }
+    std::cout << '\n';
+  }
+
+  if (writer) {
+    writer->Finish();
+  }
+  return 0;
+}
@@ -1,5 +1,13 @@
+// Compile a C source file into test.S.
+// Usage: tlex [-o tokens] [c source file]
+// Tokens are dumped to tokens.csv, or the file given by -o.
+// Top-level declarations with errors are reported and left out of test.S;
+// then the exit status is 1.
+
 #include <src/lex.h>
+#include <src/tokfile.h>
 #include <src/utils.h>
+#include <unistd.h>
 
 #include <cstdio>
 #include <cassert>
@@ -7,33 +15,49 @@
 #include <fstream>
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <file>\n", argv[0]) ;
+  std::string output = "tokens.csv";
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case ('o'): {
+      output = optarg;
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-o tokens] <file>\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-o tokens] <file>\n", argv[0]) ;
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
+  FileSource fobj(argv[optind]);
+  auto tokens = Lex::CLangTokenize(fobj.View(), true);
 
   // dump tokenizer output for debugging
-  FILE *fout = fopen("tokens.csv", "w");
-  assert( fout != nullptr );
-  for (const auto &token : tokens) {
-    fprintf(fout, "%s,%u,%s\n", EncodeString(token.buf).c_str(), token.line,
-            GetNameOfLabel(token.label));
-  }
-  fclose(fout);
+  Lex::WriteTokenFile(output, tokens);
 
   // dump parser output for debugging
   auto root = Parser::CLangParser(tokens);
   root->Print(std::cout);
 
+  // declarations with errors are skipped, and the rest is compiled.
+  auto diagnostics = Parser::BasicBlock::MergeIfElseBlockTree(root.get());
   auto generator = Generator::X86Generator();
-  auto asm_code = generator.GenerateCode(root);
+  auto asm_code = generator.GenerateCode(root.get());
   std::ofstream asm_out("test.S");
   asm_out << asm_code;
   asm_out.close();
 
-  delete root;
-  return 0;
+  const auto &more = generator.GetDiagnostics();
+  diagnostics.insert(diagnostics.end(), more.begin(), more.end());
+  for (const auto &diag : diagnostics) {
+    fprintf(stderr, "%s:%u: error: %s, skipped lines %zu-%zu\n", argv[optind],
+            diag.line, diag.message.c_str(), diag.skipped.first, diag.skipped.second);
+  }
+
+  return diagnostics.empty() ? 0 : 1;
 }
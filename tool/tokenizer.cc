@@ -1,26 +1,81 @@
 // Tokenize a given C source file.
-// The output file is tokens.csv
-// Usage: tokenize [c source file]
+// The output file is tokens.csv, or the one given by -o: a binary token
+// file unless its name ends with .csv (see src/tokfile.h).
+// Usage: tokenize [-j threads] [-o output] [c source file]
+// Regular files are mapped into memory. Pipes are read incrementally, so
+// their size is not limited by memory, unless -j is given: then the whole
+// input is read and tokenized by several threads.
 #include <src/lex.h>
+#include <src/tokfile.h>
 #include <src/utils.h>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <file>\n", argv[0]) ;
+  size_t threads = 0;
+  std::string output = "tokens.csv";
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+    switch (opt) {
+    case ('j'): {
+      threads = strtoul(optarg, nullptr, 10);
+      break;
+    }
+    case ('o'): {
+      output = optarg;
+      break;
+    }
+    default: {
+      fprintf(stderr, "Usage: %s [-j threads] [-o output] <file>\n", argv[0]);
+      return 1;
+    }
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-j threads] [-o output] <file>\n", argv[0]) ;
     return 1;
   }
+  const char *filename = argv[optind];
+
+  // dump tokenizer output
+  Lex::TokenWriter writer(output);
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, false);
+  struct stat st;
+  const bool regular = strcmp("-", filename) && stat(filename, &st) == 0 &&
+                       S_ISREG(st.st_mode);
+  if (threads > 0) {
+    FileSource fobj(filename);
+    for (const auto &token : Lex::CLangTokenize(fobj.View(), false, threads)) {
+      writer.Write(token);
+    }
+    writer.Finish();
+    return 0;
+  }
+  if (regular) {
+    FileSource fobj(filename);
+    Lex::Lexer lexer(fobj.View(), false);
+    for (const auto &token : lexer) {
+      writer.Write(token);
+    }
+    writer.Finish();
+    return 0;
+  }
 
-  // dump tokenizer output for debugging
-  FILE *fout = fopen("tokens.csv", "w");
-  assert( fout != nullptr );
-  for (const auto &token : tokens) {
-    fprintf(fout, "%s,%u,%s\n", EncodeString(token.buf).c_str(), token.line,
-            GetNameOfLabel(token.label));
+  // if file name is -, read from stdin.
+  int fd = strcmp("-", filename) ? open(filename, O_RDONLY) : 0;
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s\n", filename);
+    return 1;
+  }
+  Lex::Lexer lexer(fd, false);
+  for (const auto &token : lexer) {
+    writer.Write(token);
   }
-  fclose(fout);
+  writer.Finish();
+  close(fd);
 
   return 0;
 }
@@ -1,37 +1,30 @@
 // Print the name of variables in a tree structure.
 // Usage: vartree [C source file]
+// With $TLEX_CACHE set to a directory, parses are cached there
+// (see src/parsecache.h).
 
 #include <src/lex.h>
+#include <src/parsecache.h>
 #include <iostream>
 #include <unordered_set>
 
-template <typename T>
-void VecRemoveLast(std::vector<T> &vec) {
-  if (vec.empty()) {
-    return;
-  }
-
-  typename std::vector<T>::iterator it = vec.end();
-  it--;
-  vec.erase(it);
-}
-
 namespace Parser {
 
 struct VarTable {
  public:
   VarTable() = default;
 
-  void Enter() {
-    table_.push_back({});
+  // Leave the scopes deeper than `depth`.
+  void LeaveTo(size_t depth) {
+    assert(depth <= this->table_.size());
+    this->table_.resize(depth);
   }
 
-  void Leave() {
-    assert(!this->table_.empty());
-    VecRemoveLast(this->table_);
+  void Enter() {
+    table_.push_back({});
   }
 
-  auto Query(const std::string &var) const -> bool {
+  auto Query(Lex::Atom var) const -> bool {
     for (const auto &tb : this->table_) {
       if (tb.find(var) != tb.end()) {
         return true;
@@ -40,55 +33,45 @@ struct VarTable {
     return false;
   }
 
-  void Add(const std::string &var) {
+  void Add(Lex::Atom var) {
     this->table_.back().insert(var);
   }
 
  private:
-  std::vector<std::unordered_set<std::string> > table_;
+  std::vector<std::unordered_set<Lex::Atom> > table_;
 };
 
-static VarTable var_table;
-
-static size_t indent = 0;
-
-static auto PrintIndent(std::ostream &os) -> std::ostream & {
+static auto PrintIndent(std::ostream &os, size_t indent) -> std::ostream & {
   for (size_t i = 1; i < indent; i++)
     os << ' ';
   return os;
 }
 
-static auto PrintVars(BasicBlock *root, std::ostream &os) 
+// a scan of the flat tree. A node at depth d sees the scopes of its d
+// ancestors, and opens one for its children.
+static auto PrintVars(const FlatTree &tree, std::ostream &os) 
   -> std::ostream & {
-  
-  {
-    const auto &instr = root->GetInstrAsRef();
-    const auto vars = instr.GetVarNames();
+  VarTable var_table;
+  for (const auto id : tree.Nodes()) {
+    const size_t depth = tree.GetDepth(id);
+    // end of the blocks of the previous nodes.
+    var_table.LeaveTo(depth);
 
+    const auto vars = tree.GetVarNames(id);
     for (const auto &var: vars) {
-      PrintIndent(os);
+      PrintIndent(os, depth);
 
       if (var_table.Query(var)) {
 
       } else {
-        os << var << std::endl;
+        os << Lex::AtomText(var) << std::endl;
         var_table.Add(var);
       }
     }
-  }
 
-  indent ++;
-  var_table.Enter();
-
-  size_t num_children = root->GetNumChildren();
-  for (size_t i = 0; i < num_children; i++) {
-    PrintVars(root->GetChild(i), os);
+    var_table.Enter();
   }
 
-  // end of this block.
-  var_table.Leave();
-  indent --;
-
   return os;
 }
 
@@ -100,14 +83,11 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  auto fobj = ReadAll(argv[1]);
-  auto tokens = Lex::CLangTokenize(fobj, true);
-
-  // dump parser output for debugging
-  auto root = Parser::CLangParser(tokens);
-  PrintVars(root, std::cout);
+  FileSource fobj(argv[1]);
+  auto parsed = Parser::ParseSource(fobj.View());
+  const auto &root = parsed.tree;
+  PrintVars(Parser::FlatTree(root.get()), std::cout);
 
   std::cout << std::endl;
-  delete root;
   return 0;
 }